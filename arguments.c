@@ -23,9 +23,16 @@
 #include <sys/stat.h>
 
 #include "arguments.h"
+#include "hash.h"
 
 #define INIT_HELP_ALLOC 8
 
+/* Each tracer thread comes with a doorbell process; don't go overboard. */
+#define MAX_JOBS 256
+
+help *help_list;
+int help_list_count, help_list_allocated;
+
 /**
  * insert_help - inserts a line of help into the list
  * @arg:  the argument
@@ -34,7 +41,8 @@
 void insert_help(char *arg, char *desc, int num_vals) {
     if(help_list_count >= help_list_allocated) {
         help_list_allocated *= 2;
-        help_list = (help *)realloc(help_list, help_list_allocated);
+        help_list = (help *)realloc(help_list,
+                                   sizeof(help)*help_list_allocated);
     }
     strcpy(help_list[help_list_count].arg, arg);
     strcpy(help_list[help_list_count].desc, desc);
@@ -56,6 +64,25 @@ void build_help() {
     insert_help("-o", "logging output file (stderr by default)", 1);
     insert_help("-d", "debug output file (off by default)", 1);
     insert_help("-m", "print file to proxyfile map at the end", 0);
+    insert_help("-f", "only stop on filesystem syscalls (seccomp filter)", 0);
+    insert_help("-a", "proxy file name hash: murmur3 (default) or md5", 1);
+    insert_help("-j", "number of tracer threads (1 by default)", 1);
+    insert_help("-s", "directory to create the sandbox in (/tmp by default)", 1);
+    insert_help("-b", "backend: ptrace (default), seccomp or overlay", 1);
+#ifdef __amd64__
+    /* the shim makes its own syscalls, which is x86_64 code */
+    insert_help("-p", "preload a shim that handles most opens in-process", 0);
+#endif
+    insert_help("-u", "carry on with an existing sandbox directory", 1);
+    insert_help("-l", "read-only lower sandbox directory (repeatable)", 1);
+    insert_help("--stats", "print tracer statistics at the end", 0);
+    insert_help("--stats-json", "write tracer statistics to a JSON file", 1);
+    insert_help("--journal-sync", "fdatasync the journal every ARG ms", 1);
+    insert_help("--map", "write a sandbox's file-map from its journal", 1);
+    insert_help("--commit", "apply a sandbox's file writes, renames and "
+                            "deletes to the real files", 1);
+    insert_help("--daemon", "run sandboxes for --connect on a socket", 1);
+    insert_help("--connect", "have the daemon on a socket run the sandbox", 1);
 }
 
 /**
@@ -116,6 +143,103 @@ int help_requested(int argc, char **argv)
     return 1;
 }
 
+/**
+ * find_arg - find an argument that comes before the child's
+ * @argc: number of args given to the tracer
+ * @argv: argument list
+ * @arg:  the argument
+ *
+ * Returns its index, or -1 if it isn't there with a value after it.
+ */
+static int find_arg(int argc, char **argv, const char *arg)
+{
+    int i;
+    for(i = 1; i < argc - 1; i++) {
+        if(strcmp(argv[i], "--") == 0)
+            break;
+        if(strcmp(argv[i], arg) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * map_requested - determine if a file-map is to be written from a journal
+ * @argc: number of args given to the tracer
+ * @argv: argument list
+ *
+ * Returns the sandbox directory given with --map, or NULL.
+ */
+char *map_requested(int argc, char **argv)
+{
+    int i = find_arg(argc, argv, "--map");
+    return i < 0 ? NULL : argv[i + 1];
+}
+
+/**
+ * daemon_requested - determine if we're to run as a daemon
+ * @argc: number of args given to the tracer
+ * @argv: argument list
+ *
+ * Returns the socket given with --daemon, or NULL.
+ */
+char *daemon_requested(int argc, char **argv)
+{
+    int i = find_arg(argc, argv, "--daemon");
+    return i < 0 ? NULL : argv[i + 1];
+}
+
+/**
+ * connect_requested - determine if a daemon is to run the sandbox
+ * @argc: number of args given to the tracer; the two taken out come off it
+ * @argv: argument list; --connect and its socket are taken out
+ *
+ * The rest go to the daemon as they are.
+ *
+ * Returns the socket given with --connect, or NULL.
+ */
+char *connect_requested(int *argc, char **argv)
+{
+    int i = find_arg(*argc, argv, "--connect");
+    if(i < 0)
+        return NULL;
+
+    char *retval = argv[i + 1];
+    memmove(argv + i, argv + i + 2, (*argc - i - 2 + 1) * sizeof(char *));
+    *argc -= 2;
+    return retval;
+}
+
+/**
+ * commit_requested - determine if a sandbox is to be committed
+ * @argc: number of args given to the tracer
+ * @argv: argument list
+ * @jobs: set to the number of threads given with -j, if it is
+ *
+ * Returns the sandbox directory given with --commit, or NULL.
+ */
+char *commit_requested(int argc, char **argv, int *jobs)
+{
+    char *retval = NULL;
+
+    int i;
+    for(i = 1; i < argc - 1; i++) {
+        if(strcmp(argv[i], "--") == 0)
+            break;
+        if(strcmp(argv[i], "--commit") == 0)
+            retval = argv[i + 1];
+        if(strcmp(argv[i], "-j") == 0 &&
+           ((*jobs = atoi(argv[i + 1])) < 1 || *jobs > MAX_JOBS)) {
+            fprintf(stderr, "fssb: error: -j needs a number from 1 to %d\n",
+                            MAX_JOBS);
+            exit(1);
+        }
+    }
+
+    return retval;
+}
+
 /* comp function for qsort */
 int comp(const void *a, const void *b) {
     return strcmp(((help *)a)->arg, ((help *)b)->arg);
@@ -139,7 +263,8 @@ program but also protect your files and directories from modification.\n\n");
         int j;
         for(j = 0; j < help_list[i].num_vals; j++)
             fprintf(stdout, " ARG");
-        for(j = 0; j < 15 - 4*help_list[i].num_vals; j++)
+        int width = strlen(help_list[i].arg) + 4*help_list[i].num_vals;
+        for(j = 0; j < 17 - width || j < 1; j++)
             fprintf(stdout, " ");
         fprintf(stdout, "%s\n", help_list[i].desc);
     }
@@ -179,42 +304,159 @@ FILE *get_log_file_obj(int argc, char **argv, int i)
     return retval;
 }
 
+/**
+ * get_sandbox_root - returns the directory to create the sandbox in
+ * @argc: number of arguments
+ * @argv: argument list
+ * @i:    index of the flag
+ *
+ * The path is made absolute since the child gets handed paths in there from
+ * wherever its working directory is.  Putting the sandbox on the same
+ * filesystem as the files being changed lets them be copied up as reflinks.
+ *
+ * Note: this logs to stderr and exits with an error code 1 if the given
+ * directory does not exist.
+ *
+ * Returns a (char *) pointer.
+ */
+char *get_sandbox_root(int argc, char **argv, int i)
+{
+    if(i == argc - 1) {
+        fprintf(stderr, "fssb: error: no sandbox directory specified\n");
+        exit(1);
+    }
+
+    struct stat sb;
+    char *retval = realpath(argv[i + 1], NULL);
+    if(retval == NULL || stat(retval, &sb) || !S_ISDIR(sb.st_mode)) {
+        fprintf(stderr, "fssb: error: %s is not a directory\n", argv[i + 1]);
+        exit(1);
+    }
+
+    return retval;
+}
+
 /**
  * set_parameters - reads the command line arguments and sets the values
  * @argc:     number of args given to the tracer
  * @argv:     argument list
- * @cleanup:  whether to cleanup all temp files at exit
- * @log_file: file to log all output to
+ * @opts:     filled in, with the defaults for whatever isn't given
  */
-void set_parameters(int argc,
-                    char **argv,
-                    int *cleanup,
-                    FILE **log_file,
-                    FILE **debug_file,
-                    int *print_map)
+void set_parameters(int argc, char **argv, fssb_options *opts)
 {
     /* default values */
-    *cleanup = 0;
-    *log_file = stdout;
-    *debug_file = fopen("/dev/null", "w");
-    *print_map = 0;
+    opts->cleanup = 0;
+    opts->log_file = stdout;
+    opts->debug_file = NULL;
+    opts->print_list = 0;
+    opts->use_seccomp = 0;
+    opts->hash_algo = HASH_MURMUR3;
+    opts->jobs = 1;
+    opts->sandbox_root = "/tmp";
+    opts->backend = BACKEND_PTRACE;
+    opts->preload = 0;
+    opts->print_stats = 0;
+    opts->stats_json = NULL;
+    opts->journal_sync = 0;
+    opts->resume_dir = NULL;
+    opts->lower_dirs = NULL;
+    opts->lower_count = 0;
 
     int i;
     for(i = 0; i < argc; i++) {
         if(strcmp(argv[i], "-r") == 0)
-            *cleanup = 1;
+            opts->cleanup = 1;
 
         if(strcmp(argv[i], "-m") == 0)
-            *print_map = 1;
+            opts->print_list = 1;
+
+        if(strcmp(argv[i], "-f") == 0)
+            opts->use_seccomp = 1;
+
+        if(strcmp(argv[i], "-p") == 0)
+            opts->preload = 1;
+
+        if(strcmp(argv[i], "--stats") == 0)
+            opts->print_stats = 1;
+
+        if(strcmp(argv[i], "--stats-json") == 0) {
+            if(i == argc - 1) {
+                fprintf(stderr, "fssb: error: no statistics file specified\n");
+                exit(1);
+            }
+            opts->stats_json = argv[i + 1];
+            i++;
+        }
+
+        if(strcmp(argv[i], "--journal-sync") == 0) {
+            if(i == argc - 1 || (opts->journal_sync = atoi(argv[i + 1])) < 1) {
+                fprintf(stderr, "fssb: error: --journal-sync needs a number "
+                                "of milliseconds\n");
+                exit(1);
+            }
+            i++;
+        }
 
         if(strcmp(argv[i], "-d") == 0) {
-            fclose(*debug_file);
-            *debug_file = get_log_file_obj(argc, argv, i);
+            opts->debug_file = get_log_file_obj(argc, argv, i);
+            i++;
+        }
+
+        if(strcmp(argv[i], "-a") == 0) {
+            if(i == argc - 1 ||
+               (opts->hash_algo = hash_algo_from_name(argv[i + 1])) == -1) {
+                fprintf(stderr, "fssb: error: unknown hash algorithm\n");
+                exit(1);
+            }
+            i++;
+        }
+
+        if(strcmp(argv[i], "-j") == 0) {
+            if(i == argc - 1 ||
+               (opts->jobs = atoi(argv[i + 1])) < 1 || opts->jobs > MAX_JOBS) {
+                fprintf(stderr, "fssb: error: -j needs a number from 1 to %d\n",
+                                MAX_JOBS);
+                exit(1);
+            }
+            i++;
+        }
+
+        if(strcmp(argv[i], "-s") == 0) {
+            opts->sandbox_root = get_sandbox_root(argc, argv, i);
+            i++;
+        }
+
+        if(strcmp(argv[i], "-u") == 0) {
+            opts->resume_dir = get_sandbox_root(argc, argv, i);
+            i++;
+        }
+
+        if(strcmp(argv[i], "-l") == 0) {
+            opts->lower_dirs = (char **)realloc(opts->lower_dirs,
+                                                (opts->lower_count + 1) *
+                                                sizeof(char *));
+            opts->lower_dirs[opts->lower_count++] =
+                get_sandbox_root(argc, argv, i);
+            i++;
+        }
+
+        if(strcmp(argv[i], "-b") == 0) {
+            if(i < argc - 1 && strcmp(argv[i + 1], "ptrace") == 0)
+                opts->backend = BACKEND_PTRACE;
+            else if(i < argc - 1 && strcmp(argv[i + 1], "seccomp") == 0)
+                opts->backend = BACKEND_SECCOMP;
+            else if(i < argc - 1 && strcmp(argv[i + 1], "overlay") == 0)
+                opts->backend = BACKEND_OVERLAY;
+            else {
+                fprintf(stderr, "fssb: error: -b needs ptrace, seccomp or "
+                                "overlay\n");
+                exit(1);
+            }
             i++;
         }
 
         if(strcmp(argv[i], "-o") == 0) {
-            *log_file = get_log_file_obj(argc, argv, i);
+            opts->log_file = get_log_file_obj(argc, argv, i);
             i++;
         }
     }
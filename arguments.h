@@ -20,8 +20,37 @@
 #ifndef _ARGUMENT_H
 #define _ARGUMENT_H
 
+#include <stdio.h>
+
+/* How the child's syscalls get to us (-b). */
+#define BACKEND_PTRACE  0
+#define BACKEND_SECCOMP 1
+#define BACKEND_OVERLAY 2
+
+/**
+ * fssb_options - what the command line asks a sandbox for
+ */
+typedef struct {
+    int cleanup;        /* -r: remove the sandbox at the end */
+    FILE *log_file;     /* -o: where the output goes */
+    FILE *debug_file;   /* -d: where debug output goes, or NULL */
+    int print_list;     /* -m: print the file map at the end */
+    int use_seccomp;    /* -f: only stop at filesystem syscalls */
+    int hash_algo;      /* -a: for the proxy file names */
+    int jobs;           /* -j: tracer threads */
+    char *sandbox_root; /* -s: where the sandbox directory goes */
+    int backend;        /* -b: BACKEND_PTRACE, _SECCOMP or _OVERLAY */
+    int preload;        /* -p: preload the shim into the child */
+    int print_stats;    /* --stats */
+    char *stats_json;   /* --stats-json: where to, or NULL */
+    int journal_sync;   /* --journal-sync: in ms, or 0 for never */
+    char *resume_dir;   /* -u: the sandbox to carry on, or NULL */
+    char **lower_dirs;  /* -l: the sandboxes underneath, topmost first */
+    int lower_count;
+} fssb_options;
+
 typedef struct {
-    char arg[3], desc[128];
+    char arg[16], desc[128];
     int num_vals;
 } help;
 
@@ -31,18 +60,21 @@ extern void check_args_validity(int argc, char **argv);
 
 extern int help_requested(int argc, char **argv);
 
+extern char *map_requested(int argc, char **argv);
+
+extern char *commit_requested(int argc, char **argv, int *jobs);
+
+extern char *daemon_requested(int argc, char **argv);
+
+extern char *connect_requested(int *argc, char **argv);
+
 extern void print_help();
 
-extern void set_parameters(int argc,
-                           char **argv,
-                           int *cleanup,
-                           FILE **log_file,
-                           FILE **debug_file,
-                           int *print_map);
+extern void set_parameters(int argc, char **argv, fssb_options *opts);
 
 extern int get_child_args_start_pos(int argc, char **argv);
 
-help *help_list;
-int help_list_count, help_list_allocated;
+extern help *help_list;
+extern int help_list_count, help_list_allocated;
 
 #endif /* _ARGUMENT_H */
@@ -0,0 +1,203 @@
+/**
+ * bench.c - Syscall micro-benchmarks.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage:
+ *
+ *   bench prepare DIR PATH_LEN
+ *       Make a file in DIR whose absolute path is about PATH_LEN long, and
+ *       print that path.  Run this outside fssb, so the file is a real one.
+ *
+ *   bench run OP PATH ITERS PROXIES
+ *       Write PROXIES files next to PATH (under fssb, that's PROXIES entries
+ *       in the index), then time ITERS rounds of OP on PATH and print the
+ *       nanoseconds per round.
+ *
+ * run_bench.sh runs it both ways and works out the overhead.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* directory names the path is padded out with */
+#define PAD_DIR "dddddddddddddddd"
+
+/**
+ * now - nanoseconds on the monotonic clock
+ */
+static long now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * die - say what went wrong and exit
+ * @what: what we were doing
+ */
+static void die(const char *what)
+{
+    fprintf(stderr, "bench: cannot %s\n", what);
+    exit(1);
+}
+
+/**
+ * prepare - make the file the benchmarks work on
+ * @dir:      the directory to make it in
+ * @path_len: about how long its absolute path should be
+ */
+static int prepare(const char *dir, int path_len)
+{
+    char path[PATH_MAX];
+    if(!realpath(dir, path))
+        die("find the directory");
+
+    /* "/target" has to fit at the end */
+    while(strlen(path) + strlen("/" PAD_DIR) + strlen("/target") <=
+          (size_t)path_len) {
+        strcat(path, "/" PAD_DIR);
+        if(mkdir(path, 0755) != 0 && access(path, F_OK) != 0)
+            die("make the directories");
+    }
+
+    strcat(path, "/target");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || write(fd, "bench\n", 6) != 6)
+        die("make the target");
+    close(fd);
+
+    printf("%s\n", path);
+    return 0;
+}
+
+/**
+ * make_file - create a small file
+ * @path: where
+ */
+static void make_file(const char *path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        die("create a file");
+    close(fd);
+}
+
+/**
+ * run - time one operation
+ * @op:      the operation
+ * @path:    the file it works on
+ * @iters:   how many times
+ * @proxies: how many other files to write first
+ */
+static int run(const char *op, const char *path, long iters, long proxies)
+{
+    char name[PATH_MAX], other[PATH_MAX];
+    long i;
+
+    for(i = 0; i < proxies; i++) {
+        snprintf(name, sizeof(name), "%s.p%ld", path, i);
+        make_file(name);
+    }
+
+    /* what unlink and rename work on has to be there already */
+    if(strcmp(op, "unlink") == 0)
+        for(i = 0; i < iters; i++) {
+            snprintf(name, sizeof(name), "%s.u%ld", path, i);
+            make_file(name);
+        }
+
+    snprintf(name, sizeof(name), "%s.a", path);
+    snprintf(other, sizeof(other), "%s.b", path);
+    if(strcmp(op, "rename") == 0)
+        make_file(name);
+
+    char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(dirfd < 0)
+        die("open the directory");
+
+    struct stat sb;
+    long start = now();
+
+    if(strcmp(op, "open_close") == 0)
+        for(i = 0; i < iters; i++)
+            close(open(path, O_RDONLY));
+    else if(strcmp(op, "openat") == 0)
+        for(i = 0; i < iters; i++)
+            close(openat(dirfd, slash + 1, O_RDONLY));
+    else if(strcmp(op, "stat") == 0)
+        for(i = 0; i < iters; i++)
+            stat(path, &sb);
+    else if(strcmp(op, "access") == 0)
+        for(i = 0; i < iters; i++)
+            access(path, R_OK);
+    else if(strcmp(op, "unlink") == 0) {
+        /* the names are made up front so only the unlink is timed */
+        char **names = (char **)malloc(iters * sizeof(char *));
+        for(i = 0; i < iters; i++) {
+            snprintf(name, sizeof(name), "%s.u%ld", path, i);
+            names[i] = strdup(name);
+        }
+
+        start = now();
+        for(i = 0; i < iters; i++)
+            unlink(names[i]);
+    }
+    else if(strcmp(op, "rename") == 0)
+        for(i = 0; i < iters; i++) {
+            if(i % 2 == 0)
+                rename(name, other);
+            else
+                rename(other, name);
+        }
+    else {
+        fprintf(stderr, "bench: unknown operation %s\n", op);
+        return 1;
+    }
+
+    long elapsed = now() - start;
+    printf("%.1f\n", (double)elapsed / iters);
+
+    close(dirfd);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 4 && strcmp(argv[1], "prepare") == 0)
+        return prepare(argv[2], atoi(argv[3]));
+
+    if(argc == 6 && strcmp(argv[1], "run") == 0)
+        return run(argv[2], argv[3], atol(argv[4]), atol(argv[5]));
+
+    fprintf(stderr, "usage: bench prepare DIR PATH_LEN\n"
+                    "       bench run OP PATH ITERS PROXIES\n");
+    return 1;
+}
@@ -0,0 +1,259 @@
+#!/usr/bin/env python3
+"""
+End-to-end benchmarks: real workloads, natively and under each fssb engine.
+
+Every workload makes its own fixture, so nothing here needs the network:
+
+    build   - compile a generated C project with make -j
+    git     - git status and git checkout on a generated repo
+    python  - import a generated package of many small modules
+    tar     - extract a generated tarball
+
+Each run starts from a fresh copy of the fixture at the same path, so the
+engines all see the same thing and their file-maps can be compared.  For
+every run, one CSV line goes to stdout:
+
+    workload,engine,wall_s,child_cpu_s,tracer_cpu_s,stops,wall_overhead,map
+
+where map is "same" if the paths in the file-map match those of the first
+engine, and "differs" if not (the differences go to stderr).  A run that
+exits non-zero is "failed" and isn't compared; macro.py then exits with 1
+once it's done.
+
+Usage: macro.py [--engines ptrace,filter,...] [--workloads build,...]
+                [--scale N]
+"""
+
+from __future__ import print_function
+import os
+import sys
+import json
+import time
+import shutil
+import tarfile
+import argparse
+import subprocess
+
+
+FSSB = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', 'fssb'))
+WORK_DIR = '/tmp/fssb-macro'
+
+# engine name -> fssb flags; None is native
+ENGINES = [
+    ('native', None),
+    ('ptrace', []),
+    ('filter', ['-f']),
+    ('seccomp', ['-b', 'seccomp']),
+    ('preload', ['-p']),
+    ('overlay', ['-b', 'overlay']),
+]
+
+
+def write(path, text):
+    d = os.path.dirname(path)
+    if not os.path.isdir(d):
+        os.makedirs(d)
+    with open(path, 'w') as f:
+        f.write(text)
+
+
+def setup_build(fixture, scale):
+    n = 50 * scale
+    for i in range(n):
+        write(os.path.join(fixture, 'src', 'f%d.c' % i),
+              'int f%d(int x) { int i, s = 0; '
+              'for(i = 0; i < x; i++) s += i * %d; return s; }\n' % (i, i))
+    calls = ''.join('    s += f%d(argc);\n' % i for i in range(n))
+    decls = ''.join('int f%d(int);\n' % i for i in range(n))
+    write(os.path.join(fixture, 'src', 'main.c'),
+          decls + 'int main(int argc, char **argv) {\n    int s = 0;\n' +
+          calls + '    return s & 1;\n}\n')
+    write(os.path.join(fixture, 'Makefile'),
+          'objs = $(patsubst src/%.c,obj/%.o,$(wildcard src/*.c))\n'
+          'prog: $(objs)\n\tcc -o prog $(objs)\n'
+          'obj/%.o: src/%.c\n\t@mkdir -p obj\n\tcc -O1 -c -o $@ $<\n')
+    return ['make', '-s', '-j4']
+
+
+def setup_git(fixture, scale):
+    n = 500 * scale
+    env = dict(os.environ, GIT_AUTHOR_NAME='bench', GIT_AUTHOR_EMAIL='b@b',
+               GIT_COMMITTER_NAME='bench', GIT_COMMITTER_EMAIL='b@b')
+
+    def git(*args):
+        subprocess.check_call(['git'] + list(args), cwd=fixture, env=env,
+                              stdout=subprocess.DEVNULL)
+
+    for i in range(n):
+        write(os.path.join(fixture, 'd%d' % (i % 20), 'f%d.txt' % i),
+              'file %d\n' % i)
+    git('init', '-q')
+    git('add', '.')
+    git('commit', '-q', '-m', 'first')
+    for i in range(0, n, 10):
+        write(os.path.join(fixture, 'd%d' % (i % 20), 'f%d.txt' % i),
+              'file %d, changed\n' % i)
+    git('commit', '-q', '-a', '-m', 'second')
+    return ['sh', '-c', 'git status --porcelain >/dev/null && '
+                        'git checkout -q HEAD~1 && '
+                        'git status --porcelain >/dev/null']
+
+
+def setup_python(fixture, scale):
+    n = 200 * scale
+    pkg = os.path.join(fixture, 'storm')
+    for i in range(n):
+        write(os.path.join(pkg, 'm%d.py' % i),
+              'import os\nVALUE = %d\n\ndef get():\n    return VALUE\n' % i)
+    write(os.path.join(pkg, '__init__.py'),
+          ''.join('from . import m%d\n' % i for i in range(n)))
+    return [sys.executable, '-c', 'import storm']
+
+
+def setup_tar(fixture, scale):
+    n = 500 * scale
+    tree = os.path.join(WORK_DIR, 'tree')
+    for i in range(n):
+        write(os.path.join(tree, 'd%d' % (i % 20), 'f%d.txt' % i),
+              'file %d\n' % i * 20)
+    if not os.path.isdir(fixture):
+        os.makedirs(fixture)
+    with tarfile.open(os.path.join(fixture, 'files.tar'), 'w') as tar:
+        tar.add(tree, arcname='tree')
+    shutil.rmtree(tree)
+    os.makedirs(os.path.join(fixture, 'out'))
+    return ['tar', '-xf', 'files.tar', '-C', 'out']
+
+
+WORKLOADS = [
+    ('build', setup_build),
+    ('git', setup_git),
+    ('python', setup_python),
+    ('tar', setup_tar),
+]
+
+
+def run_native(argv, cwd):
+    start = time.time()
+    proc = subprocess.Popen(argv, cwd=cwd, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.time() - start
+    return {'wall': wall, 'child_cpu': usage.ru_utime + usage.ru_stime,
+            'tracer_cpu': 0.0, 'stops': 0, 'map': None,
+            'status': os.waitstatus_to_exitcode(status)}
+
+
+def run_fssb(flags, argv, cwd):
+    stats = os.path.join(WORK_DIR, 'stats.json')
+    if os.path.exists(stats):
+        os.remove(stats)
+
+    start = time.time()
+    proc = subprocess.Popen([FSSB] + flags + ['--stats-json', stats, '--'] +
+                            argv, cwd=cwd, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, universal_newlines=True)
+    _, err = proc.communicate()
+    wall = time.time() - start
+
+    sandbox = None
+    for line in err.splitlines():
+        if line.startswith('fssb: sandbox directory: '):
+            sandbox = line.split(': ', 2)[2]
+        elif 'not available' in line:  # it fell back to another engine
+            sys.stderr.write(line + '\n')
+
+    # a run that failed early may not have got as far as the statistics
+    s = {'child_cpu_s': 0.0, 'tracer_cpu_s': 0.0, 'syscalls': []}
+    if os.path.exists(stats):
+        with open(stats) as f:
+            s = json.load(f)
+
+    paths = set()
+    if sandbox:
+        map_path = os.path.join(sandbox, 'file-map')
+        if os.path.exists(map_path):
+            with open(map_path) as f:
+                for line in f:
+                    paths.add(line.rstrip('\n').split(' = ', 1)[1])
+        shutil.rmtree(sandbox)
+
+    return {'wall': wall, 'child_cpu': s['child_cpu_s'],
+            'tracer_cpu': s['tracer_cpu_s'],
+            'stops': sum(c['stops'] for c in s['syscalls']), 'map': paths,
+            'status': proc.returncode}
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--engines',
+                        default=','.join(name for name, _ in ENGINES))
+    parser.add_argument('--workloads',
+                        default=','.join(name for name, _ in WORKLOADS))
+    parser.add_argument('--scale', type=int, default=1)
+    args = parser.parse_args()
+
+    engines = [e for e in ENGINES if e[0] in args.engines.split(',')]
+    workloads = [w for w in WORKLOADS if w[0] in args.workloads.split(',')]
+
+    print('workload,engine,wall_s,child_cpu_s,tracer_cpu_s,stops,'
+          'wall_overhead,map')
+
+    failures = 0
+    fixture = os.path.join(WORK_DIR, 'fixture')
+    run_dir = os.path.join(WORK_DIR, 'run')
+
+    for name, setup in workloads:
+        shutil.rmtree(WORK_DIR, ignore_errors=True)
+        argv = setup(fixture, args.scale)
+
+        native_wall = None
+        first_map = None
+        for engine, flags in engines:
+            shutil.rmtree(run_dir, ignore_errors=True)
+            shutil.copytree(fixture, run_dir, symlinks=True)
+
+            if flags is None:
+                r = run_native(argv, run_dir)
+                native_wall = r['wall']
+            else:
+                r = run_fssb(flags, argv, run_dir)
+
+            same = '-'
+            if r['status'] != 0:
+                # its numbers and map are no use, and nothing to compare to
+                sys.stderr.write('%s: %s: exited with %d\n' %
+                                 (name, engine, r['status']))
+                same = 'failed'
+                failures += 1
+            elif r['map'] is not None:
+                if first_map is None:
+                    first_map = r['map']
+                    same = 'same'
+                elif r['map'] == first_map:
+                    same = 'same'
+                else:
+                    same = 'differs'
+                    for p in sorted(first_map - r['map']):
+                        sys.stderr.write('%s: %s: missing %s\n' %
+                                         (name, engine, p))
+                    for p in sorted(r['map'] - first_map):
+                        sys.stderr.write('%s: %s: extra %s\n' %
+                                         (name, engine, p))
+
+            overhead = ''
+            if native_wall:
+                overhead = '%.2f' % (r['wall'] / native_wall)
+
+            print('%s,%s,%.3f,%.3f,%.3f,%d,%s,%s' %
+                  (name, engine, r['wall'], r['child_cpu'], r['tracer_cpu'],
+                   r['stops'], overhead, same))
+            sys.stdout.flush()
+
+    shutil.rmtree(WORK_DIR, ignore_errors=True)
+
+    if failures:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Times each operation natively and under fssb, for a few path lengths and
+# index sizes, and prints one CSV line per case.  Any of these can be set
+# from the environment, e.g. PROXIES="0 1000" make bench.
+FSSB=${FSSB:-../fssb}
+FSSB_FLAGS=${FSSB_FLAGS:--f}
+ITERS=${ITERS:-20000}
+OPS=${OPS:-"open_close openat stat access unlink rename"}
+PATH_LENS=${PATH_LENS:-"32 256"}
+PROXIES=${PROXIES:-"0 1000 100000"}
+WORK_DIR=${WORK_DIR:-/tmp/fssb-bench}
+
+# a fresh target, made outside fssb so it's a real file
+prepare() {
+	rm -rf -- "$WORK_DIR"
+	mkdir -p -- "$WORK_DIR"
+	./bench prepare "$WORK_DIR" $1
+}
+
+echo "op,path_len,proxies,native_ns_per_op,fssb_ns_per_op,overhead"
+
+for len in $PATH_LENS
+do
+	for proxies in $PROXIES
+	do
+		for op in $OPS
+		do
+			target=$(prepare $len)
+			native=$(./bench run $op "$target" $ITERS $proxies)
+
+			target=$(prepare $len)
+			sandboxed=$($FSSB $FSSB_FLAGS -r -- \
+			            ./bench run $op "$target" $ITERS $proxies 2>/dev/null)
+
+			overhead=$(awk -v n="$native" -v s="$sandboxed" \
+			           'BEGIN { if(n > 0 && s > 0) printf "%.2f", s / n }')
+			echo "$op,$len,$proxies,$native,$sandboxed,$overhead"
+		done
+	done
+done
+
+rm -rf -- "$WORK_DIR"
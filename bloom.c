@@ -0,0 +1,120 @@
+/**
+ * bloom.c - Counting Bloom filter.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bloom.h"
+
+#define COUNTER_MAX 255
+
+/**
+ * new_bloom - creates a new, empty Bloom filter
+ * @size: number of counters, a power of two
+ *
+ * Returns a (bloom *) pointer.
+ */
+bloom *new_bloom(unsigned long size)
+{
+    bloom *retval = (bloom *)malloc(sizeof(bloom));
+
+    retval->counters = (unsigned char *)calloc(size, 1);
+    retval->mask = size - 1;
+    retval->retired = NULL;
+
+    return retval;
+}
+
+/**
+ * free_bloom - free a Bloom filter
+ * @b: the filter
+ */
+void free_bloom(bloom *b)
+{
+    free(b->counters);
+    free(b);
+}
+
+/**
+ * probe - get the position of the nth counter for a digest
+ * @b:      the filter
+ * @digest: the digest
+ * @n:      which probe
+ *
+ * The digest is already well mixed, so its 32-bit words serve as the
+ * independent hashes.
+ */
+static inline unsigned long probe(bloom *b, const unsigned char *digest, int n)
+{
+    uint32_t h;
+    memcpy(&h, digest + 4*n, sizeof(h));
+    return h & b->mask;
+}
+
+/**
+ * bloom_add - add a digest to the filter
+ * @b:      the filter
+ * @digest: the digest
+ *
+ * Readers don't lock, so this can run alongside bloom_maybe; writers must be
+ * serialised by the caller.
+ */
+void bloom_add(bloom *b, const unsigned char *digest)
+{
+    int n;
+    for(n = 0; n < BLOOM_PROBES; n++) {
+        unsigned char *c = &b->counters[probe(b, digest, n)];
+        if(*c < COUNTER_MAX)
+            __atomic_store_n(c, *c + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * bloom_remove - take a digest added before out of the filter
+ * @b:      the filter
+ * @digest: the digest
+ */
+void bloom_remove(bloom *b, const unsigned char *digest)
+{
+    int n;
+    for(n = 0; n < BLOOM_PROBES; n++) {
+        unsigned char *c = &b->counters[probe(b, digest, n)];
+        if(*c < COUNTER_MAX) /* a stuck counter doesn't know its count */
+            __atomic_store_n(c, *c - 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * bloom_maybe - check whether a digest may have been added
+ * @b:      the filter
+ * @digest: the digest
+ *
+ * Returns 0 if the digest is definitely not in the filter, 1 if it may be.
+ */
+int bloom_maybe(bloom *b, const unsigned char *digest)
+{
+    int n;
+    for(n = 0; n < BLOOM_PROBES; n++)
+        if(!__atomic_load_n(&b->counters[probe(b, digest, n)], __ATOMIC_ACQUIRE))
+            return 0;
+
+    return 1;
+}
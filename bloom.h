@@ -0,0 +1,53 @@
+/**
+ * bloom.h - Counting Bloom filter.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include "hash.h"
+
+/* Number of counters a digest maps to. */
+#define BLOOM_PROBES 4
+
+/**
+ * bloom - a counting Bloom filter over path digests
+ *
+ * A counter per position instead of a bit, so that entries can be taken out
+ * again.  Counters that overflow stick at the maximum and are never
+ * decremented, which only costs a few false positives.
+ */
+typedef struct bloom {
+    unsigned char *counters;
+    unsigned long mask; /* number of counters - 1, a power of two */
+
+    struct bloom *retired; /* for the owner to chain replaced filters on */
+} bloom;
+
+extern bloom *new_bloom(unsigned long size);
+
+extern void free_bloom(bloom *b);
+
+extern void bloom_add(bloom *b, const unsigned char *digest);
+
+extern void bloom_remove(bloom *b, const unsigned char *digest);
+
+extern int bloom_maybe(bloom *b, const unsigned char *digest);
+
+#endif /* _BLOOM_H */
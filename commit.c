@@ -0,0 +1,393 @@
+/**
+ * commit.c - Applying a sandbox to the real files.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "commit.h"
+#include "journal.h"
+#include "copyup.h"
+
+/* what's to be done to one path */
+typedef struct {
+    journal_entry *e;
+    int deleted;
+    int dir; /* a directory the sandbox made */
+} change;
+
+/**
+ * commit_job - what the commit threads share
+ *
+ * Each takes the next change there is until there are none left, so a few
+ * big files don't hold up the rest.
+ */
+typedef struct {
+    char *SANDBOX_DIR;
+    change *changes;
+    int count;
+    int next;
+    int failed;
+    int applying; /* 0 while checking, 1 while applying */
+} commit_job;
+
+/**
+ * mtime_ns - a file's modification time in nanoseconds
+ * @sb: its stat
+ */
+static int64_t mtime_ns(struct stat *sb)
+{
+    return sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+}
+
+/**
+ * check_parent - make sure there's somewhere to put a path
+ * @file_path: the path
+ *
+ * Its parent needn't be there, as committing makes what's missing, but the
+ * nearest thing up the path that is there has to be a directory.
+ *
+ * Returns 0 if so, -1 if not.
+ */
+static int check_parent(const char *file_path)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", file_path);
+
+    struct stat sb;
+    char *slash;
+    while((slash = strrchr(path, '/')) != NULL && slash != path) {
+        *slash = '\0';
+        if(stat(path, &sb) == 0) {
+            if(S_ISDIR(sb.st_mode))
+                return 0;
+            fprintf(stderr, "fssb: conflict: %s is in the way of %s\n",
+                            path, file_path);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * make_parents - make the directories a path needs, as mkdir -p does
+ * @file_path: the path
+ *
+ * Those the sandbox made were made first, with their own modes; these are
+ * the ones it found there and that have gone since.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int make_parents(const char *file_path)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", file_path);
+
+    char *slash;
+    for(slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if(mkdir(path, 0777) && errno != EEXIST) {
+            fprintf(stderr, "fssb: error: cannot make %s\n", path);
+            return -1;
+        }
+        *slash = '/';
+    }
+
+    return 0;
+}
+
+/**
+ * make_dir - make a directory the sandbox made
+ * @e: its JOURNAL_DIR, with the mode in @suffix
+ *
+ * One that's there already is left as it is.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int make_dir(journal_entry *e)
+{
+    if(make_parents(e->path))
+        return -1;
+
+    if(mkdir(e->path, e->suffix)) {
+        if(errno == EEXIST)
+            return 0;
+        fprintf(stderr, "fssb: error: cannot make %s\n", e->path);
+        return -1;
+    }
+
+    /* past the umask */
+    chmod(e->path, e->suffix);
+    return 0;
+}
+
+/**
+ * make_dirs - make every directory the sandbox made
+ * @r: the journal's replay
+ *
+ * This goes one at a time, in the order they were made, so that parents
+ * come before their children.
+ *
+ * Returns how many of them failed.
+ */
+static int make_dirs(journal_replay *r)
+{
+    int i, failed = 0;
+    for(i = 0; i < r->dir_count; i++)
+        if(make_dir(r->dirs[i]))
+            failed++;
+
+    return failed;
+}
+
+/**
+ * check_change - make sure a path hasn't changed behind the sandbox's back
+ * @c: the change
+ *
+ * A file the sandbox saw has to be the same one (by inode and mtime) still;
+ * a file it made mustn't have been made outside of it since.  Both go by
+ * the path itself, so a symlink is checked as the link.  The sandbox keeps
+ * what was written through one at the link's path, and can't tell whether
+ * the link or its target was meant, so that's left for the user to sort
+ * out.  A directory it made can be there already, as long as it's a
+ * directory.  Whatever's made needs somewhere to go, as check_parent has
+ * it.
+ *
+ * Returns 0 if the change can go ahead, -1 if not.
+ */
+static int check_change(change *c)
+{
+    journal_entry *e = c->e;
+    struct stat sb;
+    int exists = !lstat(e->path, &sb);
+
+    if(!c->deleted && check_parent(e->path))
+        return -1;
+
+    if(c->dir) {
+        if(exists && !S_ISDIR(sb.st_mode)) {
+            fprintf(stderr, "fssb: conflict: %s was made outside the "
+                            "sandbox\n", e->path);
+            return -1;
+        }
+        return 0;
+    }
+
+    if(exists && !c->deleted && S_ISLNK(sb.st_mode)) {
+        fprintf(stderr, "fssb: conflict: %s is a symlink; the sandbox's "
+                        "copy can't be committed through it\n", e->path);
+        return -1;
+    }
+
+    if(e->ino || e->mtime_ns) {
+        if(!exists || sb.st_ino != e->ino || mtime_ns(&sb) != e->mtime_ns) {
+            fprintf(stderr, "fssb: conflict: %s has changed since the "
+                            "sandbox saw it\n", e->path);
+            return -1;
+        }
+    }
+    else if(exists && !c->deleted) {
+        fprintf(stderr, "fssb: conflict: %s was made outside the sandbox\n",
+                        e->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * apply_change - make one of the sandbox's changes to the real file
+ * @SANDBOX_DIR: the sandbox directory
+ * @c:           the change
+ * @i:           its index, to keep temporary names apart
+ *
+ * The proxy file is copied next to the real one and renamed over it, so
+ * the real file is always either the old one or the new one in full.
+ * Deleting one the sandbox never saw is nothing to do.  The directories it
+ * made are there by now; make_parents makes any others that are missing.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int apply_change(char *SANDBOX_DIR, change *c, int i)
+{
+    journal_entry *e = c->e;
+
+    if(c->dir) /* make_dirs has made it */
+        return 0;
+
+    if(c->deleted) {
+        if((e->ino || e->mtime_ns) && unlink(e->path) && errno != ENOENT) {
+            fprintf(stderr, "fssb: error: cannot delete %s\n", e->path);
+            return -1;
+        }
+        return 0;
+    }
+
+    char name[2*DIGEST_LEN + 12], proxy_path[PATH_MAX], tmp_path[PATH_MAX];
+    hex_digest(e->digest, name);
+    if(e->suffix)
+        sprintf(name + 2*DIGEST_LEN, "-%d", e->suffix);
+    snprintf(proxy_path, sizeof(proxy_path), "%s%s", SANDBOX_DIR, name);
+
+    /* the open it was made for failed, so there's nothing to it */
+    struct stat sb;
+    if(lstat(proxy_path, &sb))
+        return 0;
+
+    if(make_parents(e->path))
+        return -1;
+
+    char *slash = strrchr(e->path, '/');
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s/.fssb-%d-%d",
+             (int)(slash - e->path), e->path, (int)getpid(), i);
+
+    /* copy_up works just as well the other way */
+    if(copy_up(proxy_path, tmp_path, 0, NULL) != 1) {
+        fprintf(stderr, "fssb: error: cannot copy %s to %s\n", proxy_path,
+                        e->path);
+        return -1;
+    }
+
+    /* the new file takes over from the old one as far as it can */
+    if(!lstat(e->path, &sb) &&
+       (sb.st_uid != geteuid() || sb.st_gid != getegid()))
+        chown(tmp_path, sb.st_uid, sb.st_gid);
+
+    if(rename(tmp_path, e->path)) {
+        fprintf(stderr, "fssb: error: cannot replace %s\n", e->path);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * commit_thread - work through changes until there are none left
+ * @arg: the commit_job
+ */
+static void *commit_thread(void *arg)
+{
+    commit_job *job = (commit_job *)arg;
+
+    int i;
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+          job->count) {
+        change *c = &job->changes[i];
+        if(job->applying ? apply_change(job->SANDBOX_DIR, c, i)
+                         : check_change(c))
+            __atomic_add_fetch(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/**
+ * run_all - run through every change with a pool of threads
+ * @job:      the commit_job
+ * @jobs:     how many threads
+ * @applying: 0 to check each change, 1 to apply it
+ *
+ * Returns how many of them failed.
+ */
+static int run_all(commit_job *job, int jobs, int applying)
+{
+    job->next = 0;
+    job->failed = 0;
+    job->applying = applying;
+
+    if(jobs > job->count)
+        jobs = job->count;
+
+    pthread_t *threads = (pthread_t *)malloc((jobs + 1) * sizeof(pthread_t));
+    int i;
+    for(i = 1; i < jobs; i++)
+        pthread_create(&threads[i], NULL, commit_thread, job);
+    commit_thread(job);
+    for(i = 1; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    return job->failed;
+}
+
+/**
+ * commit_sandbox - make a sandbox's changes to the real files
+ * @SANDBOX_DIR: the sandbox directory
+ * @jobs:        how many threads to copy with
+ *
+ * Every file the sandbox wrote replaces the real one, and every one it
+ * deleted is deleted, as the journal has it.  The directories it made are
+ * made before anything goes in them.  If any real file has changed
+ * since the sandbox saw it, nothing is done at all.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int commit_sandbox(char *SANDBOX_DIR, int jobs)
+{
+    journal_replay r;
+    if(replay_journal(SANDBOX_DIR, &r) != 0)
+        return -1;
+
+    commit_job job;
+    job.SANDBOX_DIR = SANDBOX_DIR;
+    job.count = r.count + r.deleted_count + r.dir_count;
+    job.changes = (change *)calloc(job.count + 1, sizeof(change));
+
+    int i, deletions = 0;
+    for(i = 0; i < r.count; i++)
+        job.changes[i].e = r.entries[i];
+    for(i = 0; i < r.deleted_count; i++) {
+        job.changes[r.count + i].e = r.deleted[i];
+        job.changes[r.count + i].deleted = 1;
+        if(r.deleted[i]->ino || r.deleted[i]->mtime_ns)
+            deletions++;
+    }
+    for(i = 0; i < r.dir_count; i++) {
+        job.changes[r.count + r.deleted_count + i].e = r.dirs[i];
+        job.changes[r.count + r.deleted_count + i].dir = 1;
+    }
+
+    int retval = 0, failed;
+    if((failed = run_all(&job, jobs, 0)) != 0) {
+        fprintf(stderr, "fssb: error: %d conflicts; nothing was committed\n",
+                        failed);
+        retval = -1;
+    }
+    else if((failed = make_dirs(&r)) != 0 ||
+            (failed = run_all(&job, jobs, 1)) != 0) {
+        fprintf(stderr, "fssb: error: %d changes couldn't be committed\n",
+                        failed);
+        retval = -1;
+    }
+    else
+        fprintf(stderr, "fssb: committed %d files, %d directories and %d "
+                        "deletions\n", r.count, r.dir_count, deletions);
+
+    free(job.changes);
+    free_replay(&r);
+
+    return retval;
+}
@@ -0,0 +1,143 @@
+/**
+ * copyup.c - Copying files up into the sandbox.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "copyup.h"
+
+#define COPY_BUF_SIZE 65536
+
+/**
+ * copy_data - copy the contents of one file into another
+ * @in:   fd to read from
+ * @out:  fd to write to
+ * @size: number of bytes to copy
+ *
+ * copy_file_range keeps the data in the kernel (and lets filesystems that
+ * can share extents do so), but it may refuse, say across filesystems on an
+ * older kernel; then we do it the old-fashioned way.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int copy_data(int in, int out, off_t size)
+{
+    off_t done = 0;
+
+    while(done < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+        if(n <= 0)
+            break;
+        done += n;
+    }
+
+    if(done == size)
+        return 0;
+
+    /* pick up wherever copy_file_range left off */
+    char buf[COPY_BUF_SIZE];
+    if(lseek(in, done, SEEK_SET) < 0 || lseek(out, done, SEEK_SET) < 0)
+        return -1;
+
+    ssize_t n;
+    while((n = read(in, buf, sizeof(buf))) > 0) {
+        ssize_t written = 0;
+        while(written < n) {
+            ssize_t w = write(out, buf + written, n - written);
+            if(w < 0)
+                return -1;
+            written += w;
+        }
+    }
+
+    return n < 0 ? -1 : 0;
+}
+
+/**
+ * copy_up - give a proxy file the contents of the file it stands in for
+ * @file_path:  the real file
+ * @proxy_path: its proxy file
+ * @truncate:   the file is about to be truncated, so skip the contents
+ * @sb:         filled in with the real file's lstat, if it's not NULL; for
+ *              a symlink, that's the link's own and not its target's
+ *
+ * This is what lets a sandboxed process append to or edit an existing file.
+ * When the sandbox is on the same filesystem and it supports reflinks, the
+ * copy is a FICLONE that just shares the extents, so even a huge file costs
+ * next to nothing.  The mode and timestamps carry over either way.
+ *
+ * Returns 1 if the proxy file was created, 0 if there's no regular file at
+ * @file_path to copy, and -1 on failure.
+ */
+int copy_up(const char *file_path,
+            const char *proxy_path,
+            int truncate,
+            struct stat *sb)
+{
+    struct stat own, target;
+    if(!sb)
+        sb = &own;
+    if(lstat(file_path, sb))
+        return 0;
+
+    /* what's copied is what a write through it would have gone to */
+    target = *sb;
+    if(S_ISLNK(sb->st_mode) && stat(file_path, &target))
+        return 0;
+    if(!S_ISREG(target.st_mode))
+        return 0;
+
+    int in = -1;
+    if(!truncate) {
+        in = open(file_path, O_RDONLY | O_CLOEXEC);
+        if(in < 0)
+            return -1;
+    }
+
+    int out = open(proxy_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(out < 0) {
+        if(in >= 0)
+            close(in);
+        return -1;
+    }
+
+    int retval = 1;
+    if(in >= 0) {
+        if(ioctl(out, FICLONE, in) < 0 && copy_data(in, out, target.st_size) < 0)
+            retval = -1;
+        close(in);
+    }
+
+    struct timespec times[2] = {target.st_atim, target.st_mtim};
+    fchmod(out, target.st_mode & 07777);
+    futimens(out, times);
+
+    close(out);
+
+    if(retval < 0) /* don't leave half a file behind */
+        unlink(proxy_path);
+
+    return retval;
+}
@@ -0,0 +1,30 @@
+/**
+ * copyup.h - Copying files up into the sandbox.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COPYUP_H
+#define _COPYUP_H
+
+#include <sys/stat.h>
+
+extern int copy_up(const char *file_path,
+                   const char *proxy_path,
+                   int truncate,
+                   struct stat *sb);
+
+#endif /* _COPYUP_H */
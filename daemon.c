@@ -0,0 +1,465 @@
+/**
+ * daemon.c - Running sandboxes for clients.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE  /* for struct ucred */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "daemon.h"
+#include "hash.h"
+
+extern char **environ;
+
+/* No request is anywhere near this big; it's just not to be taken in. */
+#define MAX_REQUEST (16 << 20)
+
+/* Sandbox roots the daemon remembers the next free fssb-N of. */
+#define HINT_SLOTS 16
+
+/**
+ * request - what a client sends the daemon
+ *
+ * The client's stdin, stdout and stderr come along with it.  The current
+ * directory, the arguments and the environment follow, @size bytes of
+ * strings in that order, each with its terminator.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t argc, envc;
+    uint32_t size;
+} request;
+
+#define REQUEST_MAGIC "FSSBREQ1"
+
+typedef struct {
+    unsigned long root;
+    int next;
+} sandbox_hint_slot;
+
+/* shared by the daemon's sessions; NULL in a fssb of its own */
+static sandbox_hint_slot *hints;
+
+/* the session's connection to its client */
+static int session_conn = -1;
+
+/**
+ * sandbox_hint - where to start looking for a free fssb-N
+ * @root: the directory the sandbox goes in
+ *
+ * Every session of a daemon would otherwise step over all the sandboxes
+ * made before it.  Whatever this says, the mkdir has the last word, so
+ * sessions racing for a number only cost each other a step.
+ *
+ * Returns a pointer to the number to start from, to be set past the one
+ * taken, or NULL outside the daemon.
+ */
+int *sandbox_hint(const char *root)
+{
+    if(!hints)
+        return NULL;
+
+    unsigned char digest[DIGEST_LEN];
+    unsigned long key;
+    hash_digest(HASH_MURMUR3, root, strlen(root), digest);
+    memcpy(&key, digest, sizeof(key));
+
+    sandbox_hint_slot *slot = &hints[key % HINT_SLOTS];
+    if(__atomic_exchange_n(&slot->root, key, __ATOMIC_RELAXED) != key)
+        __atomic_store_n(&slot->next, 1, __ATOMIC_RELAXED);
+
+    return &slot->next;
+}
+
+/**
+ * exit_code - what to exit with for a program that ended with @status
+ * @status: its wait status
+ *
+ * Its own exit code, or 128 and the signal that killed it, as a shell has it.
+ */
+int exit_code(int status)
+{
+    if(WIFEXITED(status))
+        return WEXITSTATUS(status);
+    return 128 + WTERMSIG(status);
+}
+
+/**
+ * read_all - read exactly as much as asked for
+ * @fd:  where from
+ * @buf: where to
+ * @len: how much
+ *
+ * Returns 0 on success, -1 if it ran out first.
+ */
+static int read_all(int fd, char *buf, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * write_all - write a buffer out in full
+ * @fd:  where to
+ * @buf: what
+ * @len: how much
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * forward_signals - pass the client's signals on to the program
+ * @arg: unused
+ *
+ * The client sends a byte for each; if it goes away altogether, that's a
+ * hangup.  The session is in a process group of its own with the program,
+ * and only catches these, so it's the program they end.
+ */
+static void *forward_signals(void *arg)
+{
+    (void)arg;
+
+    unsigned char sig;
+    while(1) {
+        ssize_t n = read(session_conn, &sig, 1);
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        kill(0, n == 1 ? sig : SIGHUP);
+        if(n != 1)
+            return NULL;
+    }
+}
+
+/* caught rather than ignored, so the program doesn't inherit it */
+static void ignore_signal(int sig)
+{
+    (void)sig;
+}
+
+/**
+ * run_session - run one client's request, in a process of its own
+ * @conn: the connection to the client
+ * @run:  what runs a sandbox; it gets the client's arguments and returns
+ *        how the program ended
+ *
+ * This takes on the client's standard streams, directory and environment,
+ * so the sandbox runs just as if the client had run it.  The program's
+ * wait status goes back to the client at the end.
+ */
+static void run_session(int conn, int (*run)(int argc, char **argv))
+{
+    session_conn = conn;
+    signal(SIGCHLD, SIG_DFL);
+    setpgid(0, 0);
+
+    request req;
+    int fds[3];
+    struct iovec iov = { &req, sizeof(req) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cmsg;
+    if(recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != sizeof(req) ||
+       memcmp(req.magic, REQUEST_MAGIC, sizeof(req.magic)) != 0 ||
+       req.size > MAX_REQUEST || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+       cmsg->cmsg_type != SCM_RIGHTS ||
+       cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        exit(1);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    char *strings = (char *)malloc(req.size + 1);
+    if(read_all(conn, strings, req.size) != 0)
+        exit(1);
+    strings[req.size] = '\0';
+
+    /* cut it back up into the directory, arguments and environment */
+    char **argv = (char **)malloc((req.argc + 1) * sizeof(char *)),
+         **envp = (char **)malloc((req.envc + 1) * sizeof(char *));
+    char *p = strings, *end = strings + req.size;
+    char *cwd = p;
+    uint32_t i;
+    for(i = 0; i < req.argc + req.envc; i++) {
+        p += strlen(p) + 1;
+        if(p >= end)
+            exit(1);
+        if(i < req.argc)
+            argv[i] = p;
+        else
+            envp[i - req.argc] = p;
+    }
+    argv[req.argc] = NULL;
+    envp[req.envc] = NULL;
+
+    for(i = 0; i < 3; i++) {
+        if(fds[i] == (int)i)
+            continue;
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if(chdir(cwd) != 0) {
+        fprintf(stderr, "fssb: error: cannot change to %s\n", cwd);
+        exit(1);
+    }
+    environ = envp;
+
+    signal(SIGINT, ignore_signal);
+    signal(SIGTERM, ignore_signal);
+    signal(SIGHUP, ignore_signal);
+    signal(SIGQUIT, ignore_signal);
+
+    pthread_t forwarder;
+    pthread_create(&forwarder, NULL, forward_signals, NULL);
+
+    int status = run(req.argc, argv);
+    fflush(NULL);
+    write_all(conn, (char *)&status, sizeof(status));
+    exit(0);
+}
+
+/**
+ * run_daemon - serve sandboxes to clients on a socket (--daemon)
+ * @socket_path: where the socket goes
+ * @run:         what runs a sandbox, as for run_session
+ *
+ * Each client gets a process forked off this one, so a session starts out
+ * with fssb loaded and set up already, and any number can run side by
+ * side without getting in each other's way.  Only clients running as the
+ * same user are served.
+ *
+ * Returns only if the socket can't be set up, with 1.
+ */
+int run_daemon(char *socket_path, int (*run)(int argc, char **argv))
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "fssb: error: %s is too long for a socket\n",
+                        socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    /* one that's still answering is another daemon's */
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "fssb: error: a daemon is already on %s\n",
+                        socket_path);
+        return 1;
+    }
+    close(sock);
+    unlink(socket_path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0077);
+    int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if(bound != 0 || listen(sock, SOMAXCONN) != 0) {
+        fprintf(stderr, "fssb: error: cannot listen on %s\n", socket_path);
+        return 1;
+    }
+
+    hints = (sandbox_hint_slot *)mmap(NULL, HINT_SLOTS *
+                                            sizeof(sandbox_hint_slot),
+                                      PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(hints == MAP_FAILED)
+        hints = NULL;
+
+    /* the sessions see to themselves */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "fssb: listening on %s\n", socket_path);
+
+    while(1) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if(conn < 0)
+            continue;
+
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+           cred.uid != geteuid()) {
+            close(conn);
+            continue;
+        }
+
+        fflush(NULL);
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(sock);
+            signal(SIGPIPE, SIG_DFL);
+            run_session(conn, run);
+        }
+        else if(pid < 0)
+            fprintf(stderr, "fssb: error: cannot fork\n");
+
+        close(conn);
+    }
+}
+
+/* the client's connection, for its signal handler */
+static int client_conn;
+
+/* passes a signal on to the session; write is safe in a handler */
+static void send_signal(int sig)
+{
+    unsigned char byte = sig;
+    write(client_conn, &byte, 1);
+}
+
+/**
+ * run_client - have a daemon run the sandbox (--connect)
+ * @socket_path: the daemon's socket
+ * @argc:        number of args, without --connect and its socket
+ * @argv:        argument list, as fssb would take it
+ *
+ * Our standard streams, directory and environment go to the daemon, and
+ * the signals we get are passed on, so this stands in for running fssb
+ * itself.
+ *
+ * Returns the program's exit status, or 128 and the signal that killed it.
+ */
+int run_client(char *socket_path, int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "fssb: error: no daemon on %s\n", socket_path);
+        return 1;
+    }
+
+    char *cwd = getcwd(NULL, 0);
+    if(!cwd) {
+        fprintf(stderr, "fssb: error: cannot get the current directory\n");
+        return 1;
+    }
+
+    request req;
+    memcpy(req.magic, REQUEST_MAGIC, sizeof(req.magic));
+    req.argc = argc;
+    req.envc = 0;
+    req.size = strlen(cwd) + 1;
+
+    int i;
+    for(i = 0; i < argc; i++)
+        req.size += strlen(argv[i]) + 1;
+    for(i = 0; environ[i]; i++) {
+        req.size += strlen(environ[i]) + 1;
+        req.envc++;
+    }
+
+    char *strings = (char *)malloc(req.size), *p = strings;
+    p = stpcpy(p, cwd) + 1;
+    for(i = 0; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+    for(i = 0; environ[i]; i++)
+        p = stpcpy(p, environ[i]) + 1;
+
+    int fds[3] = {0, 1, 2};
+    struct iovec iov = { &req, sizeof(req) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(sendmsg(sock, &msg, 0) != sizeof(req) ||
+       write_all(sock, strings, req.size) != 0) {
+        fprintf(stderr, "fssb: error: cannot send to the daemon\n");
+        return 1;
+    }
+    free(strings);
+    free(cwd);
+
+    client_conn = sock;
+    signal(SIGINT, send_signal);
+    signal(SIGTERM, send_signal);
+    signal(SIGHUP, send_signal);
+    signal(SIGQUIT, send_signal);
+
+    int status;
+    if(read_all(sock, (char *)&status, sizeof(status)) != 0)
+        return 1; /* the session has said why */
+
+    return exit_code(status);
+}
@@ -0,0 +1,31 @@
+/**
+ * daemon.h - Running sandboxes for clients.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+extern int exit_code(int status);
+
+extern int *sandbox_hint(const char *root);
+
+extern int run_daemon(char *socket_path, int (*run)(int argc, char **argv));
+
+extern int run_client(char *socket_path, int argc, char **argv);
+
+#endif /* _DAEMON_H */
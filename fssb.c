@@ -17,6 +17,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* for O_PATH */
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -24,226 +26,1114 @@
 #include <sys/syscall.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <linux/close_range.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
 
 #include "proxyfile.h"
 #include "arguments.h"
 #include "utils.h"
+#include "seccomp.h"
+#include "tracee.h"
+#include "worker.h"
+#include "copyup.h"
+#include "path.h"
+#include "notify.h"
+#include "overlay.h"
+#include "stats.h"
+#include "log.h"
+#include "commit.h"
+#include "daemon.h"
+
+/* the sandbox directory, with a trailing slash */
+char SANDBOX_DIR[PATH_MAX];
+
+proxyfile_list *list;
 
-#define RDONLY_MEM_WRITE_SIZE 256
+/* each worker thread has its own tracees */
+__thread tracee_table *tracees;
+__thread worker *self;
 
-long first_rxp_mem = -1;
-long write_slots[6];
+pthread_barrier_t workers_ready;
 
-/* Hopefully we don't need a 90-digit number. */
-char SANDBOX_DIR[100];
-int PROXY_FILE_LEN;
+/* processes being traced, over all the workers */
+int live;
 
-proxyfile_list *list;
+pid_t root_pid;
+
+/* how it ended, for a daemon's client */
+int root_status;
+
+/* each worker thread has its own cache of canonical paths */
+__thread path_cache *paths;
+
+long options;
+
+/* what the command line asked for */
+fssb_options opts;
+
+/* what the shim passes for the filter to let its syscalls through (-p) */
+unsigned long shim_cookie;
+
+/* for the child to send us its notification fd with -b seccomp */
+int notify_sock[2];
+
+/* for the child to tell us whether its overlays are in place (-b overlay) */
+int overlay_pipe[2];
+
+/* The shim lives next to the fssb binary. */
+#define SHIM_NAME "libfssb.so"
+
+/* Number of canonical paths each worker thread keeps around. */
+#define PATH_CACHE_SIZE 4096
 
-FILE *log_file, *debug_file;
+/* The syscalls syscall_enter cares about.  With -f, these are the only ones
+   that stop the tracer; keep this in sync with the switch below. */
+const int filtered_syscalls[] = {
+    SYS_open, SYS_openat, SYS_openat2, SYS_creat,
+    SYS_unlink, SYS_unlinkat,
+    SYS_rename, SYS_renameat, SYS_renameat2,
+    SYS_stat, SYS_lstat, SYS_newfstatat, SYS_statx,
+    SYS_access, SYS_faccessat, SYS_faccessat2,
+    SYS_close, SYS_close_range, SYS_dup2, SYS_dup3,
+    SYS_chdir, SYS_fchdir,
+};
 
-int cleanup, print_list;
+/**
+ * is_filtered - is this one of the syscalls syscall_enter cares about?
+ * @nr: the syscall number
+ */
+int is_filtered(long nr) {
+    int i, count = sizeof(filtered_syscalls) / sizeof(filtered_syscalls[0]);
+    for(i = 0; i < count; i++)
+        if(filtered_syscalls[i] == nr)
+            return 1;
 
-int finish_and_return(int child, int syscall, int *retval) {
-    if(syscall == -1) {
-        char buf[2];
-        fgets(buf, sizeof(buf), stdin);
+    return 0;
+}
+
+#ifdef __amd64__
+/**
+ * inject_scratch - have the child map its scratch area before going on
+ * @t:   the tracee, at the entry of a syscall, with no scratch mapping yet
+ * @ctx: its registers
+ *
+ * The syscall is turned into an mmap; finish_scratch puts it back at the exit
+ * and backs the child up onto the syscall instruction, so the syscall it
+ * really wanted is made again, this time with a scratch area to use.  This
+ * is only done on x86_64; elsewhere rewrite_arg does without.
+ */
+void inject_scratch(tracee *t, regs_ctx *ctx) {
+    struct user_regs_struct *regs = regs_ctx_regs(ctx);
+
+    t->injected = (struct user_regs_struct *)malloc(sizeof(*regs));
+    *t->injected = *regs;
+
+    set_reg(ctx, orig_rax, SYS_mmap);
+    set_syscall_arg(ctx, 0, 0);
+    set_syscall_arg(ctx, 1, SCRATCH_SIZE);
+    set_syscall_arg(ctx, 2, PROT_READ | PROT_WRITE);
+    set_syscall_arg(ctx, 3, MAP_PRIVATE | MAP_ANONYMOUS);
+    set_syscall_arg(ctx, 4, -1);
+    set_syscall_arg(ctx, 5, 0);
+
+    t->in_syscall = 1;
+    t->need_exit = 1;
+}
+
+/**
+ * finish_scratch - pick up the result of inject_scratch
+ * @t:   the tracee, at the exit of the injected mmap
+ * @ctx: its registers
+ */
+void finish_scratch(tracee *t, regs_ctx *ctx) {
+    long addr = get_syscall_ret(ctx);
+    if(addr < 0 && addr > -4096) {
+        /* we can't rewrite a thing, so it can't be let loose */
+        fprintf(stderr, "fssb: error: cannot map scratch memory in %d\n",
+                        t->pid);
+        kill(t->pid, SIGKILL);
     }
+    else
+        t->scratch->base = addr;
 
-    if(syscall_breakpoint(child) != 0)
-        return 0;
+    struct user_regs_struct *regs = regs_ctx_regs(ctx);
+    *regs = *t->injected;
+    set_reg(ctx, rip, t->injected->rip - 2); /* the syscall instruction */
+    set_reg(ctx, rax, t->injected->orig_rax);
 
-    *retval = get_reg(child, eax);
-    return 1;
+    free(t->injected);
+    t->injected = NULL;
 }
+#endif /* __amd64__ */
 
-int handle_syscalls(pid_t child) {
-    if(syscall_breakpoint(child) != 0)
-        return 0;
+/**
+ * rewrite_arg - point a syscall argument at a path of our choosing
+ * @t:    the tracee
+ * @ctx:  its registers
+ * @n:    which argument
+ * @path: the new path
+ *
+ * The path goes into the scratch area in one write.  The original value is
+ * put back by restore_args at the exit of the syscall.  Without a scratch
+ * area, it goes on the child's stack instead, below the stack pointer and
+ * any path already put there for this syscall; nothing of the child's is
+ * down there while it's in the kernel.
+ */
+void rewrite_arg(tracee *t, regs_ctx *ctx, int n, char *path)
+{
+    scratch_area *s = t->scratch;
+
+#ifndef __amd64__
+    if(s->base == -1) {
+        long addr = get_reg(ctx, esp) - 128;
+        int k;
+        for(k = 0; k < MAX_SYSCALL_ARGS; k++)
+            if((t->rewritten & (1 << k)) && get_syscall_arg(ctx, k) < addr)
+                addr = get_syscall_arg(ctx, k);
+        addr = (addr - strlen(path) - 1) & ~15L;
+
+        write_string(t->pid, addr, path);
+
+        if(!t->rewritten)
+            s->inflight++; /* as restore_args expects */
+
+        t->orig_args[n] = get_syscall_arg(ctx, n);
+        t->rewritten |= 1 << n;
+        set_syscall_arg(ctx, n, addr);
+
+        STATS_COUNT(STAT_REWRITES);
+        return;
+    }
+#endif
 
-    int syscall = get_reg(child, orig_eax);
+    /* nobody's using what's in there, so start over */
+    if(!t->rewritten && s->inflight == 0)
+        s->used = 0;
 
-    if(syscall != SYS_execve && first_rxp_mem == -1) {
-        first_rxp_mem = get_readonly_mem(child);
-        int i;
-        for(i = 0; i < 6; i++)
-            write_slots[i] = first_rxp_mem + i*RDONLY_MEM_WRITE_SIZE;
+    long addr = scratch_alloc(s, strlen(path) + 1);
+    if(addr == -1) {
+        fprintf(stderr, "fssb: error: out of scratch memory in %d\n", t->pid);
+        kill(t->pid, SIGKILL);
+        return;
     }
 
-    switch (syscall) {
-        case SYS_exit:
-        case SYS_exit_group: {
-            int exit_code = get_syscall_arg(child, 0);
-            fprintf(stderr, "fssb: child exited with %d\n", exit_code);
-            fprintf(stderr, "fssb: sandbox directory: %s\n", SANDBOX_DIR);
-            break;
-        }
-        case SYS_open:
-        case SYS_creat: {
-            /* int open(const char *pathname, int flags); */
+    write_string(t->pid, addr, path);
+
+    if(!t->rewritten)
+        s->inflight++;
+
+    t->orig_args[n] = get_syscall_arg(ctx, n);
+    t->rewritten |= 1 << n;
+    set_syscall_arg(ctx, n, addr);
+
+    STATS_COUNT(STAT_REWRITES);
+}
+
+/**
+ * restore_args - undo what rewrite_arg did
+ * @t:   the tracee
+ * @ctx: its registers
+ */
+void restore_args(tracee *t, regs_ctx *ctx)
+{
+    if(t->rewritten)
+        t->scratch->inflight--;
+
+    int n;
+    for(n = 0; n < MAX_SYSCALL_ARGS; n++)
+        if(t->rewritten & (1 << n))
+            set_syscall_arg(ctx, n, t->orig_args[n]);
+
+    t->rewritten = 0;
+}
+
+/**
+ * dirfd_path - get the directory a directory fd of the tracee refers to
+ * @t:     the tracee
+ * @dirfd: the fd
+ *
+ * Directories the tracee opened itself are in its fd_table.  Anything else
+ * (an fd it inherited from us, or got from fcntl) we look up in /proc once
+ * and remember.
+ *
+ * Returns a (char *) pointer owned by the fd_table, or NULL if @dirfd isn't
+ * a directory.
+ */
+char *dirfd_path(tracee *t, int dirfd) {
+    char *path = fd_path(t->fds, dirfd);
+    if(path)
+        return path;
+
+    char link[64], target[PATH_MAX];
+    sprintf(link, "/proc/%d/fd/%d", t->pid, dirfd);
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if(n <= 0)
+        return NULL;
+    target[n] = 0;
 
-            long orig_word = get_syscall_arg(child, 0);
-            char *pathname = get_string(child, orig_word);
+    struct stat sb;
+    if(target[0] != '/' || stat(target, &sb) || !S_ISDIR(sb.st_mode))
+        return NULL;
+
+    set_fd_path(t->fds, dirfd, strdup(target));
+    return fd_path(t->fds, dirfd);
+}
 
-            int flags = get_syscall_arg(child, 1);
+/**
+ * resolve_path - turn a path from the child into the key the index uses
+ * @t:   the tracee
+ * @raw: the path as the child gave it, relative to its cwd
+ *
+ * Build tools open the same relative paths over and over, so the canonical
+ * forms are cached by the cwd they were resolved against.
+ *
+ * Returns a (char *) pointer.  Remember to free this at the end.
+ */
+char *resolve_path(tracee *t, const char *raw) {
+    unsigned long base_id = raw[0] == '/' ? 0 : t->cwd->id;
+
+    const char *canonical = lookup_path(paths, base_id, raw);
+    if(!canonical)
+        canonical = remember_path(paths, base_id, raw,
+                                  canonical_path(t->cwd->path, raw));
+
+    return strdup(canonical);
+}
+
+/**
+ * get_path_arg - read a path argument and resolve it the way the index does
+ * @t:         the tracee
+ * @ctx:       its registers
+ * @dirfd_arg: which argument is the directory fd, -1 if there's none
+ * @n:         which argument is the path
+ *
+ * The index is keyed by absolute, canonical paths, so that "foo", "./foo"
+ * and "/abs/foo" are the same file no matter where the child is.  Relative
+ * paths of the *at() syscalls are taken relative to the directory fd.
+ *
+ * Returns a (char *) pointer to be freed, or NULL if the syscall doesn't name
+ * a path we can make sense of (an empty path, or a bad fd); those are best
+ * left for the kernel to fail.
+ */
+char *get_path_arg(tracee *t, regs_ctx *ctx, int dirfd_arg, int n) {
+    char *pathname = get_string(t->pid, get_syscall_arg(ctx, n));
+    char *retval = NULL;
+
+    if(pathname[0] == 0) /* AT_EMPTY_PATH is about the fd itself */
+        ;
+    else if(dirfd_arg == -1 || pathname[0] == '/' ||
+            (int)get_syscall_arg(ctx, dirfd_arg) == AT_FDCWD)
+        retval = resolve_path(t, pathname);
+    else {
+        char *dir = dirfd_path(t, get_syscall_arg(ctx, dirfd_arg));
+        if(dir)
+            retval = canonical_path(dir, pathname);
+    }
 
-            proxyfile *cur;
+    free(pathname);
+    return retval;
+}
 
-            if(flags & O_APPEND || flags & O_CREAT || flags & O_WRONLY) {
-                fprintf(debug_file, "open as write%s\n", pathname);
-                cur = search_proxyfile(list, pathname);
-                if(!cur)
-                    cur = new_proxyfile(list, pathname);
+/**
+ * syscall_enter - handle the entry of a syscall
+ * @t:   the tracee, stopped at the entry of t->syscall
+ * @ctx: its registers
+ *
+ * Handlers ask for the exit only when there's something to do there: a
+ * rewritten argument register to put back (the x86_64 syscall ABI preserves
+ * them, so the child may well still be using the original pointer), or
+ * records to update once the result of the syscall is known.  The rewritten
+ * paths themselves live in scratch memory that never needs restoring.
+ *
+ * Returns 1 if we need to see the exit of the syscall, 0 otherwise.
+ */
+int syscall_enter(tracee *t, regs_ctx *ctx) {
+    pid_t child = t->pid;
 
-                write_string(child, write_slots[0], cur->proxy_path);
-                set_syscall_arg(child, 0, write_slots[0]);
+    switch (t->syscall) {
+        case SYS_open:
+        case SYS_openat:
+        case SYS_openat2:
+        case SYS_creat: {
+            /* int open(const char *pathname, int flags); */
+            /* int openat(int dirfd, const char *pathname, int flags); */
+            /* long openat2(int dirfd, const char *pathname,
+                            struct open_how *how, size_t size); */
+            /* int creat(const char *pathname, mode_t mode); */
+
+            int dirfd_arg = -1, path_arg = 0;
+            if(t->syscall == SYS_openat || t->syscall == SYS_openat2) {
+                dirfd_arg = 0;
+                path_arg = 1;
             }
 
-            if(flags == O_RDONLY) {
-                /* If this file has been written to, then we should hijack the arg
-                   with the proxyfile because we want the process to see its own
-                   changes.  If this file has never been opened with write
-                   permissions, we can just give the same file (this is more
-                   performant than copying the file). */
-                cur = search_proxyfile(list, pathname);
-                fprintf(debug_file, "open as read %s\n", pathname);
-
-                if(cur) {
-                    write_string(child, write_slots[0], cur->proxy_path);
-                    set_syscall_arg(child, 0, write_slots[0]);
+            char *pathname = get_path_arg(t, ctx, dirfd_arg, path_arg);
+            if(!pathname)
+                return 0;
+
+            long flags = O_CREAT|O_WRONLY|O_TRUNC;
+            if(t->syscall == SYS_open)
+                flags = get_syscall_arg(ctx, 1);
+            else if(t->syscall == SYS_openat)
+                flags = get_syscall_arg(ctx, 2);
+            else if(t->syscall == SYS_openat2) {
+                /* struct open_how starts with the u64 flags */
+                unsigned long long how_flags;
+                if(read_child_mem(child, get_syscall_arg(ctx, 2),
+                                  &how_flags, sizeof(how_flags)) !=
+                   sizeof(how_flags)) {
+                    free(pathname);
+                    return 0;
                 }
+                flags = how_flags;
             }
 
-            int retval;
-            if(finish_and_return(child, syscall, &retval) == 0)
-                return 0;
+            proxyfile *cur = proxyfile_for_open(list, &pathname, flags);
+            if(cur)
+                rewrite_arg(t, ctx, path_arg, cur->proxy_path);
 
-            set_syscall_arg(child, 0, orig_word);
-            break;
+            /* the exit records where a directory fd points */
+            if(flags & (O_DIRECTORY | O_PATH)) {
+                t->paths[0] = pathname;
+                return 1;
+            }
+
+            free(pathname);
+            return t->rewritten != 0;
         }
         case SYS_unlink:
         case SYS_unlinkat: {
             /* int unlink(const char *pathname); */
             /* int unlinkat(int dirfd, const char *pathname, int flags); */
 
-            int swap_arg = 0;
-            if(syscall == SYS_unlinkat)
-                swap_arg = 1;
+            int dirfd_arg = -1, path_arg = 0;
+            if(t->syscall == SYS_unlinkat) {
+                dirfd_arg = 0;
+                path_arg = 1;
+            }
 
-            long orig_word = get_syscall_arg(child, swap_arg);
-            char *pathname = get_string(child, orig_word);
+            char *pathname = get_path_arg(t, ctx, dirfd_arg, path_arg);
+            if(!pathname)
+                return 0;
 
-            fprintf(debug_file, "unlink %s\n", pathname);
+            log_msg(LOG_DEBUG, "unlink %s\n", pathname);
 
             proxyfile *cur = search_proxyfile(list, pathname);
             char *new_name;
 
+            if(cur) /* a lower layer's isn't ours to remove */
+                cur = own_proxyfile(list, cur, 1);
+
             if(cur) /* it's a file we've previously written to */
                 new_name = cur->proxy_path;
             else {
-                new_name = proxy_path(SANDBOX_DIR, pathname);
+                new_name = get_proxy_path(list, pathname);
 
                 struct stat sb;
                 if(!stat(pathname, &sb)) /* this file actually exists */
                     fclose(fopen(new_name, "w"));
-                else /* this file doesn't exist; so let them try to remove it */
+                else { /* this file doesn't exist; so let them try to remove it */
+                    free(new_name);
                     new_name = pathname;
+                }
             }
 
-            if(new_name != pathname) {
-                write_string(child, write_slots[swap_arg], new_name);
-                set_syscall_arg(child, swap_arg, write_slots[swap_arg]);
-            }
-
-            int retval;
-            if(finish_and_return(child, syscall, &retval) == 0)
-                return 0;
-
-            set_syscall_arg(child, swap_arg, orig_word);
+            if(new_name != pathname)
+                rewrite_arg(t, ctx, path_arg, new_name);
 
-            if(cur) /* let's take this off our records */
-                delete_proxyfile(list, cur);
-            else /* we malloc'd some memory, let's free it */
+            if(!cur && new_name != pathname) /* we malloc'd some memory */
                 free(new_name);
-            break;
+
+            /* the exit takes this off our records */
+            t->paths[0] = pathname;
+            return 1;
         }
-        case SYS_rename: {
+        case SYS_rename:
+        case SYS_renameat:
+        case SYS_renameat2: {
             /* int rename(const char *oldpath, const char *newpath); */
+            /* int renameat(int olddirfd, const char *oldpath,
+                            int newdirfd, const char *newpath); */
+            /* int renameat2(int olddirfd, const char *oldpath,
+                             int newdirfd, const char *newpath,
+                             unsigned int flags); */
+
+            int old_arg = 0, new_arg = 1;
+            char *oldpath, *newpath;
+
+            if(t->syscall == SYS_rename) {
+                oldpath = get_path_arg(t, ctx, -1, 0);
+                newpath = get_path_arg(t, ctx, -1, 1);
+            }
+            else {
+                old_arg = 1;
+                new_arg = 3;
+                oldpath = get_path_arg(t, ctx, 0, 1);
+                newpath = get_path_arg(t, ctx, 2, 3);
+            }
 
-            long orig_old_word = get_syscall_arg(child, 0),
-                 orig_new_word = get_syscall_arg(child, 1);
-            char *oldpath = get_string(child, orig_old_word),
-                 *newpath = get_string(child, orig_new_word);
-
-            fprintf(debug_file, "rename %s -> %s\n", oldpath, newpath);
-
-            char *new_old_name = proxy_path(SANDBOX_DIR, oldpath),
-                 *new_new_name = proxy_path(SANDBOX_DIR, newpath);
-
-            write_string(child, write_slots[0], new_old_name);
-            write_string(child, write_slots[1], new_new_name);
-            set_syscall_arg(child, 0, write_slots[0]);
-            set_syscall_arg(child, 1, write_slots[1]);
-
-            int retval;
-            if(finish_and_return(child, syscall, &retval) == 0)
+            if(!oldpath || !newpath) {
+                free(oldpath);
+                free(newpath);
                 return 0;
+            }
 
-            set_syscall_arg(child, 0, orig_old_word);
-            set_syscall_arg(child, 1, orig_new_word);
+            log_msg(LOG_DEBUG, "rename %s -> %s\n", oldpath, newpath);
 
-            proxyfile *oldpf = search_proxyfile(list, oldpath);
-            if(oldpf) { /* nothing to do if this is an invalid rename */
-                delete_proxyfile(list, oldpf);
+            proxyfile_for_rename(list, &oldpath);
+            char *new_old_name = get_proxy_path(list, oldpath),
+                 *new_new_name = get_proxy_path(list, newpath);
 
-                /* register the new file as a known file for future reads */
-                proxyfile *new = new_proxyfile(list, newpath);
-            }
+            rewrite_arg(t, ctx, old_arg, new_old_name);
+            rewrite_arg(t, ctx, new_arg, new_new_name);
 
             free(new_old_name);
             free(new_new_name);
-            break;
+
+            t->paths[0] = oldpath;
+            t->paths[1] = newpath;
+            return 1;
         }
         case SYS_stat:
         case SYS_lstat:
-        case SYS_access: {
+        case SYS_access:
+        case SYS_newfstatat:
+        case SYS_statx:
+        case SYS_faccessat:
+        case SYS_faccessat2: {
             /* int stat(const char *pathname, struct stat *buf); */
             /* int lstat(const char *pathname, struct stat *buf); */
             /* int access(const char *pathname, int mode); */
+            /* int newfstatat(int dirfd, const char *pathname,
+                              struct stat *buf, int flags); */
+            /* int statx(int dirfd, const char *pathname, int flags,
+                         unsigned int mask, struct statx *buf); */
+            /* int faccessat(int dirfd, const char *pathname, int mode); */
+            /* int faccessat2(int dirfd, const char *pathname, int mode,
+                              int flags); */
+
+            int dirfd_arg = -1, path_arg = 0;
+            if(t->syscall != SYS_stat && t->syscall != SYS_lstat &&
+               t->syscall != SYS_access) {
+                dirfd_arg = 0;
+                path_arg = 1;
+            }
 
-            long orig_word = get_syscall_arg(child, 0);
-            char *pathname = get_string(child, orig_word);
+            char *pathname = get_path_arg(t, ctx, dirfd_arg, path_arg);
+            if(!pathname)
+                return 0;
 
             proxyfile *cur = search_proxyfile(list, pathname);
 
             if(cur) { /* it's a file we've previously written to */
-                write_string(child, write_slots[0], cur->proxy_path);
-                set_syscall_arg(child, 0, write_slots[0]);
+                wait_proxyfile(list, cur);
+                rewrite_arg(t, ctx, path_arg, cur->proxy_path);
+            }
+
+            free(pathname);
+            return t->rewritten != 0;
+        }
+        case SYS_chdir:
+        case SYS_fchdir: {
+            /* int chdir(const char *path); */
+            /* int fchdir(int fd); */
+
+            char *dir;
+            if(t->syscall == SYS_chdir)
+                dir = get_path_arg(t, ctx, -1, 0);
+            else {
+                dir = dirfd_path(t, get_syscall_arg(ctx, 0));
+                if(dir)
+                    dir = strdup(dir);
             }
 
-            int retval;
-            if(finish_and_return(child, syscall, &retval) == 0)
+            if(!dir) /* the kernel won't have it either */
+                return 0;
+
+            /* the exit moves us there if it worked */
+            t->paths[0] = dir;
+            return 1;
+        }
+        case SYS_close: {
+            /* int close(int fd); */
+            clear_fd(t->fds, get_syscall_arg(ctx, 0));
+            return 0;
+        }
+        case SYS_close_range: {
+            /* int close_range(unsigned int first, unsigned int last,
+                               unsigned int flags); */
+
+            unsigned int first = get_syscall_arg(ctx, 0),
+                         last = get_syscall_arg(ctx, 1),
+                         flags = get_syscall_arg(ctx, 2);
+
+            if(flags & CLOSE_RANGE_UNSHARE)
+                unshare_fds(t);
+
+            /* Close-on-exec ones are dropped at the exec like the rest. */
+            if(flags & CLOSE_RANGE_CLOEXEC)
                 return 0;
 
-            set_syscall_arg(child, 0, orig_word);
+            unsigned int fd;
+            for(fd = first; fd <= last && fd < t->fds->size; fd++)
+                clear_fd(t->fds, fd);
+            return 0;
+        }
+        case SYS_dup2:
+        case SYS_dup3: {
+            /* int dup2(int oldfd, int newfd); */
+            /* int dup3(int oldfd, int newfd, int flags); */
+
+            int oldfd = get_syscall_arg(ctx, 0),
+                newfd = get_syscall_arg(ctx, 1);
+
+            if(oldfd == newfd)
+                return 0;
+
+            /* newfd only changes if it works, so that's left to the exit */
+            char *path = fd_path(t->fds, oldfd);
+            t->paths[0] = path ? strdup(path) : NULL;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * syscall_exit - handle the exit of a syscall
+ * @t:   the tracee, stopped at the exit of t->syscall
+ * @ctx: its registers
+ */
+void syscall_exit(tracee *t, regs_ctx *ctx) {
+    restore_args(t, ctx);
+
+    long ret = get_syscall_ret(ctx);
+
+    switch (t->syscall) {
+        case SYS_open:
+        case SYS_openat:
+        case SYS_openat2: {
+            if(ret >= 0 && t->paths[0]) {
+                set_fd_path(t->fds, ret, t->paths[0]);
+                t->paths[0] = NULL; /* the fd_table owns it now */
+            }
+            break;
+        }
+        case SYS_chdir:
+        case SYS_fchdir: {
+            /* The shim resolves relative paths against getcwd, so with it
+               we go by where the kernel says we ended up, symlinks and all
+               resolved, rather than by the path we were given. */
+            if(ret == 0 && list->published) {
+                char link[64], target[PATH_MAX];
+                sprintf(link, "/proc/%d/cwd", t->pid);
+                ssize_t n = readlink(link, target, sizeof(target) - 1);
+                if(n > 0 && target[0] == '/') {
+                    target[n] = 0;
+                    free(t->paths[0]);
+                    t->paths[0] = strdup(target);
+                }
+            }
+
+            if(ret == 0) {
+                set_cwd(t->cwd, t->paths[0]);
+                t->paths[0] = NULL; /* the cwd_state owns it now */
+            }
+            break;
+        }
+        case SYS_unlink:
+        case SYS_unlinkat: {
+            proxyfile *cur = search_proxyfile(list, t->paths[0]);
+            if(cur && ret == 0) /* let's take this off our records */
+                delete_proxyfile(list, cur);
+            else if(ret == 0) /* a real file; we still need to know */
+                note_unlink(list, t->paths[0]);
+            break;
+        }
+        case SYS_rename:
+        case SYS_renameat:
+        case SYS_renameat2: {
+            /* done in one go so no other thread sees the halfway state */
+            if(ret == 0 && rename_proxyfile(list, t->paths[0], t->paths[1]))
+                t->paths[1] = NULL; /* the proxyfile owns it now */
+            break;
+        }
+        case SYS_dup2:
+        case SYS_dup3: {
+            /* whatever newfd was is closed */
+            if(ret >= 0 && t->paths[0]) {
+                set_fd_path(t->fds, ret, t->paths[0]);
+                t->paths[0] = NULL; /* the fd_table owns it now */
+            }
+            else if(ret >= 0)
+                clear_fd(t->fds, ret);
             break;
         }
     }
+
+    free(t->paths[0]);
+    free(t->paths[1]);
+    t->paths[0] = t->paths[1] = NULL;
+}
+
+/**
+ * handle_syscall_stop - deal with a tracee stopped at a syscall
+ * @t: the tracee
+ *
+ * This is either the entry (a PTRACE_EVENT_SECCOMP stop with -f) or the exit
+ * of a syscall.
+ */
+void handle_syscall_stop(tracee *t) {
+    long start = STATS_START();
+
+    regs_ctx ctx;
+    load_regs(&ctx, t->pid);
+
+    if(!t->in_syscall)
+        t->syscall = get_syscall_nr(&ctx);
+
+    STATS_SYSCALL(t->syscall);
+    STATS_COUNT(STAT_STOPS);
+
+    if(!t->in_syscall) {
+#ifdef __amd64__
+        /* the first syscall of this address space we might rewrite */
+        if(t->scratch->base == -1 && is_filtered(t->syscall)) {
+            inject_scratch(t, &ctx);
+            flush_regs(&ctx);
+            STATS_STOP(TIMER_HANDLE, start);
+            return;
+        }
+#endif
+
+        t->in_syscall = 1;
+        t->need_exit = syscall_enter(t, &ctx);
+
+        /* without the filter, the exit stop comes whether we like it or not */
+        if(!t->need_exit && opts.use_seccomp)
+            t->in_syscall = 0;
+    }
+    else {
+        /* if the entry didn't ask for it, there's not even a register to
+           fetch; we just let the child carry on */
+#ifdef __amd64__
+        if(t->injected)
+            finish_scratch(t, &ctx);
+        else if(t->need_exit)
+            syscall_exit(t, &ctx);
+#else
+        if(t->need_exit)
+            syscall_exit(t, &ctx);
+#endif
+        t->in_syscall = 0;
+    }
+
+    flush_regs(&ctx);
+    STATS_STOP(TIMER_HANDLE, start);
+}
+
+/**
+ * resume - let a stopped tracee carry on
+ * @t:   the tracee
+ * @sig: signal to deliver, 0 for none
+ *
+ * With -f, the filter brings us the syscall entries we care about, so we only
+ * ask for syscall stops when we're waiting for the exit of one of those.
+ */
+void resume(tracee *t, int sig) {
+    if(opts.use_seccomp && !t->in_syscall)
+        ptrace(PTRACE_CONT, t->pid, 0, sig);
+    else
+        ptrace(PTRACE_SYSCALL, t->pid, 0, sig);
+}
+
+/**
+ * track_tracee - start keeping track of a process in this worker
+ * @pid: PID of the process
+ */
+tracee *track_tracee(pid_t pid) {
+    __atomic_add_fetch(&live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&self->load, 1, __ATOMIC_RELAXED);
+    return add_tracee(tracees, pid);
+}
+
+/**
+ * drop_tracee - stop keeping track of a process that's gone
+ * @t: the tracee
+ *
+ * Once the last process is gone, every worker is told to wrap up.
+ */
+void drop_tracee(tracee *t) {
+    remove_tracee(tracees, t);
+    __atomic_sub_fetch(&self->load, 1, __ATOMIC_RELAXED);
+
+    if(__atomic_sub_fetch(&live, 1, __ATOMIC_ACQ_REL) == 0)
+        quit_workers();
+}
+
+/**
+ * park_tracee - get a new process ready to be handed to another worker
+ * @t: the tracee, at its initial stop
+ *
+ * ptrace ties a tracee to the thread that traces it, so the process has to
+ * be detached and attached again by the other worker.  In between it must
+ * not run any code of its own, or it'd escape the sandbox.  It's sitting
+ * right after the fork syscall, so we back it up onto the syscall
+ * instruction and have it do an rt_sigsuspend with every signal blocked
+ * instead; that blocks until the new worker interrupts it, and the real
+ * registers are put back by unpark_tracee.  That takes knowing the syscall
+ * instruction and registers, so it's only done on x86_64; elsewhere a new
+ * process stays with the worker that saw it born.
+ *
+ * Returns 1 if the tracee has been detached, 0 if it's not in a state we
+ * can do this from (it's still ours in that case).
+ */
+int park_tracee(tracee *t) {
+#ifdef __amd64__
+    regs_ctx ctx;
+    load_regs(&ctx, t->pid);
+
+    struct user_regs_struct *regs = regs_ctx_regs(&ctx);
+
+    unsigned char insn[2];
+    if(read_child_mem(t->pid, regs->rip - 2, insn, 2) != 2 ||
+       insn[0] != 0x0f || insn[1] != 0x05) /* syscall */
+        return 0;
+
+    /* below the red zone, so nothing in use gets clobbered */
+    unsigned long mask = ~0UL;
+    long mask_addr = (regs->rsp - 128 - sizeof(mask)) & ~7L;
+    if(write_child_mem(t->pid, mask_addr, &mask, sizeof(mask)) != sizeof(mask))
+        return 0;
+
+    t->parked = (struct user_regs_struct *)malloc(sizeof(*regs));
+    *t->parked = *regs;
+
+    set_reg(&ctx, rip, regs->rip - 2);
+    set_reg(&ctx, rax, SYS_rt_sigsuspend);
+    set_reg(&ctx, rdi, mask_addr);
+    set_reg(&ctx, rsi, sizeof(mask));
+    flush_regs(&ctx);
+
+    ptrace(PTRACE_DETACH, t->pid, 0, 0);
     return 1;
+#else
+    (void)t;
+    return 0;
+#endif
+}
+
+/**
+ * unpark_tracee - undo park_tracee once the process has been attached again
+ * @t: the tracee, at its first stop in its new worker
+ */
+void unpark_tracee(tracee *t) {
+    ptrace(PTRACE_SETREGS, t->pid, 0, t->parked);
+
+    free(t->parked);
+    t->parked = NULL;
+}
+
+/**
+ * place_tracee - let a new process run, possibly in another worker
+ * @t: the tracee, stopped and with its parent's state
+ */
+void place_tracee(tracee *t) {
+    if(!t->placed) {
+        t->placed = 1;
+
+        worker *w = pick_worker(self);
+        if(w != self && park_tracee(t)) {
+            log_msg(LOG_INFO, "hand %d to worker %d\n", t->pid, w->id);
+            unlink_tracee(tracees, t);
+            __atomic_sub_fetch(&self->load, 1, __ATOMIC_RELAXED);
+            hand_off(w, t);
+            return;
+        }
+    }
+
+    resume(t, 0);
+}
+
+/**
+ * adopt_tracees - attach the processes other workers have handed to us
+ */
+void adopt_tracees() {
+    tracee *t;
+    while((t = take_handoff(self)) != NULL) {
+        if(ptrace(PTRACE_SEIZE, t->pid, 0, options) < 0 ||
+           ptrace(PTRACE_INTERRUPT, t->pid, 0, 0) < 0) {
+            /* it was killed while parked */
+            insert_tracee(tracees, t);
+            drop_tracee(t);
+            continue;
+        }
+
+        /* unpark_tracee runs at the stop the interrupt brings */
+        t->started = 0;
+        insert_tracee(tracees, t);
+    }
+}
+
+/**
+ * handle_new_tracee - set up a process the child has just created
+ * @parent: the tracee that forked/cloned
+ * @event:  the ptrace event it stopped with
+ *
+ * The new process is traced from birth, but its first stop and its parent's
+ * event stop can reach us in either order.  If the new process got here first
+ * it's been held stopped until now, since it can't run without its state.
+ */
+void handle_new_tracee(tracee *parent, int event) {
+    unsigned long pid;
+    ptrace(PTRACE_GETEVENTMSG, parent->pid, 0, &pid);
+
+    tracee *t = find_tracee(tracees, pid);
+    if(!t)
+        t = track_tracee(pid);
+
+    /* threads share the fds of their creator; processes get a copy */
+    inherit_tracee(t, parent, event == PTRACE_EVENT_CLONE);
+
+    /* Threads share everything with their creator, down to the PID an exec
+       leaves behind, so only processes go to other workers. */
+    if(event == PTRACE_EVENT_CLONE)
+        t->placed = 1;
+
+    if(t->started == 2) {
+        t->started = 1;
+        place_tracee(t);
+    }
+}
+
+/**
+ * handle_exec - clean up after a tracee has replaced its program
+ * @t: the tracee
+ */
+void handle_exec(tracee *t) {
+    /* a brand new address space, which needs a scratch mapping of its own */
+    release_scratch_area(t->scratch);
+    t->scratch = new_scratch_area();
+
+    /* Close-on-exec fds are gone now.  Rather than keep track of which ones
+       those are, forget them all; any still open get looked up again. */
+    release_fd_table(t->fds);
+    t->fds = new_fd_table();
+
+    /* If a thread other than the leader called exec, it takes over the
+       leader's PID; the thread's own PID goes away without an exit. */
+    unsigned long old_pid;
+    ptrace(PTRACE_GETEVENTMSG, t->pid, 0, &old_pid);
+
+    if(old_pid != t->pid) {
+        tracee *old = find_tracee(tracees, old_pid);
+        if(old) {
+            t->in_syscall = old->in_syscall;
+            t->syscall = old->syscall;
+            t->need_exit = old->need_exit;
+            drop_tracee(old);
+        }
+    }
+}
+
+/**
+ * report_exit - tell the user how the child ended
+ * @status: the wait status
+ */
+void report_exit(int status) {
+    root_status = status;
+    if(WIFEXITED(status))
+        fprintf(stderr, "fssb: child exited with %d\n", WEXITSTATUS(status));
+    else
+        fprintf(stderr, "fssb: child killed by signal %d\n", WTERMSIG(status));
+    fprintf(stderr, "fssb: sandbox directory: %s\n", SANDBOX_DIR);
+}
+
+/**
+ * work - a tracer thread's main loop
+ *
+ * Runs until every traced process, whichever worker owns it, is gone.
+ */
+void work() {
+    int status;
+    while(!__atomic_load_n(&self->quit, __ATOMIC_ACQUIRE)) {
+        /* only our own tracees; the other threads' are not ours to touch */
+        pid_t pid = waitpid(-1, &status, __WALL | __WNOTHREAD);
+        if(pid == -1)
+            break;
+
+        if(pid == self->doorbell) {
+            adopt_tracees();
+            ptrace(PTRACE_CONT, pid, 0, 0);
+            continue;
+        }
+
+        tracee *t = find_tracee(tracees, pid);
+
+        if(WIFEXITED(status) || WIFSIGNALED(status)) {
+            if(pid == root_pid)
+                report_exit(status);
+            if(t)
+                drop_tracee(t);
+            continue;
+        }
+
+        if(!WIFSTOPPED(status))
+            continue;
+
+        if(!t) { /* hold it until its parent's event comes in */
+            t = track_tracee(pid);
+            t->started = 2;
+            continue;
+        }
+
+        int sig = WSTOPSIG(status), event = status >> 16;
+
+        if(sig == (SIGTRAP | 0x80) || event == PTRACE_EVENT_SECCOMP) {
+            handle_syscall_stop(t);
+            sig = 0;
+        }
+        else if(event == PTRACE_EVENT_FORK ||
+                event == PTRACE_EVENT_VFORK ||
+                event == PTRACE_EVENT_CLONE) {
+            handle_new_tracee(t, event);
+            sig = 0;
+        }
+        else if(event == PTRACE_EVENT_EXEC) {
+            handle_exec(t);
+            sig = 0;
+        }
+        else if(!t->started) { /* the stop every new tracee starts with */
+            t->started = 1;
+            if(t->parked)
+                unpark_tracee(t);
+            place_tracee(t);
+            continue;
+        }
+        else if(event == PTRACE_EVENT_STOP) {
+            /* a group-stop of a tracee a worker attached to itself; like
+               below, we don't keep the tracee in those */
+            sig = 0;
+        }
+        else {
+            /* A signal is about to be delivered; pass it on.  Group-stops
+               look the same but have no siginfo, and we don't keep the
+               tracee in those. */
+            siginfo_t si;
+            if(ptrace(PTRACE_GETSIGINFO, pid, 0, &si) < 0)
+                sig = 0;
+        }
+
+        resume(t, sig);
+    }
+
+    stop_doorbell(self);
 }
 
+/**
+ * worker_thread - start routine of the tracer threads other than the first
+ * @arg: the worker
+ */
+void *worker_thread(void *arg) {
+    self = (worker *)arg;
+    tracees = new_tracee_table();
+    paths = new_path_cache(PATH_CACHE_SIZE);
+    start_doorbell(self);
+
+    pthread_barrier_wait(&workers_ready);
+
+    work();
+    return NULL;
+}
+
+/**
+ * trace - trace the child and everything it creates until they're all gone
+ * @child: PID of the child process
+ *
+ * With -j, this is spread over several threads: the calling thread is worker
+ * 0 and starts out with the child, and new processes go to whichever worker
+ * has the fewest.
+ */
 void trace(pid_t child) {
     int status;
     waitpid(child, &status, 0);
 
+    /* the child may bail out before its first stop */
+    if(WIFEXITED(status))
+        return;
+
     assert(WIFSTOPPED(status));
-    ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD);
 
-    while(handle_syscalls(child));
+    options = PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL |
+              PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+              PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
+    if(opts.use_seccomp)
+        options |= PTRACE_O_TRACESECCOMP;
+    ptrace(PTRACE_SETOPTIONS, child, 0, options);
+
+    init_workers(opts.jobs);
+    list->shared = opts.jobs > 1;
+    pthread_barrier_init(&workers_ready, NULL, opts.jobs);
+
+    int i;
+    for(i = 1; i < opts.jobs; i++)
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+
+    /* the child is ours, so we're worker 0 */
+    self = &workers[0];
+    tracees = new_tracee_table();
+    paths = new_path_cache(PATH_CACHE_SIZE);
+    if(opts.jobs > 1)
+        start_doorbell(self);
+
+    /* nothing gets handed to a worker that isn't listening yet */
+    pthread_barrier_wait(&workers_ready);
+
+    root_pid = child;
+    tracee *root = track_tracee(child);
+    root->started = 1;
+    root->placed = 1;
+    root->cwd = new_cwd_state(getcwd(NULL, 0));
+    root->fds = new_fd_table();
+    root->scratch = new_scratch_area();
+    resume(root, 0);
+
+    work();
+
+    for(i = 1; i < opts.jobs; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free_retired_proxyfiles(list);
+}
+
+/**
+ * supervise_child - sandbox the child with the seccomp backend
+ * @child: PID of the child process
+ */
+void supervise_child(pid_t child) {
+    close(notify_sock[1]);
+    int listener = receive_listener(notify_sock[0]);
+    close(notify_sock[0]);
+
+    if(listener < 0) { /* the child has said why */
+        int status;
+        waitpid(child, &status, 0);
+        exit(1);
+    }
+
+    report_exit(supervise(listener, child, list, opts.jobs));
 }
 
 int process_child(int argc, char **argv) {
@@ -253,77 +1143,448 @@ int process_child(int argc, char **argv) {
         args[i] = argv[i];
     args[argc] = NULL;  /* execvp needs a NULL terminated list */
 
+    /* Nor with -b overlay, where the kernel does it all. */
+    if(opts.backend == BACKEND_OVERLAY) {
+        close(overlay_pipe[0]);
+        char ready = enter_overlay(SANDBOX_DIR) == 0;
+        write(overlay_pipe[1], &ready, 1);
+        if(!ready)
+            exit(1);
+        return execvp(args[0], args);
+    }
+
+    /* Nothing's traced with -b seccomp: the filter does it all. */
+    if(opts.backend == BACKEND_SECCOMP) {
+        close(notify_sock[0]);
+        if(install_notify(notify_sock[1], shim_cookie) != 0) {
+            fprintf(stderr, "fssb: error: cannot install seccomp "
+                            "notification filter\n");
+            exit(1);
+        }
+        return execvp(args[0], args);
+    }
+
     ptrace(PTRACE_TRACEME);
+
+    /* The filter has to be in place before the exec, but the stop must come
+       after it: the tracer only sets PTRACE_O_TRACESECCOMP once we're stopped
+       and a SECCOMP_RET_TRACE without it would fail the syscall. */
+    if(opts.use_seccomp) {
+        int count = sizeof(filtered_syscalls) / sizeof(filtered_syscalls[0]);
+        if(install_syscall_filter(filtered_syscalls, count,
+                                  shim_cookie) != 0) {
+            fprintf(stderr, "fssb: error: cannot install seccomp filter\n");
+            exit(1);
+        }
+    }
+
     kill(getpid(), SIGSTOP);
     return execvp(args[0], args);
 }
 
-void init(int child) {
-    struct stat sb;
+/**
+ * start_child - fork the process that runs the program
+ * @argc: number of child arguments
+ * @argv: the program and its arguments
+ *
+ * Returns the PID of the child; the child itself never returns.
+ */
+pid_t start_child(int argc, char **argv) {
+    pid_t child = fork();
+
+    if(child == 0) {
+        if(process_child(argc, argv) == -1)
+            fprintf(stderr, "fssb: %s: command not found\n", argv[0]);
+        exit(1);
+    }
+    else if(child < 0) {
+        fprintf(stderr, "fssb: error: cannot fork\n");
+        exit(1);
+    }
+
+    return child;
+}
+
+/**
+ * run_overlay - run the program with the overlay backend
+ * @argc: number of child arguments
+ * @argv: the program and its arguments
+ *
+ * Returns 1 once the program and everything it started are done, 0 if the
+ * kernel wouldn't give it its overlays (it hasn't run in that case).
+ */
+int run_overlay(int argc, char **argv) {
+    if(pipe2(overlay_pipe, O_CLOEXEC) != 0)
+        return 0;
+
+    /* its orphans come to us, so we know when they're all done */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    pid_t child = start_child(argc, argv);
+
+    close(overlay_pipe[1]);
+    char ready;
+    if(read(overlay_pipe[0], &ready, 1) != 1)
+        ready = 0;
+    close(overlay_pipe[0]);
+
+    int status;
+    if(!ready) {
+        waitpid(child, &status, 0);
+        prctl(PR_SET_CHILD_SUBREAPER, 0);
+        remove_overlay(SANDBOX_DIR);
+        return 0;
+    }
+
+    pid_t pid;
+    while((pid = wait(&status)) != -1 || errno == EINTR)
+        if(pid == child)
+            report_exit(status);
 
+    collect_overlay(list);
+    remove_overlay(SANDBOX_DIR);
+    return 1;
+}
+
+/**
+ * start_preload - get the shim ready to go into the child (-p)
+ *
+ * The shim finds the published index and the cookie in the environment the
+ * child inherits.  It's no use unless the filter lets its syscalls through,
+ * so with ptrace this turns -f on.
+ */
+void start_preload() {
+    char shim[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", shim,
+                         sizeof(shim) - sizeof(SHIM_NAME) - 1);
+    if(n <= 0) {
+        fprintf(stderr, "fssb: error: cannot find %s\n", SHIM_NAME);
+        exit(1);
+    }
+    shim[n] = 0;
+    strcpy(strrchr(shim, '/') + 1, SHIM_NAME);
+
+    if(access(shim, R_OK) != 0) {
+        fprintf(stderr, "fssb: error: cannot find %s\n", shim);
+        exit(1);
+    }
+
+    char index_path[PATH_MAX];
+    if(snprintf(index_path, sizeof(index_path), "%sindex",
+                SANDBOX_DIR) >= (int)sizeof(index_path)) {
+        fprintf(stderr, "fssb: error: %s is too long a path\n", SANDBOX_DIR);
+        exit(1);
+    }
+    list->published = new_pub_index(index_path);
+    if(!list->published) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", index_path);
+        exit(1);
+    }
+    publish_snapshots(list);
+
+    while(shim_cookie == 0)
+        if(getrandom(&shim_cookie, sizeof(shim_cookie), 0) !=
+           sizeof(shim_cookie)) {
+            fprintf(stderr, "fssb: error: cannot get random bytes\n");
+            exit(1);
+        }
+
+    char cookie_str[2*sizeof(shim_cookie) + 1];
+    sprintf(cookie_str, "%lx", shim_cookie);
+
+    /* whatever was preloaded already stays */
+    char *old = getenv("LD_PRELOAD");
+    char *preload_list = (char *)malloc(strlen(shim) +
+                                        (old ? strlen(old) + 1 : 0) + 1);
+    strcpy(preload_list, shim);
+    if(old) {
+        strcat(preload_list, " ");
+        strcat(preload_list, old);
+    }
+
+    setenv("LD_PRELOAD", preload_list, 1);
+    setenv("FSSB_INDEX", index_path, 1);
+    setenv("FSSB_COOKIE", cookie_str, 1);
+    free(preload_list);
+
+    opts.use_seccomp = 1;
+}
+
+/**
+ * new_sandbox - make a new sandbox directory
+ */
+void new_sandbox() {
+    /* the first fssb-N that's free; mkdir tells us atomically */
+    int *hint = sandbox_hint(opts.sandbox_root);
     int i;
-    for(i = 1; ; i++) {
-        sprintf(SANDBOX_DIR, "/tmp/fssb-%d/", i);
-        if(stat(SANDBOX_DIR, &sb))
+    for(i = hint ? __atomic_load_n(hint, __ATOMIC_RELAXED) : 1; ; i++) {
+        snprintf(SANDBOX_DIR, sizeof(SANDBOX_DIR), "%s/fssb-%d/",
+                 strcmp(opts.sandbox_root, "/") ? opts.sandbox_root : "", i);
+        if(mkdir(SANDBOX_DIR, 0775) == 0)
             break;
+
+        if(errno != EEXIST) {
+            fprintf(stderr, "fssb: error: cannot create %s\n", SANDBOX_DIR);
+            exit(1);
+        }
     }
-    mkdir(SANDBOX_DIR, 0775);
 
-    PROXY_FILE_LEN = strlen(SANDBOX_DIR) + 32;
+    if(hint)
+        __atomic_store_n(hint, i + 1, __ATOMIC_RELAXED);
+}
 
-    list = new_proxyfile_list();
-    list->SANDBOX_DIR = SANDBOX_DIR;
-    list->PROXY_FILE_LEN = PROXY_FILE_LEN;
+/**
+ * resume_sandbox - pick up where the last run in SANDBOX_DIR left off (-u)
+ *
+ * The snapshot that run saved at the end is mapped in as it is.  If it
+ * didn't get to the end, the journal has more in it than the snapshot, and
+ * the snapshot is brought up to date from it first.
+ */
+void resume_sandbox() {
+    char journal_path[PATH_MAX];
+    if(snprintf(journal_path, sizeof(journal_path), "%sjournal",
+                SANDBOX_DIR) >= (int)sizeof(journal_path)) {
+        fprintf(stderr, "fssb: error: %s is too long a path\n", SANDBOX_DIR);
+        exit(1);
+    }
+
+    struct stat sb;
+    if(stat(journal_path, &sb) != 0) {
+        fprintf(stderr, "fssb: error: %s is not a sandbox\n", SANDBOX_DIR);
+        exit(1);
+    }
+
+    snapshot *saved = open_snapshot(SANDBOX_DIR);
+    if(!saved || saved->header->journal_size != (uint64_t)sb.st_size) {
+        if(saved)
+            close_snapshot(saved);
+
+        if(compact_journal(SANDBOX_DIR, 1) != 0 ||
+           (saved = open_snapshot(SANDBOX_DIR)) == NULL) {
+            fprintf(stderr, "fssb: error: cannot read the sandbox in %s\n",
+                            SANDBOX_DIR);
+            exit(1);
+        }
+
+        /* drop whatever a crash cut short, so we add on after whole entries */
+        if(truncate(journal_path, saved->header->journal_size) != 0) {
+            fprintf(stderr, "fssb: error: cannot write %s\n", journal_path);
+            exit(1);
+        }
+    }
+
+    list->saved = saved;
+    list->hash_algo = saved->header->hash_algo;
 }
 
-int main(int argc, char **argv) {
-    build_help();
-    check_args_validity(argc, argv);
-    if(help_requested(argc, argv)) {
-        print_help();
-        return 0;
+/**
+ * open_lowers - map in the snapshots of the lower sandboxes (-l)
+ *
+ * They're only ever read, so each has to have been brought up to date from
+ * its journal already; that's left to fssb --map rather than done to
+ * someone else's sandbox behind their back.
+ */
+void open_lowers() {
+    list->lowers = (snapshot **)malloc(opts.lower_count *
+                                       sizeof(snapshot *));
+
+    int i;
+    for(i = 0; i < opts.lower_count; i++) {
+        char dir[PATH_MAX], journal_path[PATH_MAX];
+        if(snprintf(dir, sizeof(dir), "%s/",
+                    strcmp(opts.lower_dirs[i], "/") ? opts.lower_dirs[i]
+                                                    : "") >= (int)sizeof(dir) ||
+           snprintf(journal_path, sizeof(journal_path), "%sjournal",
+                    dir) >= (int)sizeof(journal_path)) {
+            fprintf(stderr, "fssb: error: %s is too long a path\n",
+                            opts.lower_dirs[i]);
+            exit(1);
+        }
+
+        if(strcmp(dir, SANDBOX_DIR) == 0) {
+            fprintf(stderr, "fssb: error: %s can't be under itself\n", dir);
+            exit(1);
+        }
+
+        struct stat sb;
+        snapshot *lower = open_snapshot(dir);
+        if(!lower || stat(journal_path, &sb) != 0 ||
+           lower->header->journal_size != (uint64_t)sb.st_size) {
+            fprintf(stderr, "fssb: error: %s has no up-to-date snapshot; "
+                            "run fssb --map %s first\n", dir,
+                            opts.lower_dirs[i]);
+            exit(1);
+        }
+
+        /* the proxy file names have to come out the same in every layer */
+        if(i == 0 && !opts.resume_dir)
+            list->hash_algo = lower->header->hash_algo;
+        else if(lower->header->hash_algo != (uint32_t)list->hash_algo) {
+            fprintf(stderr, "fssb: error: %s doesn't use the %s hash\n", dir,
+                            hash_algo_name(list->hash_algo));
+            exit(1);
+        }
+
+        list->lowers[i] = lower;
+        list->lower_count++;
+    }
+}
+
+void init() {
+    if(opts.resume_dir)
+        snprintf(SANDBOX_DIR, sizeof(SANDBOX_DIR), "%s/",
+                 strcmp(opts.resume_dir, "/") ? opts.resume_dir : "");
+    else
+        new_sandbox();
+
+    list = new_proxyfile_list();
+    list->SANDBOX_DIR = SANDBOX_DIR;
+    list->hash_algo = opts.hash_algo;
+    if(opts.resume_dir)
+        resume_sandbox();
+    if(opts.lower_count)
+        open_lowers();
+
+    write_meta(list);
+
+    char journal_path[PATH_MAX];
+    if(snprintf(journal_path, sizeof(journal_path), "%sjournal",
+                SANDBOX_DIR) >= (int)sizeof(journal_path)) {
+        fprintf(stderr, "fssb: error: %s is too long a path\n", SANDBOX_DIR);
+        exit(1);
+    }
+    list->journal = new_journal(journal_path, list->hash_algo,
+                                opts.journal_sync, opts.resume_dir != NULL);
+    if(list->journal == NULL) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", journal_path);
+        exit(1);
     }
+}
 
-    /* everything else must run a program */
+/**
+ * run_sandbox - run a program in a sandbox, as the arguments say
+ * @argc: number of args given to the tracer
+ * @argv: argument list
+ *
+ * Returns the program's wait status.
+ */
+int run_sandbox(int argc, char **argv) {
     int pos = get_child_args_start_pos(argc, argv);
     int child_argc = argc - pos;
     char **child_argv = argv + pos;
 
-    set_parameters(pos - 1,
-                   argv,
-                   &cleanup,
-                   &log_file,
-                   &debug_file,
-                   &print_list);
+    set_parameters(pos - 1, argv, &opts);
+    stats_enabled = opts.print_stats || opts.stats_json;
+    if(opts.debug_file)
+        start_log(opts.debug_file, LOG_DEBUG);
 
-    pid_t child = fork();
+    init();
 
-    if(child > 0) {
-        init(child);
-        trace(child);
+    /* the overlays would start out empty, without what the sandbox has */
+    if(opts.backend == BACKEND_OVERLAY &&
+       (opts.resume_dir || opts.lower_count)) {
+        fprintf(stderr, "fssb: %s doesn't work with overlays, using ptrace\n",
+                        opts.resume_dir ? "-u" : "-l");
+        opts.backend = BACKEND_PTRACE;
     }
-    else if(child == 0) {
-        int return_code = 0;
-        if(process_child(child_argc, child_argv) == -1) {
-            fprintf(stderr, "fssb: %s: command not found\n", child_argv[0]);
-            return_code = 1;
-        }
 
-        return return_code;
+    if(opts.backend == BACKEND_OVERLAY &&
+       !run_overlay(child_argc, child_argv)) {
+        fprintf(stderr, "fssb: overlayfs is not available, using ptrace\n");
+        opts.backend = BACKEND_PTRACE;
     }
-    else {
-        fprintf(stderr, "fssb: error: cannot fork\n");
-        return 1;
+
+    /* the overlays don't need any help */
+    if(opts.preload && opts.backend != BACKEND_OVERLAY)
+        start_preload();
+
+    if(opts.backend == BACKEND_SECCOMP) {
+        if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, notify_sock)) {
+            fprintf(stderr, "fssb: error: cannot create socket\n");
+            exit(1);
+        }
+        supervise_child(start_child(child_argc, child_argv));
     }
+    else if(opts.backend == BACKEND_PTRACE)
+        trace(start_child(child_argc, child_argv));
 
-    write_map(list, SANDBOX_DIR);
-    if(print_list)
-        print_map(list, log_file);
+    if(opts.print_stats)
+        write_stats(stderr, 0);
 
-    if(cleanup) {
+    if(opts.stats_json) {
+        FILE *json = fopen(opts.stats_json, "w");
+        if(json) {
+            write_stats(json, 1);
+            fclose(json);
+        }
+        else
+            fprintf(stderr, "fssb: error: cannot create %s\n",
+                            opts.stats_json);
+    }
+
+    log_msg(LOG_INFO, "filter: %ld misses, %ld hits, %ld false positives\n",
+            list->filter_misses, list->filter_hits,
+            list->filter_false_positives);
+    stop_log();
+
+    if(list->published)
+        free_pub_index(list->published);
+
+    close_journal(list->journal);
+    list->journal = NULL;
+    compact_journal(SANDBOX_DIR, 1);
+    if(opts.print_list)
+        print_map(list, opts.log_file);
+
+    if(opts.cleanup) {
         remove_proxy_files(list);
         rmdir(SANDBOX_DIR);
     }
 
-    return 0;
+    if(list->saved)
+        close_snapshot(list->saved);
+
+    int i;
+    for(i = 0; i < list->lower_count; i++)
+        close_snapshot(list->lowers[i]);
+
+    return root_status;
 }
+
+int main(int argc, char **argv) {
+    build_help();
+    check_args_validity(argc, argv);
+    if(help_requested(argc, argv)) {
+        print_help();
+        return 0;
+    }
+
+    /* --map only writes out a file-map; it doesn't run anything */
+    char *map_dir = map_requested(argc, argv);
+    if(map_dir) {
+        snprintf(SANDBOX_DIR, sizeof(SANDBOX_DIR), "%s%s", map_dir,
+                 map_dir[strlen(map_dir) - 1] == '/' ? "" : "/");
+        return compact_journal(SANDBOX_DIR, 0) == 0 ? 0 : 1;
+    }
+
+    /* nor does --commit; the copying is what the threads are for here */
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    char *commit_dir = commit_requested(argc, argv, &jobs);
+    if(commit_dir) {
+        snprintf(SANDBOX_DIR, sizeof(SANDBOX_DIR), "%s%s", commit_dir,
+                 commit_dir[strlen(commit_dir) - 1] == '/' ? "" : "/");
+        return commit_sandbox(SANDBOX_DIR, jobs < 1 ? 1 : jobs) == 0 ? 0 : 1;
+    }
+
+    /* --daemon runs programs for --connect, which hands it all over */
+    char *daemon_socket = daemon_requested(argc, argv);
+    if(daemon_socket)
+        return run_daemon(daemon_socket, run_sandbox);
+
+    char *connect_socket = connect_requested(&argc, argv);
+    if(connect_socket)
+        return run_client(connect_socket, argc, argv);
+
+    /* exit just as --connect does for the same program */
+    return exit_code(run_sandbox(argc, argv));
+}
\ No newline at end of file
@@ -0,0 +1,288 @@
+/**
+ * hash.c - Path hashing.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+static const char *algo_names[HASH_ALGO_COUNT] = {
+    [HASH_MURMUR3] = "murmur3",
+    [HASH_MD5] = "md5",
+};
+
+/**
+ * hash_algo_from_name - look up a hash algorithm by name
+ * @name: the name, as given with -a or recorded in the sandbox metadata
+ *
+ * Returns the algorithm, or -1 if there's no such algorithm.
+ */
+int hash_algo_from_name(const char *name)
+{
+    int i;
+    for(i = 0; i < HASH_ALGO_COUNT; i++)
+        if(strcmp(algo_names[i], name) == 0)
+            return i;
+
+    return -1;
+}
+
+/**
+ * hash_algo_name - returns the name of a hash algorithm
+ * @algo: the algorithm
+ */
+const char *hash_algo_name(int algo)
+{
+    return algo_names[algo];
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * murmur3_digest - MurmurHash3 (x64, 128-bit variant) with a zero seed
+ * @data:   the bytes to hash
+ * @len:    number of bytes
+ * @digest: buffer of DIGEST_LEN bytes to store the digest in
+ *
+ * This is Austin Appleby's public domain algorithm.  It's an order of
+ * magnitude faster than MD5 on path-sized inputs.
+ */
+static void murmur3_digest(const unsigned char *data,
+                           size_t len,
+                           unsigned char *digest)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t nblocks = len / 16, i;
+
+    for(i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + 16*i, 8);
+        memcpy(&k2, data + 16*i + 8, 8);
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + 16*nblocks;
+    k1 = k2 = 0;
+
+    switch(len & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)tail[9] << 8;  /* fall through */
+    case  9: k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+             /* fall through */
+    case  8: k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+    case  7: k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+    case  6: k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+    case  5: k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+    case  4: k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+    case  3: k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+    case  2: k1 ^= (uint64_t)tail[1] << 8;  /* fall through */
+    case  1: k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    memcpy(digest, &h1, 8);
+    memcpy(digest + 8, &h2, 8);
+}
+
+/* per-round shift amounts and the sine-derived constants from RFC 1321 */
+static const uint32_t md5_s[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+/**
+ * md5_block - run one 64-byte block through the MD5 compression function
+ * @state: the four 32-bit state words
+ * @block: the block
+ */
+static void md5_block(uint32_t *state, const unsigned char *block)
+{
+    uint32_t m[16], a = state[0], b = state[1], c = state[2], d = state[3];
+    int i;
+
+    for(i = 0; i < 16; i++)
+        m[i] = (uint32_t)block[4*i] |
+               (uint32_t)block[4*i + 1] << 8 |
+               (uint32_t)block[4*i + 2] << 16 |
+               (uint32_t)block[4*i + 3] << 24;
+
+    for(i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+
+        if(i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        }
+        else if(i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5*i + 1) % 16;
+        }
+        else if(i < 48) {
+            f = b ^ c ^ d;
+            g = (3*i + 5) % 16;
+        }
+        else {
+            f = c ^ (b | ~d);
+            g = (7*i) % 16;
+        }
+
+        f += a + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << md5_s[i]) | (f >> (32 - md5_s[i]));
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/**
+ * md5_digest - compute the MD5 digest of a block of bytes (RFC 1321)
+ * @data:   the bytes to hash
+ * @len:    number of bytes
+ * @digest: buffer of DIGEST_LEN bytes to store the digest in
+ */
+static void md5_digest(const unsigned char *data,
+                       size_t len,
+                       unsigned char *digest)
+{
+    uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char block[64];
+    size_t i;
+
+    for(i = 0; i + 64 <= len; i += 64)
+        md5_block(state, data + i);
+
+    /* pad with a 1 bit, zeroes, and the length in bits */
+    size_t rest = len - i;
+    memset(block, 0, sizeof(block));
+    memcpy(block, data + i, rest);
+    block[rest] = 0x80;
+
+    if(rest >= 56) {
+        md5_block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+
+    uint64_t bits = (uint64_t)len * 8;
+    for(i = 0; i < 8; i++)
+        block[56 + i] = bits >> (8*i);
+    md5_block(state, block);
+
+    for(i = 0; i < 16; i++)
+        digest[i] = state[i / 4] >> (8*(i % 4));
+}
+
+/**
+ * hash_digest - compute the digest of a path
+ * @algo:   one of the HASH_* algorithms
+ * @str:    the path
+ * @len:    length of the path
+ * @digest: buffer of DIGEST_LEN bytes to store the digest in
+ */
+void hash_digest(int algo, const char *str, size_t len, unsigned char *digest)
+{
+    switch(algo) {
+    case HASH_MD5:
+        md5_digest((const unsigned char *)str, len, digest);
+        break;
+    case HASH_MURMUR3:
+    default:
+        murmur3_digest((const unsigned char *)str, len, digest);
+        break;
+    }
+}
+
+/**
+ * hex_digest - format a binary digest as lowercase hex
+ * @digest: the DIGEST_LEN byte digest
+ * @hex:    buffer of at least 2*DIGEST_LEN + 1 bytes
+ */
+void hex_digest(const unsigned char *digest, char *hex)
+{
+    int i;
+    for(i = 0; i < DIGEST_LEN; i++) {
+        unsigned char x = digest[i] >> 4;
+        if(x < 10)
+            hex[2*i] = '0' + x;
+        else
+            hex[2*i] = 'a' + x - 10;
+
+        x = digest[i] & 0xf;
+        if(x < 10)
+            hex[2*i+1] = '0' + x;
+        else
+            hex[2*i+1] = 'a' + x - 10;
+    }
+
+    hex[2*DIGEST_LEN] = 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * hash.h - Path hashing.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+
+/* Length of a binary path digest.  All algorithms produce 128 bits. */
+#define DIGEST_LEN 16
+
+/* The algorithms a sandbox can name its proxy files with. */
+enum {
+    HASH_MURMUR3 = 0, /* fast, non-cryptographic; the default */
+    HASH_MD5,         /* what file-map consumers from before expect */
+    HASH_ALGO_COUNT,
+};
+
+extern int hash_algo_from_name(const char *name);
+
+extern const char *hash_algo_name(int algo);
+
+extern void hash_digest(int algo,
+                        const char *str,
+                        size_t len,
+                        unsigned char *digest);
+
+extern void hex_digest(const unsigned char *digest, char *hex);
+
+#endif /* _HASH_H */
@@ -0,0 +1,611 @@
+/**
+ * journal.c - The sandbox's change journal.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "snapshot.h"
+
+/* Entries are written out at least this often... */
+#define JOURNAL_FLUSH_MS 100
+
+/* ...or sooner, if this much is waiting. */
+#define JOURNAL_BUFFER (64 << 10)
+
+/**
+ * write_all - write a buffer out in full
+ * @fd:  where to
+ * @buf: what
+ * @len: how much
+ */
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0) {
+        ssize_t done = write(fd, buf, len);
+        if(done < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "fssb: cannot write the journal\n");
+            return;
+        }
+        buf += done;
+        len -= done;
+    }
+}
+
+/**
+ * now_ms - milliseconds on the monotonic clock
+ */
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**
+ * flusher - the thread that writes the journal out
+ * @arg: the journal
+ *
+ * It's the only one that writes to the file, so the entries go in the
+ * order they were added.
+ */
+static void *flusher(void *arg)
+{
+    journal *j = (journal *)arg;
+    long last_sync = now_ms();
+
+    pthread_mutex_lock(&j->lock);
+    while(1) {
+        if(!j->stopping) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += JOURNAL_FLUSH_MS * 1000000L;
+            if(until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&j->wake, &j->lock, &until);
+        }
+
+        int stop = j->stopping;
+
+        /* swap buffers, so adding entries can go on while this one's
+           written */
+        char *buf = j->buf;
+        size_t used = j->used;
+        j->buf = j->spare;
+        j->spare = buf;
+        j->used = 0;
+        pthread_cond_broadcast(&j->drained);
+        pthread_mutex_unlock(&j->lock);
+
+        write_all(j->fd, buf, used);
+
+        if(j->sync_ms && (stop || now_ms() - last_sync >= j->sync_ms)) {
+            fdatasync(j->fd);
+            last_sync = now_ms();
+        }
+
+        if(stop)
+            return NULL;
+
+        pthread_mutex_lock(&j->lock);
+    }
+}
+
+/**
+ * new_journal - start a journal
+ * @path:      the file to keep it in
+ * @hash_algo: the hash the proxy file names are made with
+ * @sync_ms:   fdatasync it this often, in milliseconds; 0 for never
+ * @resume:    1 to add on to the journal already there, which must be whole
+ *
+ * Returns a (journal *) pointer, or NULL if the file can't be opened.
+ */
+journal *new_journal(char *path, int hash_algo, int sync_ms, int resume)
+{
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC |
+                        (resume ? 0 : O_CREAT | O_TRUNC), 0644);
+    if(fd < 0)
+        return NULL;
+
+    if(!resume) {
+        journal_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.record_size = JOURNAL_RECORD;
+        header.hash_algo = hash_algo;
+        write_all(fd, (char *)&header, sizeof(header));
+    }
+
+    journal *j = (journal *)malloc(sizeof(journal));
+    j->fd = fd;
+    j->buf = (char *)malloc(JOURNAL_BUFFER);
+    j->spare = (char *)malloc(JOURNAL_BUFFER);
+    j->used = 0;
+    j->stopping = 0;
+    j->sync_ms = sync_ms;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wake, NULL);
+    pthread_cond_init(&j->drained, NULL);
+
+    pthread_create(&j->flusher, NULL, flusher, j);
+
+    return j;
+}
+
+/**
+ * append_entry - put an entry of any type in the journal
+ * @j:         the journal
+ * @type:      the entry type
+ * @digest:    the path's digest
+ * @suffix:    the proxy file name's collision suffix
+ * @file_path: the path
+ * @sb:        the real file, for a JOURNAL_BASE; NULL otherwise
+ *
+ * This only copies the entry into the buffer; if the buffer's full, it
+ * waits for the flusher to take it.
+ */
+static void append_entry(journal *j,
+                         int type,
+                         const unsigned char *digest,
+                         int suffix,
+                         const char *file_path,
+                         const struct stat *sb)
+{
+    size_t len = strlen(file_path);
+
+    /* leave room for a terminator, so the compactor can use it in place */
+    size_t records = 1;
+    if(len + 1 > sizeof(((journal_entry *)0)->path))
+        records += (len + 1 - sizeof(((journal_entry *)0)->path) +
+                    JOURNAL_RECORD - 1) / JOURNAL_RECORD;
+    size_t size = records * JOURNAL_RECORD;
+
+    pthread_mutex_lock(&j->lock);
+
+    while(j->used + size > JOURNAL_BUFFER) {
+        pthread_cond_signal(&j->wake);
+        pthread_cond_wait(&j->drained, &j->lock);
+    }
+
+    char *p = j->buf + j->used;
+    memset(p, 0, size);
+
+    journal_entry *e = (journal_entry *)p;
+    e->type = type;
+    e->records = records;
+    e->suffix = suffix;
+    e->path_len = len;
+    memcpy(e->digest, digest, DIGEST_LEN);
+    if(sb) {
+        e->ino = sb->st_ino;
+        e->mtime_ns = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+    }
+    memcpy(e->path, file_path, len); /* on into the records after */
+
+    unsigned char check[DIGEST_LEN];
+    hash_digest(HASH_MURMUR3, p, size, check);
+    memcpy(&e->check, check, sizeof(e->check));
+
+    j->used += size;
+
+    pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * journal_add - put an entry in the journal
+ * @j:         the journal
+ * @type:      JOURNAL_ADD or JOURNAL_DELETE
+ * @digest:    the path's digest
+ * @suffix:    the proxy file name's collision suffix
+ * @file_path: the path
+ */
+void journal_add(journal *j,
+                 int type,
+                 const unsigned char *digest,
+                 int suffix,
+                 const char *file_path)
+{
+    append_entry(j, type, digest, suffix, file_path, NULL);
+}
+
+/**
+ * journal_base - note what the real file behind a proxyfile was
+ * @j:         the journal
+ * @digest:    the path's digest
+ * @suffix:    the proxy file name's collision suffix
+ * @file_path: the path
+ * @sb:        the real file, as it was when the proxy file was made
+ *
+ * Committing the sandbox checks the real file against this, so that a file
+ * changed behind the sandbox's back isn't overwritten.
+ */
+void journal_base(journal *j,
+                  const unsigned char *digest,
+                  int suffix,
+                  const char *file_path,
+                  const struct stat *sb)
+{
+    append_entry(j, JOURNAL_BASE, digest, suffix, file_path, sb);
+}
+
+/**
+ * journal_dir - note a directory the sandbox made
+ * @j:        the journal
+ * @digest:   the path's digest
+ * @dir_path: the path
+ * @mode:     the directory's permission bits
+ *
+ * Committing the sandbox makes the directory, with @mode, before the files
+ * that go in it.
+ */
+void journal_dir(journal *j,
+                 const unsigned char *digest,
+                 const char *dir_path,
+                 mode_t mode)
+{
+    append_entry(j, JOURNAL_DIR, digest, mode & 07777, dir_path, NULL);
+}
+
+/**
+ * close_journal - write out what's left and close the journal
+ * @j: the journal
+ */
+void close_journal(journal *j)
+{
+    pthread_mutex_lock(&j->lock);
+    j->stopping = 1;
+    pthread_cond_signal(&j->wake);
+    pthread_mutex_unlock(&j->lock);
+
+    pthread_join(j->flusher, NULL);
+
+    close(j->fd);
+    free(j->buf);
+    free(j->spare);
+    free(j);
+}
+
+/**
+ * entry_whole - check that an entry is all there
+ * @e:    the entry
+ * @room: bytes from the entry to the end of the journal
+ */
+static int entry_whole(journal_entry *e, size_t room)
+{
+    if(e->records == 0 || (size_t)e->records * JOURNAL_RECORD > room)
+        return 0;
+
+    size_t size = (size_t)e->records * JOURNAL_RECORD;
+    if(e->path_len + 1 > size - offsetof(journal_entry, path))
+        return 0;
+
+    uint32_t check = e->check;
+    unsigned char digest[DIGEST_LEN];
+    e->check = 0;
+    hash_digest(HASH_MURMUR3, (char *)e, size, digest);
+    e->check = check;
+
+    return memcmp(&check, digest, sizeof(check)) == 0;
+}
+
+typedef struct {
+    journal_entry *e;
+    int order;
+} replayed;
+
+/* comp function for qsort: by path, then in the order they happened */
+static int comp_replayed(const void *a, const void *b)
+{
+    const replayed *x = (const replayed *)a, *y = (const replayed *)b;
+    int c = strcmp(x->e->path, y->e->path);
+    return c ? c : x->order - y->order;
+}
+
+/**
+ * replay_journal - work out which proxyfiles a journal adds up to
+ * @SANDBOX_DIR: the sandbox directory
+ * @r:           filled in; free_replay it once done
+ *
+ * A path has a proxyfile if the last entry for it is a JOURNAL_ADD.  Those
+ * end up in @r->entries in the order they were added, as they would be in
+ * the proxyfile_list, the paths last deleted in @r->deleted and the
+ * directories the sandbox made in @r->dirs.  Each gets the first
+ * JOURNAL_BASE of its path's, if there's one.  Should the journal end in an
+ * entry a crash cut short, that one's left out, and @r->size is where the
+ * whole entries end.
+ *
+ * Returns 0 on success, -1 if there's no journal to go by.
+ */
+int replay_journal(char *SANDBOX_DIR, journal_replay *r)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%sjournal", SANDBOX_DIR);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if(fd < 0 || fstat(fd, &sb) != 0) {
+        fprintf(stderr, "fssb: error: cannot open %s\n", path);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    size_t size = sb.st_size;
+    char *data = (char *)malloc(size + 1);
+    size_t got = 0;
+    while(got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if(n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+    size = got;
+
+    journal_header *header = (journal_header *)data;
+    if(size < sizeof(journal_header) ||
+       memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+       header->record_size != JOURNAL_RECORD) {
+        fprintf(stderr, "fssb: error: %s is not a journal\n", path);
+        free(data);
+        return -1;
+    }
+
+    /* there can't be more entries than records */
+    int count = 0;
+    replayed *entries = (replayed *)malloc((size / JOURNAL_RECORD) *
+                                           sizeof(replayed));
+
+    size_t off = JOURNAL_RECORD;
+    while(off + JOURNAL_RECORD <= size) {
+        journal_entry *e = (journal_entry *)(data + off);
+        if(!entry_whole(e, size - off))
+            break;
+
+        entries[count].e = e;
+        entries[count].order = count;
+        count++;
+        off += (size_t)e->records * JOURNAL_RECORD;
+    }
+
+    qsort(entries, count, sizeof(replayed), comp_replayed);
+
+    /* one path at a time */
+    char *live = (char *)calloc(count + 1, 1);
+    int i, first;
+    for(first = 0; first < count; first = i) {
+        journal_entry *base = NULL;
+        int last = -1;
+        for(i = first; i < count && strcmp(entries[i].e->path,
+                                           entries[first].e->path) == 0; i++) {
+            if(entries[i].e->type != JOURNAL_BASE)
+                last = i;
+            else if(!base)
+                base = entries[i].e;
+        }
+
+        if(last < 0)
+            continue;
+
+        journal_entry *e = entries[last].e;
+        if(base) {
+            e->ino = base->ino;
+            e->mtime_ns = base->mtime_ns;
+        }
+        live[entries[last].order] = e->type == JOURNAL_ADD ? 1 :
+                                    e->type == JOURNAL_DIR ? 3 : 2;
+    }
+
+    /* back in the order they happened */
+    journal_entry **ordered = (journal_entry **)malloc((count + 1) *
+                                                       sizeof(journal_entry *));
+    for(i = 0; i < count; i++)
+        ordered[entries[i].order] = entries[i].e;
+
+    r->count = 0;
+    r->deleted_count = 0;
+    r->entries = ordered;
+    r->dir_count = 0;
+    r->deleted = (journal_entry **)malloc((count + 1) *
+                                          sizeof(journal_entry *));
+    r->dirs = (journal_entry **)malloc((count + 1) * sizeof(journal_entry *));
+    for(i = 0; i < count; i++) {
+        if(live[i] == 1)
+            r->entries[r->count++] = ordered[i];
+        else if(live[i] == 2)
+            r->deleted[r->deleted_count++] = ordered[i];
+        else if(live[i] == 3)
+            r->dirs[r->dir_count++] = ordered[i];
+    }
+
+    r->hash_algo = header->hash_algo;
+    r->size = off;
+    r->data = data;
+
+    free(live);
+    free(entries);
+
+    return 0;
+}
+
+/**
+ * free_replay - free what replay_journal filled in
+ * @r: the replay
+ */
+void free_replay(journal_replay *r)
+{
+    free(r->entries);
+    free(r->deleted);
+    free(r->dirs);
+    free(r->data);
+}
+
+/**
+ * copy_entry - copy an entry out of a replay, as another type
+ * @to:   where to
+ * @e:    the entry
+ * @type: the type to give the copy
+ *
+ * Only a JOURNAL_BASE keeps what replay_journal put in @ino and @mtime_ns.
+ *
+ * Returns the size of the copy.
+ */
+static size_t copy_entry(char *to, journal_entry *e, int type)
+{
+    size_t size = (size_t)e->records * JOURNAL_RECORD;
+    memcpy(to, e, size);
+
+    journal_entry *copy = (journal_entry *)to;
+    copy->type = type;
+    copy->check = 0;
+    if(type != JOURNAL_BASE) {
+        copy->ino = 0;
+        copy->mtime_ns = 0;
+    }
+
+    unsigned char check[DIGEST_LEN];
+    hash_digest(HASH_MURMUR3, to, size, check);
+    memcpy(&copy->check, check, sizeof(copy->check));
+
+    return size;
+}
+
+/**
+ * rewrite_journal - replace a journal with just what it adds up to
+ * @SANDBOX_DIR: the sandbox directory
+ * @r:           the journal's replay; @r->size becomes the new size
+ *
+ * What's left is each directory the sandbox made, then each live path's
+ * JOURNAL_ADD and each deleted real file's JOURNAL_DELETE, after the
+ * JOURNAL_BASE that goes with it.  Paths the
+ * sandbox made and deleted again leave nothing behind.  The new journal is
+ * written alongside and renamed over the old one, so a crash leaves one or
+ * the other.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+static int rewrite_journal(char *SANDBOX_DIR, journal_replay *r)
+{
+    char path[PATH_MAX], new_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%sjournal", SANDBOX_DIR);
+    snprintf(new_path, sizeof(new_path), "%sjournal.new", SANDBOX_DIR);
+
+    /* every entry here and its base were in the old one already */
+    char *data = (char *)malloc(r->size);
+    size_t size = JOURNAL_RECORD;
+    memcpy(data, r->data, JOURNAL_RECORD); /* the header */
+
+    int i;
+    for(i = 0; i < r->dir_count; i++)
+        size += copy_entry(data + size, r->dirs[i], JOURNAL_DIR);
+
+    for(i = 0; i < r->count + r->deleted_count; i++) {
+        int deleted = i >= r->count;
+        journal_entry *e = deleted ? r->deleted[i - r->count] : r->entries[i];
+        int based = e->ino || e->mtime_ns;
+
+        if(deleted && !based)
+            continue;
+        if(based)
+            size += copy_entry(data + size, e, JOURNAL_BASE);
+        size += copy_entry(data + size, e,
+                           deleted ? JOURNAL_DELETE : JOURNAL_ADD);
+    }
+
+    int fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", new_path);
+        free(data);
+        return -1;
+    }
+    write_all(fd, data, size);
+    fdatasync(fd);
+    close(fd);
+    free(data);
+
+    if(rename(new_path, path) != 0) {
+        fprintf(stderr, "fssb: error: cannot replace %s\n", path);
+        unlink(new_path);
+        return -1;
+    }
+
+    r->size = size;
+    return 0;
+}
+
+/**
+ * compact_journal - write the file-map and the snapshot a journal adds up to
+ * @SANDBOX_DIR: the sandbox directory
+ * @rewrite:     1 to cut the journal itself down to what it adds up to too
+ *
+ * Rewriting it is only for when no fssb is tracing into the sandbox any
+ * more, as its entries would go to the old journal.
+ *
+ * Returns 0 on success, -1 if there's no journal to go by or the files
+ * can't be written.
+ */
+int compact_journal(char *SANDBOX_DIR, int rewrite)
+{
+    journal_replay r;
+    if(replay_journal(SANDBOX_DIR, &r) != 0)
+        return -1;
+
+    if(rewrite && rewrite_journal(SANDBOX_DIR, &r) != 0) {
+        free_replay(&r);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%sfile-map", SANDBOX_DIR);
+    FILE *pfm = fopen(path, "w");
+    if(pfm == NULL) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", path);
+        free_replay(&r);
+        return -1;
+    }
+
+    int i;
+    for(i = 0; i < r.count; i++) {
+        char name[2*DIGEST_LEN + 12];
+        hex_digest(r.entries[i]->digest, name);
+        if(r.entries[i]->suffix)
+            sprintf(name + 2*DIGEST_LEN, "-%d", r.entries[i]->suffix);
+
+        fprintf(pfm, "%s%s = %s\n", SANDBOX_DIR, name, r.entries[i]->path);
+    }
+
+    fclose(pfm);
+
+    int retval = write_snapshot(SANDBOX_DIR, &r);
+    free_replay(&r);
+
+    return retval;
+}
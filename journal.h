@@ -0,0 +1,133 @@
+/**
+ * journal.h - The sandbox's change journal.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+/* The journal is read and written in records of this size. */
+#define JOURNAL_RECORD 64
+
+#define JOURNAL_MAGIC "FSSBJNL2"
+
+/* entry types */
+#define JOURNAL_ADD    1 /* a proxyfile was made for the path */
+#define JOURNAL_DELETE 2 /* the path's proxyfile went away */
+#define JOURNAL_BASE   3 /* the real file the path's proxy file came from */
+#define JOURNAL_DIR    4 /* the sandbox made a directory at the path */
+
+/**
+ * journal_header - the first record of the journal
+ */
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t hash_algo;
+    char unused[JOURNAL_RECORD - 16];
+} journal_header;
+
+/**
+ * journal_entry - the first record of an entry
+ *
+ * The path runs on from @path into as many more records as it needs;
+ * @records counts them all.  @check is over the whole entry (with @check
+ * itself zero), so an entry a crash cut short can be told from a whole one.
+ * A rename is a JOURNAL_DELETE of the old path and a JOURNAL_ADD of the new.
+ * @ino and @mtime_ns say what the real file was when the sandbox first saw
+ * it; they're only written in a JOURNAL_BASE, and are 0 if there was none.
+ * A directory has no proxy file, so a JOURNAL_DIR keeps its mode in @suffix.
+ */
+typedef struct {
+    uint16_t type;
+    uint16_t records;
+    uint32_t suffix;
+    uint32_t path_len;
+    uint32_t check;
+    unsigned char digest[DIGEST_LEN];
+    uint64_t ino;
+    int64_t mtime_ns;
+    char path[JOURNAL_RECORD - 48];
+} journal_entry;
+
+/**
+ * journal - the tracer's handle on the journal
+ *
+ * Entries go into @buf and a thread of the journal's own writes them out
+ * every so often, so adding one doesn't cost a syscall.
+ */
+typedef struct {
+    int fd;
+    char *buf, *spare;
+    size_t used;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, drained;
+    pthread_t flusher;
+    int stopping;
+    int sync_ms; /* fdatasync this often; 0 for never */
+} journal;
+
+/**
+ * journal_replay - what a journal adds up to
+ */
+typedef struct {
+    journal_entry **entries; /* the live JOURNAL_ADDs, oldest first */
+    int count;
+    journal_entry **deleted; /* the JOURNAL_DELETEs that were last */
+    int deleted_count;
+    journal_entry **dirs; /* the JOURNAL_DIRs that were last, oldest first */
+    int dir_count;
+    int hash_algo;
+    size_t size; /* of the journal, up to the end of its last whole entry */
+    char *data;
+} journal_replay;
+
+extern journal *new_journal(char *path, int hash_algo, int sync_ms,
+                            int resume);
+
+extern void journal_add(journal *j,
+                        int type,
+                        const unsigned char *digest,
+                        int suffix,
+                        const char *file_path);
+
+extern void journal_base(journal *j,
+                         const unsigned char *digest,
+                         int suffix,
+                         const char *file_path,
+                         const struct stat *sb);
+
+extern void journal_dir(journal *j,
+                        const unsigned char *digest,
+                        const char *dir_path,
+                        mode_t mode);
+
+extern void close_journal(journal *j);
+
+extern int replay_journal(char *SANDBOX_DIR, journal_replay *r);
+
+extern void free_replay(journal_replay *r);
+
+extern int compact_journal(char *SANDBOX_DIR, int rewrite);
+
+#endif /* _JOURNAL_H */
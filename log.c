@@ -0,0 +1,292 @@
+/**
+ * log.c - Debug logging.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/* must be a power of two */
+#define LOG_RING_SLOTS 1024
+
+/* how long the writer sleeps when there's nothing to write */
+#define LOG_IDLE_NS 1000000
+
+/**
+ * log_record - one line, not yet formatted
+ *
+ * Numbers are kept as they are, and strings are copied into @strings with
+ * their offsets in @args; the writer goes through @fmt again to put them
+ * back together.
+ */
+typedef struct {
+    unsigned long seq;
+    const char *fmt;
+    int nargs;
+    long args[LOG_MAX_ARGS];
+    char strings[LOG_STRING_SPACE];
+} log_record;
+
+/* set by -d */
+int log_level = LOG_OFF;
+
+/*
+ * The ring is a bounded queue after Dmitry Vyukov's: a slot's seq says
+ * whose turn it is, so any number of threads can put records in without a
+ * lock and the writer thread takes them out in order.  A slot at position
+ * pos is free when seq == pos, full when seq == pos + 1, and is free again
+ * for the next lap once the writer sets seq to pos + LOG_RING_SLOTS.
+ */
+static log_record *ring;
+static unsigned long enqueue_pos;
+
+static FILE *log_out;
+static pthread_t writer_thread;
+static int stopping;
+
+/**
+ * claim_slot - get a slot in the ring to fill
+ * @pos: filled with the slot's position
+ *
+ * If the ring is full, this waits for the writer rather than lose the
+ * record.
+ */
+static log_record *claim_slot(unsigned long *pos)
+{
+    unsigned long p = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+
+    while(1) {
+        log_record *r = &ring[p & (LOG_RING_SLOTS - 1)];
+        unsigned long seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - p);
+
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&enqueue_pos, &p, p + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = p;
+                return r;
+            }
+            /* someone else got it; p is where they left off */
+        }
+        else {
+            if(diff < 0)
+                sched_yield();
+            p = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * log_write - put a line in the ring; use log_msg instead
+ * @fmt: the format, a string literal
+ */
+void log_write(const char *fmt, ...)
+{
+    unsigned long pos;
+    log_record *r = claim_slot(&pos);
+
+    r->fmt = fmt;
+    r->nargs = 0;
+    size_t used = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    const char *p;
+    for(p = fmt; *p && r->nargs < LOG_MAX_ARGS; p++) {
+        if(*p != '%')
+            continue;
+        if(*++p == '%')
+            continue;
+
+        int is_long = *p == 'l';
+        if(is_long)
+            p++;
+
+        switch(*p) {
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if(s == NULL)
+                s = "(null)";
+
+            if(used == LOG_STRING_SPACE) {
+                /* out of room: point at the last string's terminator */
+                r->args[r->nargs++] = used - 1;
+                break;
+            }
+
+            size_t len = strnlen(s, LOG_STRING_SPACE - used - 1);
+            memcpy(r->strings + used, s, len);
+            r->strings[used + len] = '\0';
+            r->args[r->nargs++] = used;
+            used += len + 1;
+            break;
+        }
+        case 'p':
+            r->args[r->nargs++] = (long)va_arg(ap, void *);
+            break;
+        default:
+            r->args[r->nargs++] = is_long ? va_arg(ap, long)
+                                          : va_arg(ap, int);
+            break;
+        }
+    }
+
+    va_end(ap);
+
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * format_record - write out a record the way printf would have
+ * @out: where to
+ * @r:   the record
+ */
+static void format_record(FILE *out, log_record *r)
+{
+    const char *p = r->fmt;
+    int n = 0;
+
+    while(*p) {
+        if(*p != '%') {
+            fputc(*p++, out);
+            continue;
+        }
+
+        if(*++p == '%') {
+            fputc(*p++, out);
+            continue;
+        }
+
+        int is_long = *p == 'l';
+        if(is_long)
+            p++;
+
+        if(n == r->nargs)
+            break;
+        long arg = r->args[n++];
+
+        switch(*p++) {
+        case 's':
+            fputs(r->strings + arg, out);
+            break;
+        case 'c':
+            fputc((int)arg, out);
+            break;
+        case 'p':
+            fprintf(out, "%p", (void *)arg);
+            break;
+        case 'u':
+            if(is_long)
+                fprintf(out, "%lu", (unsigned long)arg);
+            else
+                fprintf(out, "%u", (unsigned int)arg);
+            break;
+        case 'x':
+            if(is_long)
+                fprintf(out, "%lx", (unsigned long)arg);
+            else
+                fprintf(out, "%x", (unsigned int)arg);
+            break;
+        default:
+            if(is_long)
+                fprintf(out, "%ld", arg);
+            else
+                fprintf(out, "%d", (int)arg);
+            break;
+        }
+    }
+}
+
+/**
+ * writer - the thread that formats the records and writes them out
+ * @arg: unused
+ *
+ * It only flushes once it has caught up, so a burst of records costs one
+ * write.
+ */
+static void *writer(void *arg)
+{
+    (void)arg;
+
+    unsigned long pos = 0;
+    struct timespec idle = { 0, LOG_IDLE_NS };
+
+    while(1) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+
+        log_record *r = &ring[pos & (LOG_RING_SLOTS - 1)];
+        if(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == pos + 1) {
+            format_record(log_out, r);
+            __atomic_store_n(&r->seq, pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+            pos++;
+            continue;
+        }
+
+        fflush(log_out);
+        if(stop)
+            break;
+
+        nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * start_log - start logging
+ * @out:   where the lines go
+ * @level: the most detailed level to log
+ */
+void start_log(FILE *out, int level)
+{
+    ring = (log_record *)malloc(LOG_RING_SLOTS * sizeof(log_record));
+    unsigned long i;
+    for(i = 0; i < LOG_RING_SLOTS; i++)
+        ring[i].seq = i;
+
+    log_out = out;
+    pthread_create(&writer_thread, NULL, writer, NULL);
+
+    log_level = level;
+}
+
+/**
+ * stop_log - write out what's left and stop logging
+ *
+ * Call this once nothing else is logging.
+ */
+void stop_log()
+{
+    if(log_level == LOG_OFF)
+        return;
+
+    log_level = LOG_OFF;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+
+    free(ring);
+    ring = NULL;
+}
@@ -0,0 +1,63 @@
+/**
+ * log.h - Debug logging.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdio.h>
+
+/* levels, least chatty first */
+#define LOG_OFF   0
+#define LOG_INFO  1 /* once a run or once a process */
+#define LOG_DEBUG 2 /* every syscall we act on */
+
+/* Levels above this aren't compiled in at all; build with
+   -DLOG_MAX_LEVEL=LOG_INFO to drop the per-syscall ones. */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+/* A record holds at most this many conversions... */
+#define LOG_MAX_ARGS 4
+
+/* ...and this many bytes of the strings among them; longer ones are cut. */
+#define LOG_STRING_SPACE 1024
+
+extern int log_level;
+
+/*
+ * log_msg(level, fmt, ...) - log a line, if level is on
+ *
+ * fmt has to be a string literal (it's formatted later, on another thread)
+ * and may only use %s, %c, %d, %i, %u, %x and %p, with or without an l.
+ * With the level off, all this costs is a test of log_level.
+ */
+#define log_msg(level, ...) \
+    do { \
+        if((level) <= LOG_MAX_LEVEL && (level) <= log_level) \
+            log_write(__VA_ARGS__); \
+    } while(0)
+
+extern void start_log(FILE *out, int level);
+
+extern void stop_log();
+
+extern void log_write(const char *fmt, ...);
+
+#endif /* _LOG_H */
@@ -0,0 +1,723 @@
+/**
+ * notify.c - The seccomp user notification backend.  Part of the FSSB
+ * project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With -b seccomp, nothing is traced.  The child installs a filter that
+ * makes the filesystem syscalls wait for us, and we get told about each one
+ * on a notification fd.  Instead of rewriting the arguments, we do the work
+ * ourselves: an open that goes to the sandbox is made here and the fd is
+ * put into the child with SECCOMP_IOCTL_NOTIF_ADDFD, a stat of a sandboxed
+ * file is made here and the result written into the child, and so on.
+ * Everything else is let through to the kernel as it is.
+ *
+ * Letting a syscall through re-reads the arguments from the child's memory,
+ * so another thread of the child could swap a path under us between our look
+ * and the kernel's.  That's fine for keeping honest programs' changes in the
+ * sandbox, which is what fssb is for, but this is not a security boundary.
+ */
+
+#define _GNU_SOURCE  /* for statx and renameat2 */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/openat2.h>
+#include <linux/seccomp.h>
+
+#include "notify.h"
+#include "seccomp.h"
+#include "utils.h"
+#include "path.h"
+#include "stats.h"
+#include "log.h"
+
+#ifdef __amd64__
+#define FSSB_AUDIT_ARCH AUDIT_ARCH_X86_64
+#else
+#define FSSB_AUDIT_ARCH AUDIT_ARCH_I386
+#endif
+
+/* The syscalls handle_notif cares about; keep this in sync with it. */
+static const int notified_syscalls[] = {
+    SYS_open, SYS_openat, SYS_openat2, SYS_creat,
+    SYS_unlink, SYS_unlinkat,
+    SYS_rename, SYS_renameat, SYS_renameat2,
+    SYS_stat, SYS_lstat, SYS_newfstatat, SYS_statx,
+    SYS_access, SYS_faccessat, SYS_faccessat2,
+};
+
+static proxyfile_list *list;
+static int listener;
+static struct seccomp_notif_sizes sizes;
+
+/* One thread at a time waits for the next notification; the rest are busy
+   with the ones they've got.  Once the child and everything it started are
+   gone, done is set and the threads wrap up. */
+static pthread_mutex_t recv_lock = PTHREAD_MUTEX_INITIALIZER;
+static int done;
+
+/**
+ * install_notify - install the filter and send its fd to the supervisor
+ * @sock:   our end of a socket pair with the supervisor
+ * @cookie: lets through syscalls the shim has rewritten, if not 0
+ *
+ * This must be called in the child before it execs.  The filter survives the
+ * exec and is inherited by every process the child creates.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int install_notify(int sock, unsigned long cookie)
+{
+    int count = sizeof(notified_syscalls) / sizeof(notified_syscalls[0]);
+    int fd = install_notify_filter(notified_syscalls, count, cookie);
+    if(fd < 0)
+        return -1;
+
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int retval = sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+
+    close(fd);
+    close(sock);
+    return retval;
+}
+
+/**
+ * receive_listener - get the notification fd install_notify sent
+ * @sock: our end of the socket pair with the child
+ *
+ * Returns the fd, or -1 if the child didn't get as far as sending it.
+ */
+int receive_listener(int sock)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    if(recvmsg(sock, &msg, 0) != 1)
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * notify_dir - get the directory a relative path of the child starts from
+ * @pid:   the process that made the syscall
+ * @dirfd: its directory fd, or AT_FDCWD
+ *
+ * Unlike the tracer, we don't see the chdirs and the opens of directories
+ * go by, so we ask /proc every time.
+ *
+ * Returns a (char *) pointer to be freed, or NULL if @dirfd isn't a
+ * directory.
+ */
+static char *notify_dir(pid_t pid, int dirfd)
+{
+    char link[64], target[PATH_MAX];
+    if(dirfd == AT_FDCWD)
+        sprintf(link, "/proc/%d/cwd", pid);
+    else
+        sprintf(link, "/proc/%d/fd/%d", pid, dirfd);
+
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if(n <= 0)
+        return NULL;
+    target[n] = 0;
+
+    struct stat sb;
+    if(target[0] != '/' || stat(target, &sb) || !S_ISDIR(sb.st_mode))
+        return NULL;
+
+    return strdup(target);
+}
+
+/**
+ * notify_path - read a path argument and resolve it the way the index does
+ * @req:       the notification
+ * @dirfd_arg: which argument is the directory fd, -1 if there's none
+ * @n:         which argument is the path
+ *
+ * Returns a (char *) pointer to be freed, or NULL if the syscall doesn't name
+ * a path we can make sense of; those are best left for the kernel to fail.
+ */
+static char *notify_path(struct seccomp_notif *req, int dirfd_arg, int n)
+{
+    char *raw = get_string(req->pid, req->data.args[n]);
+    char *retval = NULL;
+
+    /* If the process died in the meantime, its PID may be someone else's
+       already, and what we read is no good. */
+    if(ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) == 0 &&
+       raw[0] != 0) {
+        int dirfd = dirfd_arg == -1 ? AT_FDCWD
+                                    : (int)req->data.args[dirfd_arg];
+
+        char *dir = raw[0] == '/' ? strdup("/") : notify_dir(req->pid, dirfd);
+        if(dir) {
+            retval = canonical_path(dir, raw);
+            free(dir);
+        }
+    }
+
+    free(raw);
+    return retval;
+}
+
+/**
+ * send_fd - put an fd into the child as the result of its syscall
+ * @req:     the notification
+ * @resp:    the response, if one still needs to be sent
+ * @fd:      our fd; it's closed
+ * @cloexec: whether the child asked for O_CLOEXEC
+ *
+ * Returns 1 if @resp still needs to be sent, 0 if not.
+ */
+static int send_fd(struct seccomp_notif *req,
+                   struct seccomp_notif_resp *resp,
+                   int fd,
+                   int cloexec)
+{
+    struct seccomp_notif_addfd addfd = {
+        .id = req->id,
+        .flags = SECCOMP_ADDFD_FLAG_SEND,
+        .srcfd = fd,
+        .newfd = 0,
+        .newfd_flags = cloexec ? O_CLOEXEC : 0,
+    };
+
+    int ret = ioctl(listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+    if(ret < 0 && errno == EINVAL) {
+        /* before Linux 5.14, the fd is added and then sent as the result */
+        addfd.flags = 0;
+        ret = ioctl(listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+        if(ret >= 0) {
+            close(fd);
+            resp->val = ret;
+            return 1;
+        }
+    }
+
+    int err = errno;
+    close(fd);
+
+    if(ret >= 0 || err == ENOENT) /* sent, or nobody's waiting any more */
+        return 0;
+
+    resp->error = -err;
+    return 1;
+}
+
+/**
+ * child_umask - get the umask of a process of the child
+ * @pid: the process
+ *
+ * Returns the umask, or 022 if /proc doesn't say (before Linux 4.7).
+ */
+static mode_t child_umask(pid_t pid)
+{
+    char status[64];
+    sprintf(status, "/proc/%d/status", pid);
+
+    FILE *f = fopen(status, "re");
+    if(!f)
+        return 022;
+
+    mode_t mask = 022;
+    char line[256];
+    unsigned int val;
+    while(fgets(line, sizeof(line), f))
+        if(sscanf(line, "Umask: %o", &val) == 1) {
+            mask = val;
+            break;
+        }
+
+    fclose(f);
+    return mask;
+}
+
+/**
+ * handle_open - the open family
+ * @req:  the notification
+ * @resp: the response
+ *
+ * A file we make here would get our umask rather than the child's, so it's
+ * made with no permissions at all and given the child's mode afterwards.
+ *
+ * Returns 1 if @resp still needs to be sent, 0 if not.
+ */
+static int handle_open(struct seccomp_notif *req,
+                       struct seccomp_notif_resp *resp)
+{
+    /* int open(const char *pathname, int flags, mode_t mode); */
+    /* int openat(int dirfd, const char *pathname, int flags, mode_t mode); */
+    /* long openat2(int dirfd, const char *pathname,
+                    struct open_how *how, size_t size); */
+    /* int creat(const char *pathname, mode_t mode); */
+
+    int nr = req->data.nr, dirfd_arg = -1, path_arg = 0;
+    long flags = O_CREAT|O_WRONLY|O_TRUNC, mode = req->data.args[1];
+
+    if(nr == SYS_open) {
+        flags = req->data.args[1];
+        mode = req->data.args[2];
+    }
+    else if(nr == SYS_openat) {
+        dirfd_arg = 0;
+        path_arg = 1;
+        flags = req->data.args[2];
+        mode = req->data.args[3];
+    }
+    else if(nr == SYS_openat2) {
+        /* the resolve flags are left out in the sandbox */
+        struct open_how how;
+        if(read_child_mem(req->pid, req->data.args[2], &how, sizeof(how)) !=
+           sizeof(how))
+            return 1;
+
+        dirfd_arg = 0;
+        path_arg = 1;
+        flags = how.flags;
+        mode = how.mode;
+    }
+
+    char *pathname = notify_path(req, dirfd_arg, path_arg);
+    if(!pathname)
+        return 1;
+
+    proxyfile *cur = proxyfile_for_open(list, &pathname, flags);
+    free(pathname);
+
+    if(!cur)
+        return 1;
+
+    resp->flags = 0;
+
+    int fd = -1;
+    if((flags & O_CREAT) &&
+       (fd = open(cur->proxy_path, (flags | O_EXCL) & ~O_CLOEXEC, 0)) >= 0)
+        fchmod(fd, mode & 07777 & ~child_umask(req->pid));
+    else if(!(flags & O_CREAT) || (errno == EEXIST && !(flags & O_EXCL)))
+        fd = open(cur->proxy_path, flags & ~O_CLOEXEC, mode);
+    if(fd < 0) {
+        resp->error = -errno;
+        return 1;
+    }
+
+    return send_fd(req, resp, fd, flags & O_CLOEXEC);
+}
+
+/**
+ * handle_stat - the stat and access families
+ * @req:  the notification
+ * @resp: the response
+ *
+ * Returns 1 if @resp still needs to be sent.
+ */
+static int handle_stat(struct seccomp_notif *req,
+                       struct seccomp_notif_resp *resp)
+{
+    /* int stat(const char *pathname, struct stat *buf); */
+    /* int lstat(const char *pathname, struct stat *buf); */
+    /* int access(const char *pathname, int mode); */
+    /* int newfstatat(int dirfd, const char *pathname,
+                      struct stat *buf, int flags); */
+    /* int statx(int dirfd, const char *pathname, int flags,
+                 unsigned int mask, struct statx *buf); */
+    /* int faccessat(int dirfd, const char *pathname, int mode); */
+    /* int faccessat2(int dirfd, const char *pathname, int mode,
+                      int flags); */
+
+    int nr = req->data.nr, dirfd_arg = -1, path_arg = 0;
+    if(nr != SYS_stat && nr != SYS_lstat && nr != SYS_access) {
+        dirfd_arg = 0;
+        path_arg = 1;
+    }
+
+    char *pathname = notify_path(req, dirfd_arg, path_arg);
+    if(!pathname)
+        return 1;
+
+    proxyfile *cur = search_proxyfile(list, pathname);
+    free(pathname);
+
+    if(!cur) /* not a file we've written to */
+        return 1;
+
+    wait_proxyfile(list, cur);
+
+    unsigned long *args = (unsigned long *)req->data.args;
+    int ret;
+
+    if(nr == SYS_stat || nr == SYS_lstat || nr == SYS_newfstatat) {
+        int flags = nr == SYS_lstat ? AT_SYMLINK_NOFOLLOW :
+                    nr == SYS_newfstatat ? (int)args[3] : 0;
+        unsigned long buf = nr == SYS_newfstatat ? args[2] : args[1];
+
+        struct stat sb;
+        ret = fstatat(AT_FDCWD, cur->proxy_path, &sb, flags);
+        if(ret == 0 &&
+           write_child_mem(req->pid, buf, &sb, sizeof(sb)) != sizeof(sb)) {
+            ret = -1;
+            errno = EFAULT;
+        }
+    }
+    else if(nr == SYS_statx) {
+        struct statx stx;
+        ret = statx(AT_FDCWD, cur->proxy_path, args[2], args[3], &stx);
+        if(ret == 0 &&
+           write_child_mem(req->pid, args[4], &stx, sizeof(stx)) !=
+           sizeof(stx)) {
+            ret = -1;
+            errno = EFAULT;
+        }
+    }
+    else if(nr == SYS_access)
+        ret = faccessat(AT_FDCWD, cur->proxy_path, args[1], 0);
+    else
+        ret = faccessat(AT_FDCWD, cur->proxy_path, args[2],
+                        nr == SYS_faccessat2 ? (int)args[3] : 0);
+
+    resp->flags = 0;
+    if(ret < 0)
+        resp->error = -errno;
+    return 1;
+}
+
+/**
+ * handle_unlink - unlink and unlinkat
+ * @req:  the notification
+ * @resp: the response
+ *
+ * Returns 1 if @resp still needs to be sent.
+ */
+static int handle_unlink(struct seccomp_notif *req,
+                         struct seccomp_notif_resp *resp)
+{
+    /* int unlink(const char *pathname); */
+    /* int unlinkat(int dirfd, const char *pathname, int flags); */
+
+    int dirfd_arg = -1, path_arg = 0, flags = 0;
+    if(req->data.nr == SYS_unlinkat) {
+        dirfd_arg = 0;
+        path_arg = 1;
+        flags = req->data.args[2];
+    }
+
+    char *pathname = notify_path(req, dirfd_arg, path_arg);
+    if(!pathname)
+        return 1;
+
+    log_msg(LOG_DEBUG, "unlink %s\n", pathname);
+
+    proxyfile *cur = search_proxyfile(list, pathname);
+    char *new_name;
+
+    if(cur) /* a lower layer's isn't ours to remove */
+        cur = own_proxyfile(list, cur, 1);
+
+    struct stat sb;
+    if(cur) /* it's a file we've previously written to */
+        new_name = strdup(cur->proxy_path);
+    else if(!stat(pathname, &sb)) { /* this file actually exists */
+        new_name = get_proxy_path(list, pathname);
+        fclose(fopen(new_name, "w"));
+    }
+    else { /* this file doesn't exist; so let them try to remove it */
+        free(pathname);
+        return 1;
+    }
+
+    resp->flags = 0;
+    if(unlinkat(AT_FDCWD, new_name, flags) < 0)
+        resp->error = -errno;
+    else if(cur) /* let's take this off our records */
+        delete_proxyfile(list, cur);
+    else /* a real file; we still need to know */
+        note_unlink(list, pathname);
+
+    free(new_name);
+    free(pathname);
+    return 1;
+}
+
+/**
+ * handle_rename - the rename family
+ * @req:  the notification
+ * @resp: the response
+ *
+ * Returns 1 if @resp still needs to be sent.
+ */
+static int handle_rename(struct seccomp_notif *req,
+                         struct seccomp_notif_resp *resp)
+{
+    /* int rename(const char *oldpath, const char *newpath); */
+    /* int renameat(int olddirfd, const char *oldpath,
+                    int newdirfd, const char *newpath); */
+    /* int renameat2(int olddirfd, const char *oldpath,
+                     int newdirfd, const char *newpath,
+                     unsigned int flags); */
+
+    char *oldpath, *newpath;
+    unsigned int flags = 0;
+
+    if(req->data.nr == SYS_rename) {
+        oldpath = notify_path(req, -1, 0);
+        newpath = notify_path(req, -1, 1);
+    }
+    else {
+        oldpath = notify_path(req, 0, 1);
+        newpath = notify_path(req, 2, 3);
+        if(req->data.nr == SYS_renameat2)
+            flags = req->data.args[4];
+    }
+
+    if(!oldpath || !newpath) {
+        free(oldpath);
+        free(newpath);
+        return 1;
+    }
+
+    log_msg(LOG_DEBUG, "rename %s -> %s\n", oldpath, newpath);
+
+    proxyfile_for_rename(list, &oldpath);
+    char *new_old_name = get_proxy_path(list, oldpath),
+         *new_new_name = get_proxy_path(list, newpath);
+
+    resp->flags = 0;
+    if(renameat2(AT_FDCWD, new_old_name, AT_FDCWD, new_new_name, flags) < 0)
+        resp->error = -errno;
+    else if(rename_proxyfile(list, oldpath, newpath))
+        newpath = NULL; /* the proxyfile owns it now */
+
+    free(new_old_name);
+    free(new_new_name);
+    free(oldpath);
+    free(newpath);
+    return 1;
+}
+
+/**
+ * handle_notif - decide on a syscall the child is waiting on
+ * @req:  the notification
+ * @resp: the response, set up to let the syscall through
+ *
+ * Returns 1 if @resp still needs to be sent, 0 if not.
+ */
+static int handle_notif(struct seccomp_notif *req,
+                        struct seccomp_notif_resp *resp)
+{
+    /* the filter sends these our way without looking; see seccomp.c */
+    if(req->data.arch != FSSB_AUDIT_ARCH)
+        return 1;
+
+    switch(req->data.nr) {
+        case SYS_open:
+        case SYS_openat:
+        case SYS_openat2:
+        case SYS_creat:
+            return handle_open(req, resp);
+        case SYS_stat:
+        case SYS_lstat:
+        case SYS_access:
+        case SYS_newfstatat:
+        case SYS_statx:
+        case SYS_faccessat:
+        case SYS_faccessat2:
+            return handle_stat(req, resp);
+        case SYS_unlink:
+        case SYS_unlinkat:
+            return handle_unlink(req, resp);
+        case SYS_rename:
+        case SYS_renameat:
+        case SYS_renameat2:
+            return handle_rename(req, resp);
+    }
+
+    return 1;
+}
+
+/**
+ * next_notif - wait for the next syscall to decide on
+ * @req:  where to put it
+ * @size: how big @req is
+ *
+ * Returns 1 if there's one in @req, 0 once everything's gone.
+ */
+static int next_notif(struct seccomp_notif *req, size_t size)
+{
+    int got = 0;
+
+    pthread_mutex_lock(&recv_lock);
+    while(!done && !got) {
+        struct pollfd pfd = { listener, POLLIN, 0 };
+        if(poll(&pfd, 1, -1) < 0) {
+            if(errno != EINTR)
+                done = 1;
+            continue;
+        }
+
+        if(pfd.revents & POLLIN) {
+            memset(req, 0, size);
+
+            /* ENOENT: the process was killed before we got to it */
+            if(ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, req) == 0)
+                got = 1;
+            else if(errno != ENOENT && errno != EINTR)
+                done = 1;
+        }
+        else if(pfd.revents & (POLLHUP | POLLERR)) /* nobody's left */
+            done = 1;
+    }
+    pthread_mutex_unlock(&recv_lock);
+
+    return got;
+}
+
+/**
+ * serve - start routine of the threads answering notifications
+ * @arg: unused
+ */
+static void *serve(void *arg)
+{
+    (void)arg;
+
+    size_t req_size = sizes.seccomp_notif, resp_size = sizes.seccomp_notif_resp;
+    if(req_size < sizeof(struct seccomp_notif))
+        req_size = sizeof(struct seccomp_notif);
+    if(resp_size < sizeof(struct seccomp_notif_resp))
+        resp_size = sizeof(struct seccomp_notif_resp);
+
+    struct seccomp_notif *req = (struct seccomp_notif *)malloc(req_size);
+    struct seccomp_notif_resp *resp = (struct seccomp_notif_resp *)
+                                      malloc(resp_size);
+
+    while(next_notif(req, req_size)) {
+        memset(resp, 0, resp_size);
+        resp->id = req->id;
+        resp->flags = SECCOMP_USER_NOTIF_FLAG_CONTINUE;
+
+        long start = STATS_START();
+        STATS_SYSCALL(req->data.nr);
+        STATS_COUNT(STAT_STOPS);
+
+        /* if the process is gone, there's nobody to answer */
+        if(handle_notif(req, resp))
+            ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, resp);
+
+        /* the handlers clear the flag when they do the syscall themselves */
+        if(!(resp->flags & SECCOMP_USER_NOTIF_FLAG_CONTINUE))
+            STATS_COUNT(STAT_REWRITES);
+        STATS_STOP(TIMER_HANDLE, start);
+    }
+
+    free(req);
+    free(resp);
+    return NULL;
+}
+
+/**
+ * supervise - answer the child's notifications until it's all over
+ * @fd:      the notification fd
+ * @child:   PID of the child process
+ * @plist:   the proxyfile_list
+ * @threads: number of threads to answer with
+ *
+ * The child is reaped here as well: a dead child that isn't reaped still
+ * counts as using the filter, and the notification fd wouldn't tell us it's
+ * all over.
+ *
+ * Returns the wait status of the child.
+ */
+int supervise(int fd,
+              pid_t child,
+              proxyfile_list *plist,
+              int threads)
+{
+    listener = fd;
+    list = plist;
+    list->shared = threads > 1;
+
+    if(syscall(SYS_seccomp, SECCOMP_GET_NOTIF_SIZES, 0, &sizes) < 0)
+        memset(&sizes, 0, sizeof(sizes));
+
+    pthread_t *pool = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    int i;
+    for(i = 0; i < threads; i++)
+        pthread_create(&pool[i], NULL, serve, NULL);
+
+    int status;
+    while(waitpid(child, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    for(i = 0; i < threads; i++)
+        pthread_join(pool[i], NULL);
+
+    free(pool);
+    close(listener);
+    free_retired_proxyfiles(list);
+
+    return status;
+}
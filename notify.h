@@ -0,0 +1,38 @@
+/**
+ * notify.h - The seccomp user notification backend.  Part of the FSSB
+ * project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _NOTIFY_H
+#define _NOTIFY_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "proxyfile.h"
+
+extern int install_notify(int sock, unsigned long cookie);
+
+extern int receive_listener(int sock);
+
+extern int supervise(int fd,
+                     pid_t child,
+                     proxyfile_list *plist,
+                     int threads);
+
+#endif /* _NOTIFY_H */
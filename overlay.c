@@ -0,0 +1,512 @@
+/**
+ * overlay.c - The overlayfs backend.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With -b overlay, the kernel does the sandboxing and we stay out of the way
+ * altogether.  The child gets a user and mount namespace of its own, and
+ * every top-level directory (bar /proc, /sys, /dev and /run) has an overlay
+ * mounted on it, with the real directory as the lower layer and a directory
+ * in the sandbox as the upper one; see cover_dir for directories with mounts
+ * inside them.  Once it's all over, the files that ended up in the upper
+ * layers are moved to proxy files, so the sandbox looks just like one the
+ * tracing backends leave.
+ */
+
+#define _GNU_SOURCE  /* for unshare */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "overlay.h"
+#include "log.h"
+
+/* where the layers go in the sandbox directory */
+#define UPPER_DIR "upper"
+#define WORK_DIR  "work"
+
+/* Top-level directories that aren't files on a disk, if they're mounts. */
+static const char *skipped_dirs[] = { "proc", "sys", "dev", "run", NULL };
+
+/**
+ * write_file - write a line of text to a file
+ * @path: the file
+ * @text: what to write
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_file(const char *path, const char *text)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    int retval = write(fd, text, strlen(text)) == strlen(text) ? 0 : -1;
+    close(fd);
+    return retval;
+}
+
+/**
+ * map_ids - be ourselves in the user namespace we've just created
+ * @uid: our user ID outside it
+ * @gid: our group ID outside it
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int map_ids(uid_t uid, gid_t gid)
+{
+    char map[64];
+
+    /* an unprivileged process has to give up setgroups to map a group */
+    if(write_file("/proc/self/setgroups", "deny") != 0)
+        return -1;
+
+    sprintf(map, "%d %d 1", uid, uid);
+    if(write_file("/proc/self/uid_map", map) != 0)
+        return -1;
+
+    sprintf(map, "%d %d 1", gid, gid);
+    return write_file("/proc/self/gid_map", map);
+}
+
+/**
+ * skipped - is this top-level directory left alone?
+ * @name: its name
+ */
+static int skipped(const char *name)
+{
+    int i;
+    for(i = 0; skipped_dirs[i]; i++)
+        if(strcmp(name, skipped_dirs[i]) == 0)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * unescape - undo the octal escapes of a path in /proc/self/mountinfo
+ * @path: the path, changed in place
+ */
+static void unescape(char *path)
+{
+    char *in = path, *out = path;
+    while(*in) {
+        if(in[0] == '\\' && in[1] && in[2] && in[3]) {
+            *out++ = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+            in += 4;
+        }
+        else
+            *out++ = *in++;
+    }
+    *out = 0;
+}
+
+/* every mount point there is, read before we add any */
+static char **mount_points;
+static int mount_points_count;
+
+/* the mounts with directories cover_dir couldn't put an overlay on */
+static char **uncovered;
+static int uncovered_count;
+
+/**
+ * read_mount_points - fill in mount_points from /proc/self/mountinfo
+ */
+static void read_mount_points()
+{
+    int allocated = 16;
+    mount_points = (char **)malloc(allocated * sizeof(char *));
+    mount_points_count = 0;
+
+    FILE *mountinfo = fopen("/proc/self/mountinfo", "r");
+    if(!mountinfo)
+        return;
+
+    char *line = NULL;
+    size_t n = 0;
+    while(getline(&line, &n, mountinfo) != -1) {
+        /* the mount point is the fifth field */
+        char path[PATH_MAX];
+        if(sscanf(line, "%*s %*s %*s %*s %4095s", path) != 1)
+            continue;
+        unescape(path);
+
+        if(mount_points_count >= allocated) {
+            allocated *= 2;
+            mount_points = (char **)realloc(mount_points,
+                                            allocated * sizeof(char *));
+        }
+        mount_points[mount_points_count++] = strdup(path);
+    }
+
+    free(line);
+    fclose(mountinfo);
+}
+
+/**
+ * has_submounts - is anything mounted somewhere inside a directory?
+ * @dir: the directory, absolute and canonical
+ */
+static int has_submounts(const char *dir)
+{
+    size_t len = strlen(dir);
+    if(len == 1) /* everything's inside the root */
+        len = 0;
+
+    int i;
+    for(i = 0; i < mount_points_count; i++)
+        if(strncmp(mount_points[i], dir, len) == 0 &&
+           mount_points[i][len] == '/' && mount_points[i][len + 1] != 0)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * mount_of - the mount point of the mount a directory is on
+ * @dir: the directory, absolute and canonical
+ */
+static const char *mount_of(const char *dir)
+{
+    const char *best = "/";
+    size_t best_len = 1;
+
+    int i;
+    for(i = 0; i < mount_points_count; i++) {
+        size_t len = strlen(mount_points[i]);
+        if(len > best_len && strncmp(mount_points[i], dir, len) == 0 &&
+           (dir[len] == '/' || dir[len] == 0)) {
+            best = mount_points[i];
+            best_len = len;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * make_readonly - remount a mount read-only in our namespace
+ * @mount_point: where it's mounted
+ *
+ * The flags the mount already has are locked in a user namespace, so they
+ * have to be asked for again.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int make_readonly(const char *mount_point)
+{
+    struct statvfs sv;
+    if(statvfs(mount_point, &sv) != 0)
+        return -1;
+
+    unsigned long flags = MS_REMOUNT | MS_BIND | MS_RDONLY;
+    if(sv.f_flag & ST_NOSUID)
+        flags |= MS_NOSUID;
+    if(sv.f_flag & ST_NODEV)
+        flags |= MS_NODEV;
+    if(sv.f_flag & ST_NOEXEC)
+        flags |= MS_NOEXEC;
+    if(sv.f_flag & ST_NOATIME)
+        flags |= MS_NOATIME;
+    if(sv.f_flag & ST_NODIRATIME)
+        flags |= MS_NODIRATIME;
+    if(sv.f_flag & ST_RELATIME)
+        flags |= MS_RELATIME;
+
+    return mount(NULL, mount_point, NULL, flags, NULL);
+}
+
+/**
+ * make_dirs - mkdir -p
+ * @path: the directory; it's changed along the way, but put back
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int make_dirs(char *path)
+{
+    char *slash;
+    for(slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = 0;
+        int failed = mkdir(path, 0755) != 0 && errno != EEXIST;
+        *slash = '/';
+        if(failed)
+            return -1;
+    }
+
+    return mkdir(path, 0755) != 0 && errno != EEXIST ? -1 : 0;
+}
+
+/**
+ * mount_overlay - put an overlay on a directory
+ * @SANDBOX_DIR: the sandbox directory, with a trailing slash
+ * @dir:         the directory, absolute and canonical
+ *
+ * The layers go at the same path under the upper and work directories of
+ * the sandbox, so the upper one tells collect_overlay where its files go.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int mount_overlay(char *SANDBOX_DIR, const char *dir)
+{
+    char upper[PATH_MAX], work[PATH_MAX];
+    snprintf(upper, sizeof(upper), "%s" UPPER_DIR "%s", SANDBOX_DIR, dir);
+    snprintf(work, sizeof(work), "%s" WORK_DIR "%s", SANDBOX_DIR, dir);
+
+    if(make_dirs(upper) != 0 || make_dirs(work) != 0)
+        return -1;
+
+    /* Unprivileged overlays (Linux 5.11 and later) keep their bookkeeping
+       in user.* xattrs. */
+    char options[4*PATH_MAX];
+    snprintf(options, sizeof(options),
+             "lowerdir=%s,upperdir=%s,workdir=%s,userxattr",
+             dir, upper, work);
+
+    return mount("overlay", dir, "overlay", 0, options);
+}
+
+/**
+ * cover_dir - sandbox everything in a directory
+ * @SANDBOX_DIR: the sandbox directory, with a trailing slash
+ * @dir:         the directory, absolute and canonical
+ *
+ * In a user namespace, the kernel won't let us put an overlay on a directory
+ * with mounts inside it, since the lower layer would show what those mounts
+ * hide.  So we go down into it and cover its subdirectories one at a time.
+ * That leaves the files right inside it, which nothing can keep the child
+ * from writing to for real; the mount it's on is noted down, to be made
+ * read-only once everything else is covered.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int cover_dir(char *SANDBOX_DIR, const char *dir)
+{
+    if(!has_submounts(dir))
+        return mount_overlay(SANDBOX_DIR, dir);
+
+    DIR *d = opendir(dir);
+    if(!d)
+        return -1;
+
+    uncovered = (char **)realloc(uncovered, (uncovered_count + 1) *
+                                            sizeof(char *));
+    uncovered[uncovered_count++] = strdup(mount_of(dir));
+
+    /* The sandbox can't be got at once the directory it's in has its overlay,
+       so that one goes last. */
+    char *last = NULL;
+    int count = 0, allocated = 16, i, retval = 0;
+    char **subdirs = (char **)malloc(allocated * sizeof(char *));
+
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") ? dir : "",
+                                              entry->d_name);
+
+        /* one that's only a directory on the disk is covered like any */
+        if(strcmp(dir, "/") == 0 && skipped(entry->d_name) &&
+           strcmp(mount_of(path), path) == 0)
+            continue;
+
+        struct stat sb;
+        if(lstat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+            continue;
+
+        size_t len = strlen(path);
+        if(strncmp(SANDBOX_DIR, path, len) == 0 && SANDBOX_DIR[len] == '/') {
+            if(SANDBOX_DIR[len + 1] != 0) /* not the sandbox itself */
+                last = strdup(path);
+            continue;
+        }
+
+        if(count >= allocated) {
+            allocated *= 2;
+            subdirs = (char **)realloc(subdirs, allocated * sizeof(char *));
+        }
+        subdirs[count++] = strdup(path);
+    }
+    closedir(d);
+
+    for(i = 0; i < count; i++) {
+        if(retval == 0)
+            retval = cover_dir(SANDBOX_DIR, subdirs[i]);
+        free(subdirs[i]);
+    }
+    free(subdirs);
+
+    if(last) {
+        if(retval == 0)
+            retval = cover_dir(SANDBOX_DIR, last);
+        free(last);
+    }
+
+    return retval;
+}
+
+/**
+ * enter_overlay - put the calling process in a sandbox of overlays
+ * @SANDBOX_DIR: the sandbox directory, with a trailing slash
+ *
+ * This must be called in the child before it execs.  Everything it creates
+ * afterwards shares its view of the filesystem.
+ *
+ * Returns 0 on success, -1 if the kernel won't let us (the child hasn't been
+ * let loose in that case).
+ */
+int enter_overlay(char *SANDBOX_DIR)
+{
+    uid_t uid = getuid();
+    gid_t gid = getgid();
+
+    if(unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0 || map_ids(uid, gid) != 0)
+        return -1;
+
+    /* none of what we mount may show up outside */
+    if(mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+        return -1;
+
+    read_mount_points();
+    if(cover_dir(SANDBOX_DIR, "/") != 0)
+        return -1;
+
+    /* Not before now, as the layers are made on these; the overlays keep
+       the upper layers writable, mounted as they were. */
+    int i;
+    for(i = 0; i < uncovered_count; i++)
+        if(make_readonly(uncovered[i]) != 0)
+            return -1;
+
+    /* the working directory is still the one under the overlay */
+    char *cwd = getcwd(NULL, 0);
+    if(cwd) {
+        chdir(cwd);
+        free(cwd);
+    }
+
+    return 0;
+}
+
+/* nftw doesn't take a context argument */
+static proxyfile_list *collected_list;
+static size_t upper_len;
+
+/**
+ * collect_entry - nftw callback for collect_overlay
+ */
+static int collect_entry(const char *fpath,
+                         const struct stat *sb,
+                         int type,
+                         struct FTW *ftw)
+{
+    (void)type;
+
+    const char *file_path = fpath + upper_len; /* "/dir/..." */
+    struct stat real;
+
+    if(S_ISREG(sb->st_mode)) {
+        proxyfile *pf = new_proxyfile(collected_list, strdup(file_path));
+        if(rename(fpath, pf->proxy_path) != 0)
+            fprintf(stderr, "fssb: cannot move %s to %s\n",
+                            fpath, pf->proxy_path);
+
+        /* the lower layer is the real file, for committing over */
+        if(collected_list->journal && !lstat(file_path, &real))
+            journal_base(collected_list->journal, pf->digest, pf->suffix,
+                         file_path, &real);
+    }
+    else if(S_ISCHR(sb->st_mode) && sb->st_rdev == 0) { /* a whiteout */
+        log_msg(LOG_DEBUG, "deleted %s\n", file_path);
+
+        /* directories aren't something a commit deletes */
+        if(!lstat(file_path, &real) && !S_ISDIR(real.st_mode))
+            note_unlink(collected_list, (char *)file_path);
+    }
+    else if(S_ISDIR(sb->st_mode) && ftw->level > 0 &&
+            lstat(file_path, &real) != 0) { /* one the child made */
+        log_msg(LOG_DEBUG, "made directory %s\n", file_path);
+        note_mkdir(collected_list, (char *)file_path, sb->st_mode);
+    }
+
+    return 0;
+}
+
+/**
+ * collect_overlay - turn what's in the upper layers into proxy files
+ * @list: the proxyfile_list
+ *
+ * Files the child deleted are whiteouts in the upper layers, which go in
+ * the journal as the tracing backends' unlinks of real files do.  The
+ * directories it made are journaled too; nftw visits them before what's in
+ * them, so a parent always comes before its children.
+ */
+void collect_overlay(proxyfile_list *list)
+{
+    char upper[PATH_MAX];
+    snprintf(upper, sizeof(upper), "%s" UPPER_DIR, list->SANDBOX_DIR);
+
+    collected_list = list;
+    upper_len = strlen(upper);
+
+    nftw(upper, collect_entry, 16, FTW_PHYS);
+}
+
+/**
+ * remove_entry - nftw callback for remove_overlay
+ */
+static int remove_entry(const char *fpath,
+                        const struct stat *sb,
+                        int type,
+                        struct FTW *ftw)
+{
+    (void)sb;
+    (void)type;
+    (void)ftw;
+
+    remove(fpath);
+    return 0;
+}
+
+/**
+ * remove_overlay - clear the layers out of the sandbox directory
+ * @SANDBOX_DIR: the sandbox directory, with a trailing slash
+ */
+void remove_overlay(char *SANDBOX_DIR)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s" UPPER_DIR, SANDBOX_DIR);
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    snprintf(path, sizeof(path), "%s" WORK_DIR, SANDBOX_DIR);
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
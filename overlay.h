@@ -0,0 +1,33 @@
+/**
+ * overlay.h - The overlayfs backend.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OVERLAY_H
+#define _OVERLAY_H
+
+#include <stdio.h>
+
+#include "proxyfile.h"
+
+extern int enter_overlay(char *SANDBOX_DIR);
+
+extern void collect_overlay(proxyfile_list *list);
+
+extern void remove_overlay(char *SANDBOX_DIR);
+
+#endif /* _OVERLAY_H */
@@ -0,0 +1,284 @@
+/**
+ * path.c - Path canonicalisation.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "path.h"
+#include "hash.h"
+
+/* as many symlinks as the kernel follows in one path */
+#define MAX_LINKS 40
+
+static char *resolve_path(const char *base, const char *path, int links);
+
+/**
+ * canonical_path - make a path absolute and normal
+ * @base: the absolute, normal directory a relative @path is relative to
+ * @path: the path
+ *
+ * "." components and repeated slashes are dropped, and ".." takes away the
+ * component before it (at the root, it stays at the root).  That's only
+ * right if the component is a directory, so if it's a symlink, ".." goes
+ * up from where it points instead, as the kernel would have it.  Symlinks
+ * that aren't followed by ".." are left as they are.
+ *
+ * Returns a (char *) pointer.  Remember to free this at the end.
+ */
+char *canonical_path(const char *base, const char *path)
+{
+    return resolve_path(base, path, 0);
+}
+
+/**
+ * resolve_path - canonical_path, with the symlinks followed so far
+ * @base:  as for canonical_path
+ * @path:  as for canonical_path
+ * @links: how many symlinks have been followed to get here
+ */
+static char *resolve_path(const char *base, const char *path, int links)
+{
+    /* the result is never longer than the two glued together */
+    char *retval = (char *)malloc(strlen(base) + strlen(path) + 3);
+    size_t len = 0;
+
+    if(path[0] != '/') {
+        len = strlen(base);
+        memcpy(retval, base, len);
+        if(len == 1) /* just the root */
+            len = 0;
+    }
+
+    const char *p = path;
+    while(*p) {
+        while(*p == '/')
+            p++;
+
+        const char *end = strchr(p, '/');
+        if(!end)
+            end = p + strlen(p);
+        size_t n = end - p;
+
+        if(n == 0 || (n == 1 && p[0] == '.'))
+            ; /* nothing to do */
+        else if(n == 2 && p[0] == '.' && p[1] == '.') {
+            char target[PATH_MAX];
+            ssize_t t = -1;
+
+            retval[len] = 0;
+            if(len > 0 && links < MAX_LINKS)
+                t = readlink(retval, target, sizeof(target) - 1);
+
+            /* go on from the link's directory, through where it points */
+            if(t > 0) {
+                target[t] = 0;
+                char *rest = (char *)malloc(t + strlen(p) + 2);
+                sprintf(rest, "%s/%s", target, p);
+
+                while(len > 0 && retval[len - 1] != '/')
+                    len--;
+                retval[len > 1 ? len - 1 : 1] = 0;
+
+                char *resolved = resolve_path(retval, rest, links + 1);
+                free(rest);
+                free(retval);
+                return resolved;
+            }
+
+            while(len > 0 && retval[len - 1] != '/')
+                len--;
+            if(len > 0) /* and the slash */
+                len--;
+        }
+        else {
+            retval[len++] = '/';
+            memcpy(retval + len, p, n);
+            len += n;
+        }
+
+        p = end;
+    }
+
+    if(len == 0)
+        retval[len++] = '/';
+    retval[len] = 0;
+
+    return retval;
+}
+
+/**
+ * new_path_cache - creates a new, empty path_cache
+ * @capacity: how many paths to hold at most
+ *
+ * Returns a (path_cache *) pointer.
+ */
+path_cache *new_path_cache(int capacity)
+{
+    path_cache *retval = (path_cache *)malloc(sizeof(path_cache));
+
+    /* a power of two at least as big as the capacity */
+    retval->bucket_count = 1;
+    while(retval->bucket_count < capacity)
+        retval->bucket_count *= 2;
+    retval->buckets = (path_entry **)calloc(retval->bucket_count,
+                                            sizeof(path_entry *));
+
+    retval->newest = retval->oldest = NULL;
+    retval->used = 0;
+    retval->capacity = capacity;
+
+    retval->hits = retval->misses = 0;
+
+    return retval;
+}
+
+/**
+ * key_hash - hash a cache key
+ * @base_id: id of the base directory
+ * @raw:     the path as the child gave it
+ */
+static unsigned long key_hash(unsigned long base_id, const char *raw)
+{
+    unsigned char digest[DIGEST_LEN];
+    unsigned long h;
+
+    hash_digest(HASH_MURMUR3, raw, strlen(raw), digest);
+    memcpy(&h, digest, sizeof(h));
+
+    return h ^ (base_id * 0x9e3779b97f4a7c15ul);
+}
+
+/* take an entry out of the LRU order */
+static void lru_unlink(path_cache *cache, path_entry *e)
+{
+    if(e->newer)
+        e->newer->older = e->older;
+    else
+        cache->newest = e->older;
+
+    if(e->older)
+        e->older->newer = e->newer;
+    else
+        cache->oldest = e->newer;
+}
+
+/* put an entry at the front of the LRU order */
+static void lru_push(path_cache *cache, path_entry *e)
+{
+    e->newer = NULL;
+    e->older = cache->newest;
+    if(cache->newest)
+        cache->newest->newer = e;
+    else
+        cache->oldest = e;
+    cache->newest = e;
+}
+
+/**
+ * evict_oldest - drop the least recently used entry
+ * @cache: the path_cache
+ */
+static void evict_oldest(path_cache *cache)
+{
+    path_entry *e = cache->oldest;
+    lru_unlink(cache, e);
+
+    path_entry **p = &cache->buckets[e->hash & (cache->bucket_count - 1)];
+    while(*p != e)
+        p = &(*p)->chain;
+    *p = e->chain;
+
+    free(e->raw);
+    free(e->canonical);
+    free(e);
+    cache->used--;
+}
+
+/**
+ * lookup_path - find the canonical form of a path in the cache
+ * @cache:   the path_cache
+ * @base_id: id of the directory @raw is relative to, 0 if it's absolute
+ * @raw:     the path as the child gave it
+ *
+ * Returns a (const char *) pointer owned by the cache, or NULL if the path
+ * isn't in there.  It's only good until the next remember_path.
+ */
+const char *lookup_path(path_cache *cache,
+                        unsigned long base_id,
+                        const char *raw)
+{
+    unsigned long h = key_hash(base_id, raw);
+
+    path_entry *e = cache->buckets[h & (cache->bucket_count - 1)];
+    while(e) {
+        if(e->hash == h && e->base_id == base_id && strcmp(e->raw, raw) == 0)
+            break;
+        e = e->chain;
+    }
+
+    if(!e) {
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    lru_unlink(cache, e);
+    lru_push(cache, e);
+
+    return e->canonical;
+}
+
+/**
+ * remember_path - add the canonical form of a path to the cache
+ * @cache:     the path_cache
+ * @base_id:   id of the directory @raw is relative to, 0 if it's absolute
+ * @raw:       the path as the child gave it
+ * @canonical: what canonical_path made of it; the cache takes it over
+ *
+ * The path must not be in the cache already.
+ *
+ * Returns @canonical.
+ */
+const char *remember_path(path_cache *cache,
+                          unsigned long base_id,
+                          const char *raw,
+                          char *canonical)
+{
+    if(cache->used >= cache->capacity)
+        evict_oldest(cache);
+
+    path_entry *e = (path_entry *)malloc(sizeof(path_entry));
+    e->base_id = base_id;
+    e->raw = strdup(raw);
+    e->canonical = canonical;
+    e->hash = key_hash(base_id, raw);
+
+    path_entry **bucket = &cache->buckets[e->hash & (cache->bucket_count - 1)];
+    e->chain = *bucket;
+    *bucket = e;
+
+    lru_push(cache, e);
+    cache->used++;
+
+    return canonical;
+}
@@ -0,0 +1,64 @@
+/**
+ * path.h - Path canonicalisation.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _PATH_H
+#define _PATH_H
+
+typedef struct path_entry {
+    unsigned long base_id;
+    char *raw, *canonical;
+    unsigned long hash;
+
+    struct path_entry *chain;            /* next in the same bucket */
+    struct path_entry *newer, *older;    /* LRU order */
+} path_entry;
+
+/**
+ * path_cache - recently canonicalised paths
+ *
+ * Keyed by the id of the directory a relative path was resolved against
+ * (0 for absolute paths) and the path as the child gave it.  Entries are
+ * evicted least recently used first once the cache is full.  Every worker
+ * thread has its own, so there's no locking.
+ */
+typedef struct {
+    path_entry **buckets;
+    int bucket_count;
+
+    path_entry *newest, *oldest;
+    int used, capacity;
+
+    long hits, misses;
+} path_cache;
+
+extern char *canonical_path(const char *base, const char *path);
+
+extern path_cache *new_path_cache(int capacity);
+
+extern const char *lookup_path(path_cache *cache,
+                               unsigned long base_id,
+                               const char *raw);
+
+extern const char *remember_path(path_cache *cache,
+                                 unsigned long base_id,
+                                 const char *raw,
+                                 char *canonical);
+
+#endif /* _PATH_H */
@@ -1,5 +1,5 @@
 /**
- * proxyfile.h - Proxy file operations.  Part of the FSSB project.
+ * proxyfile.c - Proxy file operations.  Part of the FSSB project.
  *
  * Copyright (C) 2016 Adhityaa Chandrasekar
  *
@@ -20,9 +20,40 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "proxyfile.h"
 #include "utils.h"
+#include "copyup.h"
+#include "stats.h"
+#include "log.h"
+
+/* Marks a hash table slot whose proxyfile has been deleted. */
+#define TOMBSTONE ((proxyfile *)-1)
+
+/* Bloom filter counters per hash table slot.  The table is at most half
+   full, so that's 32 or more per path, for a false positive rate of about
+   one in five thousand with BLOOM_PROBES = 4. */
+#define BLOOM_COUNTERS_PER_SLOT 16
+
+#define INIT_TABLE_CAPACITY 64
+
+/* Number of recently computed path digests each thread remembers. */
+#define DIGEST_MEMO_SIZE 2
+
+typedef struct {
+    char *path;
+    int hash_algo;
+    unsigned char digest[DIGEST_LEN];
+} digest_memo;
+
+/* A handler usually looks up a path and then creates it or asks for its
+   proxy path, so remember the last few digests instead of rehashing.  Each
+   tracer thread handles its own syscalls, so this is per thread. */
+static __thread digest_memo memo[DIGEST_MEMO_SIZE];
+static __thread int memo_next;
 
 /**
  * new_proxyfile_list - creates a new proxyfile list
@@ -38,72 +69,441 @@ proxyfile_list *new_proxyfile_list()
     retval->tail = NULL;
     retval->used = 0;
 
+    retval->capacity = INIT_TABLE_CAPACITY;
+    retval->tombstones = 0;
+    retval->table = (proxyfile **)calloc(retval->capacity, sizeof(proxyfile *));
+
+    retval->filter = new_bloom(BLOOM_COUNTERS_PER_SLOT * retval->capacity);
+    retval->filter_misses = 0;
+    retval->filter_hits = 0;
+    retval->filter_false_positives = 0;
+
+    pthread_rwlock_init(&retval->lock, NULL);
+    retval->shared = 0;
+    retval->retired = NULL;
+
+    pthread_mutex_init(&retval->ready_lock, NULL);
+    pthread_cond_init(&retval->ready_cond, NULL);
+
+    retval->published = NULL;
+    retval->journal = NULL;
+    retval->saved = NULL;
+    retval->lowers = NULL;
+    retval->lower_count = 0;
+    retval->hash_algo = HASH_MURMUR3;
+
     return retval;
 }
 
 /**
- * new_proxyfile - create a new proxyfile and append it to the list
+ * hash_path - get the digest of a path
  * @list:      the proxyfile_list
- * @file_path: path to the file to be added
+ * @file_path: the file path
+ * @digest:    buffer of DIGEST_LEN bytes to store the digest in
  *
- * Returns a (proxyfile *) pointer pointing to the newly created proxyfile
- * object.
+ * Digests computed recently are remembered, so the search-then-create
+ * sequence of a single syscall only hashes the path once.
  */
-proxyfile *new_proxyfile(proxyfile_list *list, char *file_path)
+static void hash_path(proxyfile_list *list,
+                      char *file_path,
+                      unsigned char *digest)
 {
-    if(list->head == NULL) { /* first proxyfile */
-        list->head = (proxyfile *)malloc(sizeof(proxyfile));
-        list->tail = list->head;
-        list->tail->next = NULL;
-        list->tail->prev = NULL;
+    int i;
+    for(i = 0; i < DIGEST_MEMO_SIZE; i++) {
+        digest_memo *m = &memo[i];
+        if(m->path && m->hash_algo == list->hash_algo &&
+           strcmp(m->path, file_path) == 0) {
+            memcpy(digest, m->digest, DIGEST_LEN);
+            return;
+        }
     }
-    else { /* append to existing linked list */
-        proxyfile *next = (proxyfile *)malloc(sizeof(proxyfile));
-        next->prev = list->tail;
-        next->next = NULL;
-        list->tail = next;
+
+    hash_digest(list->hash_algo, file_path, strlen(file_path), digest);
+
+    digest_memo *m = &memo[memo_next];
+    memo_next = (memo_next + 1) % DIGEST_MEMO_SIZE;
+
+    free(m->path);
+    m->path = strdup(file_path);
+    m->hash_algo = list->hash_algo;
+    memcpy(m->digest, digest, DIGEST_LEN);
+}
+
+/**
+ * table_index - get the preferred hash table slot for a digest
+ * @list:   the proxyfile_list
+ * @digest: the path digest
+ */
+static int table_index(proxyfile_list *list, const unsigned char *digest)
+{
+    unsigned long h;
+    memcpy(&h, digest, sizeof(h)); /* the digest is already well mixed */
+    return h & (list->capacity - 1);
+}
+
+/**
+ * table_insert - put a proxyfile in the first free slot for its digest
+ * @list: the proxyfile_list
+ * @pf:   the proxyfile
+ */
+static void table_insert(proxyfile_list *list, proxyfile *pf)
+{
+    int i = table_index(list, pf->digest);
+    while(list->table[i] != NULL && list->table[i] != TOMBSTONE)
+        i = (i + 1) & (list->capacity - 1);
+
+    if(list->table[i] == TOMBSTONE)
+        list->tombstones--;
+
+    list->table[i] = pf;
+    pf->slot = i;
+}
+
+/**
+ * filter_grow - rebuild the Bloom filter to go with a bigger table
+ * @list: the proxyfile_list
+ *
+ * Lookups read the filter without the lock, so one may still be looking at
+ * the old filter; when the list is shared it's retired rather than freed.
+ */
+static void filter_grow(proxyfile_list *list)
+{
+    bloom *filter = new_bloom(BLOOM_COUNTERS_PER_SLOT * list->capacity);
+
+    proxyfile *cur = list->head;
+    while(cur != NULL) {
+        bloom_add(filter, cur->digest);
+        cur = cur->next;
     }
 
-    proxyfile *cur = list->tail;
+    bloom *old = list->filter;
+    __atomic_store_n(&list->filter, filter, __ATOMIC_RELEASE);
+
+    if(list->shared) /* old keeps the ones before it */
+        filter->retired = old;
+    else
+        free_bloom(old);
+}
+
+/**
+ * table_grow - rebuild the hash table if it's getting crowded
+ * @list: the proxyfile_list
+ *
+ * Tombstones count towards the load as they lengthen probe sequences; a
+ * rebuild drops all of them.
+ */
+static void table_grow(proxyfile_list *list)
+{
+    if(2*(list->used + list->tombstones + 1) <= list->capacity)
+        return;
+
+    /* only double if it's actually the live entries filling things up */
+    int grown = 0;
+    if(4*(list->used + 1) > list->capacity) {
+        list->capacity *= 2;
+        grown = 1;
+    }
+
+    free(list->table);
+    list->table = (proxyfile **)calloc(list->capacity, sizeof(proxyfile *));
+    list->tombstones = 0;
+
+    proxyfile *cur = list->head;
+    while(cur != NULL) {
+        table_insert(list, cur);
+        cur = cur->next;
+    }
+
+    if(grown)
+        filter_grow(list);
+}
+
+/**
+ * table_lookup - find the proxyfile for a path, with the lock held
+ * @list:      the proxyfile_list
+ * @file_path: the file path
+ * @digest:    its digest
+ *
+ * The digest only narrows things down; the full path is compared too, so a
+ * collision never hands out somebody else's proxyfile.
+ */
+static proxyfile *table_lookup(proxyfile_list *list,
+                               char *file_path,
+                               const unsigned char *digest)
+{
+    int i = table_index(list, digest);
+    while(list->table[i] != NULL) {
+        proxyfile *cur = list->table[i];
+        if(cur != TOMBSTONE &&
+           memcmp(cur->digest, digest, DIGEST_LEN) == 0 &&
+           strcmp(cur->file_path, file_path) == 0)
+            return cur;
+        i = (i + 1) & (list->capacity - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * format_name - put a proxy file name together
+ * @digest: digest of the path
+ * @suffix: the collision suffix, 0 for none
+ * @name:   buffer of at least PROXY_NAME_MAX + 1 bytes
+ */
+static void format_name(const unsigned char *digest, int suffix, char *name)
+{
+    hex_digest(digest, name);
+    if(suffix)
+        sprintf(name + 2*DIGEST_LEN, "-%d", suffix);
+}
+
+/**
+ * proxy_name - pick the proxy file name for a new proxyfile
+ * @list:   the proxyfile_list
+ * @digest: digest of the path
+ * @name:   buffer of at least PROXY_NAME_MAX + 1 bytes
+ *
+ * This is normally just the digest in hex.  On the off chance that another
+ * path with the same digest is already in the sandbox (or its snapshot), a
+ * "-N" suffix with the smallest N not taken keeps their proxy files apart.
+ * The lock must be held.
+ *
+ * Returns the suffix used, 0 meaning none.
+ */
+static int proxy_name(proxyfile_list *list,
+                      const unsigned char *digest,
+                      char *name)
+{
+    int suffix = 0, taken;
+
+    do {
+        taken = 0;
+
+        int i = table_index(list, digest);
+        while(list->table[i] != NULL) {
+            proxyfile *cur = list->table[i];
+            if(cur != TOMBSTONE &&
+               memcmp(cur->digest, digest, DIGEST_LEN) == 0 &&
+               cur->suffix == suffix) {
+                taken = 1;
+                suffix++;
+                break;
+            }
+            i = (i + 1) & (list->capacity - 1);
+        }
+
+        if(!taken && list->saved &&
+           snapshot_suffix_taken(list->saved, digest, suffix)) {
+            taken = 1;
+            suffix++;
+        }
+    } while(taken);
+
+    format_name(digest, suffix, name);
+    return suffix;
+}
+
+/**
+ * table_add - put a proxyfile in, with the lock held exclusively
+ * @list:      the proxyfile_list
+ * @file_path: path to the file to be added
+ * @digest:    its digest
+ * @suffix:    its proxy file name's collision suffix
+ * @dir:       the sandbox directory its proxy file is in
+ */
+static proxyfile *table_add(proxyfile_list *list,
+                            char *file_path,
+                            const unsigned char *digest,
+                            int suffix,
+                            const char *dir)
+{
+    table_grow(list);
+
+    proxyfile *cur = (proxyfile *)malloc(sizeof(proxyfile));
+
+    cur->next = NULL;
+    cur->prev = list->tail;
+    if(list->tail)
+        list->tail->next = cur;
+    else /* first proxyfile */
+        list->head = cur;
+    list->tail = cur;
+
     cur->file_path = file_path; /* no need to copy char-by-char */
 
-    cur->md5 = md5sum(file_path); /* just assign the already assigned addr */
+    memcpy(cur->digest, digest, DIGEST_LEN);
+    cur->name = (char *)malloc(PROXY_NAME_MAX + 1);
+    cur->suffix = suffix;
+    format_name(digest, suffix, cur->name);
+
+    cur->proxy_path = (char *)malloc(strlen(dir) + strlen(cur->name) + 1);
+    strcpy(cur->proxy_path, dir);
+    strcat(cur->proxy_path, cur->name);
 
-    cur->proxy_path = (char *)malloc((list->PROXY_FILE_LEN + 1)*sizeof(char));
-    strcpy(cur->proxy_path, list->SANDBOX_DIR);
-    strcat(cur->proxy_path, cur->md5);
+    cur->ready = 1;
+    cur->lower = 0;
 
+    table_insert(list, cur);
+    bloom_add(list->filter, cur->digest);
     list->used++;
 
     return cur;
 }
 
 /**
- * search_proxyfile - search for a proxyfile
+ * table_new - create a proxyfile, with the lock held exclusively
+ * @list:      the proxyfile_list
+ * @file_path: path to the file to be added
+ * @digest:    its digest
+ */
+static proxyfile *table_new(proxyfile_list *list,
+                            char *file_path,
+                            const unsigned char *digest)
+{
+    char name[PROXY_NAME_MAX + 1];
+    proxyfile *cur = table_add(list, file_path, digest,
+                               proxy_name(list, digest, name),
+                               list->SANDBOX_DIR);
+
+    if(list->journal)
+        journal_add(list->journal, JOURNAL_ADD, cur->digest, cur->suffix,
+                    cur->file_path);
+
+    return cur;
+}
+
+/**
+ * table_find - look a path up, with the lock held exclusively
  * @list:      the proxyfile_list
  * @file_path: the file path
+ * @digest:    its digest
  *
- * Returns a (proxyfile *) pointer.
+ * Unlike table_lookup, this also brings the path's proxyfile in from the
+ * snapshot or a lower layer if it's there.  Neither goes in the journal:
+ * the snapshot's is there already, and a lower layer's isn't ours.
  */
-proxyfile *search_proxyfile(proxyfile_list *list, char *file_path) {
-    char *md5 = md5sum(file_path);
-    
-    proxyfile *cur = list->head;
-    while(cur != NULL) {
-        if(strcmp(cur->md5, md5) == 0)
-            return cur;
-        cur = cur->next;
+static proxyfile *table_find(proxyfile_list *list,
+                             char *file_path,
+                             const unsigned char *digest)
+{
+    proxyfile *cur = table_lookup(list, file_path, digest);
+    if(cur)
+        return cur;
+
+    long slot;
+    snapshot_slot *s;
+    if(list->saved && (slot = snapshot_find(list->saved, file_path,
+                                            digest)) >= 0) {
+        s = &list->saved->slots[slot];
+        list->saved->taken[slot] = 1;
+        return table_add(list, strdup(list->saved->strings + s->path),
+                         s->digest, s->suffix, list->SANDBOX_DIR);
+    }
+
+    int i;
+    for(i = 0; i < list->lower_count; i++) {
+        snapshot *lower = list->lowers[i];
+        if((slot = snapshot_find(lower, file_path, digest)) < 0)
+            continue;
+
+        s = &lower->slots[slot];
+        cur = table_add(list, strdup(lower->strings + s->path), s->digest,
+                        s->suffix, lower->SANDBOX_DIR);
+        cur->lower = 1;
+
+        /* it may have been copied up and deleted since it was published */
+        if(list->published)
+            pub_add_lower(list->published, cur->file_path, cur->proxy_path);
+        return cur;
     }
 
     return NULL;
 }
 
 /**
- * delete_proxyfile - remove a proxyfile from the proxyfile_list
+ * in_lowers - check if a lower layer has a path
+ * @list:      the proxyfile_list
+ * @file_path: the file path
+ * @digest:    its digest
+ */
+static int in_lowers(proxyfile_list *list,
+                     char *file_path,
+                     const unsigned char *digest)
+{
+    int i;
+    for(i = 0; i < list->lower_count; i++)
+        if(snapshot_find(list->lowers[i], file_path, digest) >= 0)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * uncover_lower - let a lower layer's proxyfile show through again
+ * @list:      the proxyfile_list
+ * @file_path: the file path whose proxyfile's just been deleted
+ * @digest:    its digest
+ *
+ * Without layers, the real file is what's seen once a proxy file is gone;
+ * with them, it's the lower layer's.  The tracer finds that anyway, but
+ * the shim has to be told.  Call this with the lock held.
+ */
+static void uncover_lower(proxyfile_list *list,
+                          char *file_path,
+                          const unsigned char *digest)
+{
+    if(list->published && in_lowers(list, file_path, digest))
+        table_find(list, file_path, digest);
+}
+
+/**
+ * in_snapshots - check if the snapshot or a lower layer has a path
+ * @list:      the proxyfile_list
+ * @file_path: the file path
+ * @digest:    its digest
+ *
+ * With the lock held, this says whether table_find would bring something
+ * in that table_lookup didn't find.
+ */
+static int in_snapshots(proxyfile_list *list,
+                        char *file_path,
+                        const unsigned char *digest)
+{
+    if(list->saved && snapshot_find(list->saved, file_path, digest) >= 0)
+        return 1;
+
+    return in_lowers(list, file_path, digest);
+}
+
+/**
+ * maybe_in_snapshots - check the snapshots' Bloom filters for a digest
+ * @list:   the proxyfile_list
+ * @digest: the path digest
+ *
+ * Each layer has its own filter, so a path that's in none of them costs a
+ * few bit tests per layer, however big they are.
+ */
+static int maybe_in_snapshots(proxyfile_list *list,
+                              const unsigned char *digest)
+{
+    if(list->saved && snapshot_maybe(list->saved, digest))
+        return 1;
+
+    int i;
+    for(i = 0; i < list->lower_count; i++)
+        if(snapshot_maybe(list->lowers[i], digest))
+            return 1;
+
+    return 0;
+}
+
+/**
+ * table_delete - remove a proxyfile, with the lock held exclusively
  * @list: the proxyfile_list
  * @pf:   the proxyfile
  */
-void delete_proxyfile(proxyfile_list *list, proxyfile *pf) {
+static void table_delete(proxyfile_list *list, proxyfile *pf)
+{
     if(pf->prev)
         ((proxyfile *)pf->prev)->next = pf->next;
     else /* only head has this property */
@@ -111,50 +511,621 @@ void delete_proxyfile(proxyfile_list *list, proxyfile *pf) {
 
     if(pf->next)
         ((proxyfile *)pf->next)->prev = pf->prev;
+    else /* only tail has this property */
+        list->tail = pf->prev;
+
+    list->table[pf->slot] = TOMBSTONE;
+    list->tombstones++;
+    bloom_remove(list->filter, pf->digest);
+    list->used--;
+
+    if(list->published)
+        pub_remove(list->published, pf->file_path);
+
+    if(list->journal && !pf->lower)
+        journal_add(list->journal, JOURNAL_DELETE, pf->digest, pf->suffix,
+                    pf->file_path);
+
+    if(list->shared) {
+        pf->next = list->retired;
+        list->retired = pf;
+        return;
+    }
 
     free(pf->file_path);
-    free(pf->md5);
+    free(pf->name);
     free(pf->proxy_path);
     free(pf);
 }
 
+/**
+ * new_proxyfile - create a new proxyfile and append it to the list
+ * @list:      the proxyfile_list
+ * @file_path: path to the file to be added
+ *
+ * Returns a (proxyfile *) pointer pointing to the newly created proxyfile
+ * object.
+ */
+proxyfile *new_proxyfile(proxyfile_list *list, char *file_path)
+{
+    long start = STATS_START();
+    unsigned char digest[DIGEST_LEN];
+    hash_path(list, file_path, digest);
+
+    pthread_rwlock_wrlock(&list->lock);
+    proxyfile *cur = table_new(list, file_path, digest);
+    if(list->published)
+        pub_add(list->published, cur->file_path, cur->proxy_path);
+    pthread_rwlock_unlock(&list->lock);
+
+    STATS_STOP(TIMER_INDEX, start);
+    return cur;
+}
+
+/**
+ * search_proxyfile - search for a proxyfile
+ * @list:      the proxyfile_list
+ * @file_path: the file path
+ *
+ * The Bloom filter goes first; only when it can't rule the path out do we
+ * take the lock and look in the table.
+ *
+ * Returns a (proxyfile *) pointer, or NULL if there's no such proxyfile.
+ */
+proxyfile *search_proxyfile(proxyfile_list *list, char *file_path) {
+    long start = STATS_START();
+    STATS_COUNT(STAT_LOOKUPS);
+
+    unsigned char digest[DIGEST_LEN];
+    hash_path(list, file_path, digest);
+
+    bloom *filter = __atomic_load_n(&list->filter, __ATOMIC_ACQUIRE);
+    if(!bloom_maybe(filter, digest) && !maybe_in_snapshots(list, digest)) {
+        __atomic_add_fetch(&list->filter_misses, 1, __ATOMIC_RELAXED);
+        STATS_STOP(TIMER_INDEX, start);
+        return NULL;
+    }
+
+    pthread_rwlock_rdlock(&list->lock);
+    proxyfile *cur = table_lookup(list, file_path, digest);
+    int saved = !cur && in_snapshots(list, file_path, digest);
+    pthread_rwlock_unlock(&list->lock);
+
+    if(saved) {
+        pthread_rwlock_wrlock(&list->lock);
+        cur = table_find(list, file_path, digest);
+        pthread_rwlock_unlock(&list->lock);
+    }
+
+    if(cur)
+        __atomic_add_fetch(&list->filter_hits, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&list->filter_false_positives, 1, __ATOMIC_RELAXED);
+
+    STATS_STOP(TIMER_INDEX, start);
+    return cur;
+}
+
+/**
+ * find_or_new_proxyfile - get the proxyfile for a path, creating it if needed
+ * @list:      the proxyfile_list
+ * @file_path: the file path
+ *
+ * Unlike a search followed by a new_proxyfile, two threads racing on the
+ * same path end up with the same proxyfile.  If a proxyfile is created,
+ * it takes @file_path over; check whether cur->file_path == @file_path.
+ * Whoever created it has to get the proxy file in place and then call
+ * proxyfile_ready; everyone else should wait_proxyfile before using it.
+ *
+ * Returns a (proxyfile *) pointer.
+ */
+proxyfile *find_or_new_proxyfile(proxyfile_list *list, char *file_path)
+{
+    long start = STATS_START();
+    STATS_COUNT(STAT_LOOKUPS);
+
+    unsigned char digest[DIGEST_LEN];
+    hash_path(list, file_path, digest);
+
+    pthread_rwlock_rdlock(&list->lock);
+    proxyfile *cur = table_lookup(list, file_path, digest);
+    pthread_rwlock_unlock(&list->lock);
+
+    if(cur) {
+        STATS_STOP(TIMER_INDEX, start);
+        return cur;
+    }
+
+    pthread_rwlock_wrlock(&list->lock);
+    cur = table_find(list, file_path, digest);
+    if(!cur) {
+        cur = table_new(list, file_path, digest);
+        cur->ready = 0;
+    }
+    pthread_rwlock_unlock(&list->lock);
+
+    STATS_STOP(TIMER_INDEX, start);
+    return cur;
+}
+
+/**
+ * proxyfile_ready - mark a proxyfile from find_or_new_proxyfile as usable
+ * @list: the proxyfile_list
+ * @pf:   the proxyfile
+ *
+ * This is also when the shim gets to see it, unless it's been deleted in
+ * the meantime.
+ */
+void proxyfile_ready(proxyfile_list *list, proxyfile *pf)
+{
+    if(list->published) {
+        pthread_rwlock_rdlock(&list->lock);
+        if(list->table[pf->slot] == pf)
+            pub_add(list->published, pf->file_path, pf->proxy_path);
+        pthread_rwlock_unlock(&list->lock);
+    }
+
+    pthread_mutex_lock(&list->ready_lock);
+    pf->ready = 1;
+    pthread_cond_broadcast(&list->ready_cond);
+    pthread_mutex_unlock(&list->ready_lock);
+}
+
+/**
+ * wait_proxyfile - wait until a proxyfile is usable
+ * @list: the proxyfile_list
+ * @pf:   the proxyfile
+ *
+ * This only ever waits when another thread is copying the file up.
+ */
+void wait_proxyfile(proxyfile_list *list, proxyfile *pf)
+{
+    if(__atomic_load_n(&pf->ready, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&list->ready_lock);
+    while(!pf->ready)
+        pthread_cond_wait(&list->ready_cond, &list->ready_lock);
+    pthread_mutex_unlock(&list->ready_lock);
+}
+
+/**
+ * proxyfile_for_open - find where an open of a file should really go
+ * @list:       the proxyfile_list
+ * @file_path:  the canonical path being opened; if a new proxyfile takes it
+ *              over, it's replaced with a copy for the caller
+ * @flags:      the open flags
+ *
+ * The first open of a file that could change it gets it a proxyfile, which
+ * starts out as a copy of the real file so appends and in-place edits see
+ * what was there.  Any other open goes to the proxyfile if the file has
+ * one, so the process sees its own changes, and to the real file (which is
+ * cheaper than copying it) if not.
+ *
+ * Returns the proxyfile to open instead, or NULL to open the real file.
+ */
+proxyfile *proxyfile_for_open(proxyfile_list *list,
+                              char **file_path,
+                              long flags)
+{
+    int writes = (flags & O_ACCMODE) != O_RDONLY ||
+                 flags & (O_APPEND | O_CREAT | O_TRUNC);
+
+    proxyfile *cur = search_proxyfile(list, *file_path);
+
+    /* Devices, pipes and the like aren't files we can sandbox; writing to
+       /dev/null or a terminal goes straight through. */
+    struct stat sb;
+    if(writes && !cur && !stat(*file_path, &sb) && !S_ISREG(sb.st_mode))
+        writes = 0;
+
+    log_msg(LOG_DEBUG, "open as %s %s\n", writes ? "write" : "read",
+                                   *file_path);
+
+    if(!writes) {
+        if(cur)
+            wait_proxyfile(list, cur);
+        return cur;
+    }
+
+    if(!cur)
+        cur = find_or_new_proxyfile(list, *file_path);
+    if(cur->file_path == *file_path) { /* the first write to this file */
+        int copied = copy_up(*file_path, cur->proxy_path, flags & O_TRUNC,
+                             &sb);
+        if(copied < 0)
+            fprintf(stderr, "fssb: cannot copy %s to the sandbox\n",
+                            *file_path);
+        else if(copied && list->journal)
+            journal_base(list->journal, cur->digest, cur->suffix,
+                         cur->file_path, &sb);
+        proxyfile_ready(list, cur);
+        *file_path = strdup(*file_path);
+    }
+    else if(cur->lower)
+        cur = own_proxyfile(list, cur, flags & O_TRUNC);
+    else
+        wait_proxyfile(list, cur);
+
+    return cur;
+}
+
+/**
+ * own_proxyfile - get a proxyfile the sandbox can change
+ * @list:     the proxyfile_list
+ * @pf:       the proxyfile
+ * @truncate: whether what's in it can be thrown away
+ *
+ * A lower layer's proxy file is copied up into a new proxyfile of our own,
+ * which takes its place; @pf mustn't be used after that.  Any other
+ * proxyfile is ours already.
+ *
+ * Returns a (proxyfile *) pointer.
+ */
+proxyfile *own_proxyfile(proxyfile_list *list, proxyfile *pf, int truncate)
+{
+    if(!pf->lower)
+        return pf;
+
+    long start = STATS_START();
+    char *file_path = strdup(pf->file_path), *lower_path = NULL;
+    unsigned char digest[DIGEST_LEN];
+    memcpy(digest, pf->digest, DIGEST_LEN);
+
+    pthread_rwlock_wrlock(&list->lock);
+    proxyfile *cur = table_find(list, file_path, digest);
+    if(cur->lower) { /* nobody's beaten us to it */
+        lower_path = strdup(cur->proxy_path);
+        table_delete(list, cur);
+        cur = table_new(list, file_path, digest);
+        cur->ready = 0;
+    }
+    pthread_rwlock_unlock(&list->lock);
+
+    STATS_STOP(TIMER_INDEX, start);
+
+    if(!lower_path) {
+        free(file_path);
+        wait_proxyfile(list, cur);
+        return cur;
+    }
+
+    if(copy_up(lower_path, cur->proxy_path, truncate, NULL) < 0)
+        fprintf(stderr, "fssb: cannot copy %s to the sandbox\n", file_path);
+    free(lower_path);
+
+    /* what the lower layer's copy came from is its business; this one's
+       committed over whatever's there now */
+    struct stat sb;
+    if(list->journal && !lstat(file_path, &sb))
+        journal_base(list->journal, cur->digest, cur->suffix, file_path, &sb);
+
+    proxyfile_ready(list, cur);
+    return cur;
+}
+
+/**
+ * note_unlink - record the deletion of a file that had no proxyfile
+ * @list:      the proxyfile_list
+ * @file_path: the real file, which its empty stand-in was deleted for
+ *
+ * There's nothing to take off the records, but committing the sandbox
+ * needs to know to delete it, and what it was.
+ */
+void note_unlink(proxyfile_list *list, char *file_path)
+{
+    struct stat sb;
+    if(!list->journal || lstat(file_path, &sb) != 0)
+        return;
+
+    unsigned char digest[DIGEST_LEN];
+    hash_path(list, file_path, digest);
+
+    journal_base(list->journal, digest, 0, file_path, &sb);
+    journal_add(list->journal, JOURNAL_DELETE, digest, 0, file_path);
+}
+
+/**
+ * note_mkdir - record a directory the sandbox made
+ * @list:     the proxyfile_list
+ * @dir_path: the directory, which isn't there outside the sandbox
+ * @mode:     its permission bits
+ *
+ * The files in it are recorded as any others are; this is so committing
+ * the sandbox has the directory to put them in.
+ */
+void note_mkdir(proxyfile_list *list, char *dir_path, mode_t mode)
+{
+    if(!list->journal)
+        return;
+
+    unsigned char digest[DIGEST_LEN];
+    hash_path(list, dir_path, digest);
+
+    journal_dir(list->journal, digest, dir_path, mode);
+}
+
+/**
+ * proxyfile_for_rename - give a real file about to be renamed a proxyfile
+ * @list:      the proxyfile_list
+ * @file_path: the file; may be replaced, as for proxyfile_for_open
+ *
+ * The sandbox can only rename what's in it, so a real regular file is
+ * copied up first, as for a write.  Once renamed, the journal has it
+ * deleted at the old path and made at the new, and that's what committing
+ * does.  Directories and symlinks are left as they are, and renaming them
+ * fails as before.
+ */
+void proxyfile_for_rename(proxyfile_list *list, char **file_path)
+{
+    struct stat sb;
+    if(search_proxyfile(list, *file_path) || lstat(*file_path, &sb) != 0 ||
+       !S_ISREG(sb.st_mode))
+        return;
+
+    proxyfile_for_open(list, file_path, O_RDWR);
+}
+
+/**
+ * delete_proxyfile - remove a proxyfile from the proxyfile_list
+ * @list: the proxyfile_list
+ * @pf:   the proxyfile
+ *
+ * Deleting a proxyfile another thread has already deleted is harmless.
+ */
+void delete_proxyfile(proxyfile_list *list, proxyfile *pf) {
+    long start = STATS_START();
+
+    pthread_rwlock_wrlock(&list->lock);
+    if(list->table[pf->slot] == pf) {
+        char *file_path = strdup(pf->file_path);
+        unsigned char digest[DIGEST_LEN];
+        memcpy(digest, pf->digest, DIGEST_LEN);
+
+        table_delete(list, pf);
+        uncover_lower(list, file_path, digest);
+        free(file_path);
+    }
+    pthread_rwlock_unlock(&list->lock);
+
+    STATS_STOP(TIMER_INDEX, start);
+}
+
+/**
+ * rename_proxyfile - move the record of a file over to a new path
+ * @list:     the proxyfile_list
+ * @old_path: the path the file was renamed from
+ * @new_path: the path it was renamed to; taken over if a proxyfile is made
+ *
+ * Returns 1 if a proxyfile for @new_path was created, 0 otherwise.
+ */
+int rename_proxyfile(proxyfile_list *list, char *old_path, char *new_path)
+{
+    long start = STATS_START();
+    unsigned char old_digest[DIGEST_LEN], new_digest[DIGEST_LEN];
+    hash_path(list, old_path, old_digest);
+    hash_path(list, new_path, new_digest);
+
+    int retval = 0, suffix = 0;
+
+    /* if it's renamed over a real file, committing will replace that */
+    struct stat sb;
+    int over_real = list->journal && !lstat(new_path, &sb);
+
+    pthread_rwlock_wrlock(&list->lock);
+
+    proxyfile *oldpf = table_find(list, old_path, old_digest);
+    if(oldpf) { /* nothing to do if this is an invalid rename */
+        table_delete(list, oldpf);
+        uncover_lower(list, old_path, old_digest);
+
+        /* register the new file as a known file for future reads */
+        if(!table_find(list, new_path, new_digest)) {
+            proxyfile *newpf = table_new(list, new_path, new_digest);
+            if(list->published)
+                pub_add(list->published, newpf->file_path, newpf->proxy_path);
+            suffix = newpf->suffix;
+            retval = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&list->lock);
+
+    if(retval && over_real)
+        journal_base(list->journal, new_digest, suffix, new_path, &sb);
+
+    STATS_STOP(TIMER_INDEX, start);
+    return retval;
+}
+
+/**
+ * get_proxy_path - returns the path of the proxyfile for the given file
+ * @list:      the proxyfile_list
+ * @file_path: path of the original file
+ *
+ * If the file doesn't have a proxyfile yet, this is the path one created now
+ * would get.
+ *
+ * Returns a (char *) pointer.  Remember to free this at the end.
+ */
+char *get_proxy_path(proxyfile_list *list, char *file_path)
+{
+    long start = STATS_START();
+    STATS_COUNT(STAT_LOOKUPS);
+
+    unsigned char digest[DIGEST_LEN];
+    char name[PROXY_NAME_MAX + 1];
+    hash_path(list, file_path, digest);
+
+    pthread_rwlock_rdlock(&list->lock);
+
+    proxyfile *cur = table_lookup(list, file_path, digest);
+    if(cur && !cur->lower) {
+        char *retval = strdup(cur->proxy_path);
+        pthread_rwlock_unlock(&list->lock);
+        STATS_STOP(TIMER_INDEX, start);
+        return retval;
+    }
+
+    /* the caller's about to change it, so a lower layer's has to be
+       copied up */
+    if(cur || in_lowers(list, file_path, digest)) {
+        pthread_rwlock_unlock(&list->lock);
+
+        pthread_rwlock_wrlock(&list->lock);
+        cur = table_find(list, file_path, digest);
+        pthread_rwlock_unlock(&list->lock);
+
+        STATS_STOP(TIMER_INDEX, start);
+        return strdup(own_proxyfile(list, cur, 0)->proxy_path);
+    }
+
+    long slot = list->saved ? snapshot_find(list->saved, file_path, digest)
+                            : -1;
+    if(slot >= 0)
+        format_name(digest, list->saved->slots[slot].suffix, name);
+    else
+        proxy_name(list, digest, name);
+
+    pthread_rwlock_unlock(&list->lock);
+
+    char *retval = (char *)malloc(strlen(list->SANDBOX_DIR) + strlen(name) + 1);
+    strcpy(retval, list->SANDBOX_DIR);
+    strcat(retval, name);
+
+    STATS_STOP(TIMER_INDEX, start);
+    return retval;
+}
+
+/**
+ * free_retired_proxyfiles - free what was retired while the list was shared
+ * @list: the proxyfile_list
+ *
+ * That's deleted proxyfiles and replaced Bloom filters.  Only call this once
+ * no other thread can be holding on to either.
+ */
+void free_retired_proxyfiles(proxyfile_list *list)
+{
+    while(list->filter->retired) {
+        bloom *old = list->filter->retired;
+        list->filter->retired = old->retired;
+        free_bloom(old);
+    }
+
+    while(list->retired) {
+        proxyfile *pf = list->retired;
+        list->retired = pf->next;
+
+        free(pf->file_path);
+        free(pf->name);
+        free(pf->proxy_path);
+        free(pf);
+    }
+}
+
+/**
+ * next_saved - step through the proxyfiles still only in the snapshot
+ * @list: the proxyfile_list
+ * @slot: the last slot, or -1 to start
+ *
+ * Returns the next slot, or -1 once there are none left.
+ */
+static long next_saved(proxyfile_list *list, long slot)
+{
+    if(!list->saved)
+        return -1;
+
+    for(slot++; slot < (long)list->saved->header->capacity; slot++)
+        if(list->saved->slots[slot].path && !list->saved->taken[slot])
+            return slot;
+
+    return -1;
+}
+
+/**
+ * publish_snapshots - publish the proxyfiles still only in snapshots
+ * @list: the proxyfile_list
+ *
+ * The rest are published as they're made; call this once list->published
+ * is set.  Lower layers go in bottom-up, so that the topmost wins.
+ */
+void publish_snapshots(proxyfile_list *list)
+{
+    long slot;
+    char name[PROXY_NAME_MAX + 1], proxy_path[PATH_MAX];
+
+    int i;
+    for(i = list->lower_count - 1; i >= 0; i--) {
+        snapshot *lower = list->lowers[i];
+        for(slot = 0; slot < (long)lower->header->capacity; slot++) {
+            snapshot_slot *s = &lower->slots[slot];
+            if(!s->path)
+                continue;
+
+            format_name(s->digest, s->suffix, name);
+            snprintf(proxy_path, sizeof(proxy_path), "%s%s",
+                     lower->SANDBOX_DIR, name);
+            pub_add_lower(list->published, lower->strings + s->path,
+                          proxy_path);
+        }
+    }
+
+    for(slot = next_saved(list, -1); slot >= 0; slot = next_saved(list, slot)) {
+        snapshot_slot *s = &list->saved->slots[slot];
+        format_name(s->digest, s->suffix, name);
+        snprintf(proxy_path, sizeof(proxy_path), "%s%s", list->SANDBOX_DIR,
+                 name);
+        pub_add(list->published, list->saved->strings + s->path, proxy_path);
+    }
+}
+
 /**
  * print_map - print the internal file map
  * @list:     the proxyfile_list
  * @log_file: a (FILE *) pointer to write to
  *
- * Prints each MD5 and its real file path.  This is done only when the -m
- * arg is passed to FSSB.
+ * Prints each proxy file name and its real file path.  This is done only when the -m
+ * arg is passed to FSSB.  Those still only in the snapshot come first.
  */
 void print_map(proxyfile_list *list, FILE *log_file) {
+    long slot;
+    char name[PROXY_NAME_MAX + 1];
+    for(slot = next_saved(list, -1); slot >= 0; slot = next_saved(list, slot)) {
+        snapshot_slot *s = &list->saved->slots[slot];
+        format_name(s->digest, s->suffix, name);
+        fprintf(log_file, "    + %s = %s\n", name,
+                          list->saved->strings + s->path);
+    }
+
     proxyfile *cur = list->head;
     while(cur != NULL) {
-        fprintf(log_file, "    + %s = %s\n", cur->md5, cur->file_path);
+        if(!cur->lower)
+            fprintf(log_file, "    + %s = %s\n", cur->name, cur->file_path);
         cur = cur->next;
     }
 }
 
 /**
- * write_map - writes the proxy file map list to a file
- * @list:        the proxfile_list
- * @SANDBOX_DIR: the sandbox directory
+ * write_meta - records how the sandbox was set up
+ * @list: the proxyfile_list
  *
- * Writes the list of proxy files and their actual file maps.
+ * Anything reading the sandbox later (say, to make sense of the proxy file
+ * names) can find the details in the meta file.
  */
-extern void write_map(proxyfile_list *list, char *SANDBOX_DIR)
+void write_meta(proxyfile_list *list)
 {
-    char proxyfile_map[256];
-    strcpy(proxyfile_map, SANDBOX_DIR);
-    strcat(proxyfile_map, "file-map");
-    FILE *pfm = fopen(proxyfile_map, "w");
+    char meta_path[PATH_MAX];
+    strcpy(meta_path, list->SANDBOX_DIR);
+    strcat(meta_path, "meta");
+    FILE *meta = fopen(meta_path, "w");
 
-    proxyfile *cur = list->head;
-    while(cur != NULL) {
-        fprintf(pfm, "%s%s = %s\n", SANDBOX_DIR, cur->md5, cur->file_path);
-        cur = cur->next;
-    }
+    fprintf(meta, "hash = %s\n", hash_algo_name(list->hash_algo));
+
+    int i;
+    for(i = 0; i < list->lower_count; i++)
+        fprintf(meta, "lower = %s\n", list->lowers[i]->SANDBOX_DIR);
 
-    fclose(pfm);
+    fclose(meta);
 }
 
 /**
@@ -163,9 +1134,37 @@ extern void write_map(proxyfile_list *list, char *SANDBOX_DIR)
  */
 void remove_proxy_files(proxyfile_list *list)
 {
+    char path[PATH_MAX];
+
+    long slot;
+    char name[PROXY_NAME_MAX + 1];
+    for(slot = next_saved(list, -1); slot >= 0; slot = next_saved(list, slot)) {
+        snapshot_slot *s = &list->saved->slots[slot];
+        format_name(s->digest, s->suffix, name);
+        snprintf(path, sizeof(path), "%s%s", list->SANDBOX_DIR, name);
+        remove(path);
+    }
+
     proxyfile *cur = list->head;
     while(cur != NULL) {
-        remove(cur->proxy_path);
+        if(!cur->lower)
+            remove(cur->proxy_path);
         cur = cur->next;
     }
+
+    strcpy(path, list->SANDBOX_DIR);
+    strcat(path, "meta");
+    remove(path);
+
+    strcpy(path, list->SANDBOX_DIR);
+    strcat(path, "file-map");
+    remove(path);
+
+    strcpy(path, list->SANDBOX_DIR);
+    strcat(path, "journal");
+    remove(path);
+
+    strcpy(path, list->SANDBOX_DIR);
+    strcat(path, "snapshot");
+    remove(path);
 }
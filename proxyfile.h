@@ -21,17 +21,72 @@
 #define _PROXYFILE_H
 
 #include <stdio.h>
+#include <pthread.h>
+
+#include "hash.h"
+#include "bloom.h"
+#include "pubindex.h"
+#include "journal.h"
+#include "snapshot.h"
+
+/* Longest proxy file name: the hex digest and a collision suffix. */
+#define PROXY_NAME_MAX (2*DIGEST_LEN + 12)
 
 typedef struct {
     void *next, *prev;
-    char *file_path, *md5, *proxy_path;
+    char *file_path, *name, *proxy_path;
+    unsigned char digest[DIGEST_LEN];
+    int suffix; /* tells apart paths with the same digest */
+    int slot;   /* position in the hash table */
+    int ready;  /* the proxy file has its contents */
+    int lower;  /* the proxy file is a lower layer's, not to be changed */
     int fd;
 } proxyfile;
 
 typedef struct {
+    /* insertion order, for the map */
     proxyfile *head, *tail;
+
+    /* open addressing hash table keyed by the path digest */
+    proxyfile **table;
+    int capacity, tombstones;
+
+    /* Most lookups are for paths the sandbox has never seen; the filter
+       answers those without going near the lock or the table. */
+    bloom *filter;
+    long filter_misses, filter_hits, filter_false_positives;
+
+    /* Lookups share the lock, changes take it exclusively.  When the list
+       is shared between tracer threads, a deleted proxyfile may still be
+       in use by a reader, so it goes on the retired list and is only freed
+       by free_retired_proxyfiles once the threads are done. */
+    pthread_rwlock_t lock;
+    int shared;
+    proxyfile *retired;
+
+    /* for waiting on a proxyfile that's being copied up */
+    pthread_mutex_t ready_lock;
+    pthread_cond_t ready_cond;
+
+    /* where proxyfiles that are ready get published for the shim, if
+       anywhere */
+    pub_index *published;
+
+    /* where every proxyfile made or deleted is recorded as it happens */
+    journal *journal;
+
+    /* With -u, the proxyfiles the sandbox had are looked up here, and only
+       brought into the table when they're used. */
+    snapshot *saved;
+
+    /* The read-only sandboxes underneath (-l), searched in order after the
+       table and the snapshot.  Their proxyfiles are brought into the table
+       too when they're used, and copied up before they're changed. */
+    snapshot **lowers;
+    int lower_count;
+
     int used;
-    int PROXY_FILE_LEN;
+    int hash_algo;
     char *SANDBOX_DIR;
 } proxyfile_list;
 
@@ -41,11 +96,41 @@ extern proxyfile *new_proxyfile(proxyfile_list *list, char *file_path);
 
 extern proxyfile *search_proxyfile(proxyfile_list *list, char *file_path);
 
+extern proxyfile *find_or_new_proxyfile(proxyfile_list *list, char *file_path);
+
+extern void proxyfile_ready(proxyfile_list *list, proxyfile *pf);
+
+extern void wait_proxyfile(proxyfile_list *list, proxyfile *pf);
+
+extern proxyfile *proxyfile_for_open(proxyfile_list *list,
+                                     char **file_path,
+                                     long flags);
+
+extern proxyfile *own_proxyfile(proxyfile_list *list,
+                                proxyfile *pf,
+                                int truncate);
+
+extern void note_unlink(proxyfile_list *list, char *file_path);
+
+extern void note_mkdir(proxyfile_list *list, char *dir_path, mode_t mode);
+
+extern void proxyfile_for_rename(proxyfile_list *list, char **file_path);
+
 extern void delete_proxyfile(proxyfile_list *list, proxyfile *pf);
 
+extern int rename_proxyfile(proxyfile_list *list,
+                            char *old_path,
+                            char *new_path);
+
+extern void free_retired_proxyfiles(proxyfile_list *list);
+
+extern char *get_proxy_path(proxyfile_list *list, char *file_path);
+
+extern void publish_snapshots(proxyfile_list *list);
+
 extern void print_map(proxyfile_list *list, FILE *log_file);
 
-extern void write_map(proxyfile_list *list, char *SANDBOX_DIR);
+extern void write_meta(proxyfile_list *list);
 
 extern void remove_proxy_files(proxyfile_list *list);
 
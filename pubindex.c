@@ -0,0 +1,280 @@
+/**
+ * pubindex.c - The proxyfile index as the preload shim sees it.  Part of
+ * the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The tracer keeps the real index (proxyfile.c) to itself.  What it
+ * publishes here is a copy of just the proxyfiles that are ready, in a file
+ * the shim maps read-only, so a process can look a path up without asking
+ * anybody.  Everything else (creating a proxyfile, deleting one) still goes
+ * through the tracer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "pubindex.h"
+#include "hash.h"
+
+/* Past this, probe sequences get long; stop adding paths. */
+#define PUB_MAX_USED (PUB_SLOTS / 4 * 3)
+
+/**
+ * path_hash - hash a path for the slots
+ * @path: the path
+ */
+static unsigned long path_hash(const char *path)
+{
+    unsigned char digest[DIGEST_LEN];
+    unsigned long h;
+
+    hash_digest(HASH_MURMUR3, path, strlen(path), digest);
+    memcpy(&h, digest, sizeof(h));
+    return h;
+}
+
+/**
+ * find_slot - find the slot of a path
+ * @table: the table
+ * @path:  the path
+ * @hash:  its hash
+ *
+ * Returns the slot, or the empty slot it would go in.
+ */
+static pub_slot *find_slot(pub_table *table, const char *path,
+                           unsigned long hash)
+{
+    unsigned int i = hash & (PUB_SLOTS - 1);
+
+    while(1) {
+        pub_slot *s = &table->slots[i];
+        if(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) == PUB_EMPTY)
+            return s;
+        if(s->hash == hash && strcmp(table->arena + s->path, path) == 0)
+            return s;
+        i = (i + 1) & (PUB_SLOTS - 1);
+    }
+}
+
+/**
+ * arena_add - copy a string into the arena
+ * @table: the table
+ * @str:   the string
+ *
+ * Returns its offset, or 0 if it doesn't fit (the first byte of the arena
+ * is never handed out).
+ */
+static unsigned int arena_add(pub_table *table, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    if(table->arena_used + len > PUB_ARENA)
+        return 0;
+
+    unsigned int retval = table->arena_used;
+    memcpy(table->arena + retval, str, len);
+    table->arena_used += len;
+
+    return retval;
+}
+
+/**
+ * new_pub_index - create the file the index is published in
+ * @path: where to put it
+ *
+ * Returns a (pub_index *) pointer, or NULL if the file can't be set up.
+ */
+pub_index *new_pub_index(char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return NULL;
+
+    pub_table *table = MAP_FAILED;
+    if(ftruncate(fd, sizeof(pub_table)) == 0)
+        table = (pub_table *)mmap(NULL, sizeof(pub_table),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(table == MAP_FAILED) {
+        unlink(path);
+        return NULL;
+    }
+
+    table->arena_used = 1;
+
+    pub_index *retval = (pub_index *)malloc(sizeof(pub_index));
+    retval->table = table;
+    retval->path = strdup(path);
+    pthread_mutex_init(&retval->lock, NULL);
+
+    return retval;
+}
+
+/**
+ * free_pub_index - take down the published index
+ * @index: the pub_index
+ */
+void free_pub_index(pub_index *index)
+{
+    munmap(index->table, sizeof(pub_table));
+    unlink(index->path);
+    free(index->path);
+    free(index);
+}
+
+/**
+ * publish - publish the proxy file of a path
+ * @index:      the pub_index
+ * @file_path:  the canonical path
+ * @proxy_path: where its proxy file is
+ * @state:      PUB_LIVE or PUB_LOWER
+ */
+static void publish(pub_index *index,
+                    const char *file_path,
+                    const char *proxy_path,
+                    int state)
+{
+    pub_table *table = index->table;
+    unsigned long hash = path_hash(file_path);
+
+    pthread_mutex_lock(&index->lock);
+
+    pub_slot *s = find_slot(table, file_path, hash);
+    unsigned int proxy = arena_add(table, proxy_path);
+
+    if(s->state == PUB_EMPTY) {
+        unsigned int path = 0;
+        if(proxy && table->slots_used < PUB_MAX_USED)
+            path = arena_add(table, file_path);
+
+        if(!path) {
+            __atomic_store_n(&table->overflowed, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&index->lock);
+            return;
+        }
+
+        s->hash = hash;
+        s->path = path;
+        table->slots_used++;
+    }
+    else if(!proxy) {
+        /* what's there now would be wrong */
+        __atomic_store_n(&s->state, PUB_GONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&table->overflowed, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&index->lock);
+        return;
+    }
+
+    __atomic_store_n(&s->proxy, proxy, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->state, state, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * pub_add - publish the proxy file of a path
+ * @index:      the pub_index
+ * @file_path:  the canonical path
+ * @proxy_path: where its proxy file is
+ *
+ * Only call this once the proxy file has its contents.
+ */
+void pub_add(pub_index *index, const char *file_path, const char *proxy_path)
+{
+    publish(index, file_path, proxy_path, PUB_LIVE);
+}
+
+/**
+ * pub_add_lower - publish a proxy file from a lower layer (-l)
+ * @index:      the pub_index
+ * @file_path:  the canonical path
+ * @proxy_path: where its proxy file is
+ *
+ * The shim only reads these; a write goes to the tracer, which copies the
+ * file up first.
+ */
+void pub_add_lower(pub_index *index,
+                   const char *file_path,
+                   const char *proxy_path)
+{
+    publish(index, file_path, proxy_path, PUB_LOWER);
+}
+
+/**
+ * pub_remove - take a path back out of the published index
+ * @index:     the pub_index
+ * @file_path: the canonical path
+ */
+void pub_remove(pub_index *index, const char *file_path)
+{
+    pub_table *table = index->table;
+    unsigned long hash = path_hash(file_path);
+
+    pthread_mutex_lock(&index->lock);
+
+    pub_slot *s = find_slot(table, file_path, hash);
+    if(s->state == PUB_LIVE || s->state == PUB_LOWER)
+        __atomic_store_n(&s->state, PUB_GONE, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * map_pub_table - map a published index to read it
+ * @fd: the index file, open for reading
+ *
+ * Returns a (pub_table *) pointer, or NULL on failure.
+ */
+pub_table *map_pub_table(int fd)
+{
+    void *retval = mmap(NULL, sizeof(pub_table), PROT_READ, MAP_SHARED, fd, 0);
+    return retval == MAP_FAILED ? NULL : (pub_table *)retval;
+}
+
+/**
+ * pub_lookup - look up the proxy file of a path
+ * @table:     the mapped table
+ * @file_path: the canonical path
+ * @known:     set to whether a NULL return can be trusted
+ * @lower:     set to whether the proxy file is in a lower layer, and so only
+ *             to be read
+ *
+ * Returns the proxy path, or NULL if the path has no proxy file that's
+ * ready (or none that's been published, if *@known is 0).
+ */
+const char *pub_lookup(pub_table *table,
+                       const char *file_path,
+                       int *known,
+                       int *lower)
+{
+    pub_slot *s = find_slot(table, file_path, path_hash(file_path));
+
+    int state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    *lower = state == PUB_LOWER;
+    if(state == PUB_LIVE || state == PUB_LOWER) {
+        *known = 1;
+        return table->arena + __atomic_load_n(&s->proxy, __ATOMIC_RELAXED);
+    }
+
+    *known = !__atomic_load_n(&table->overflowed, __ATOMIC_ACQUIRE);
+    return NULL;
+}
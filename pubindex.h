@@ -0,0 +1,89 @@
+/**
+ * pubindex.h - The proxyfile index as the preload shim sees it.  Part of
+ * the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PUBINDEX_H
+#define _PUBINDEX_H
+
+#include <pthread.h>
+
+/* Fixed sizes, so the shim never has to remap.  The file is sparse; only
+   the pages that get written take up memory. */
+#define PUB_SLOTS (1 << 16)
+#define PUB_ARENA (16 << 20)
+
+/* slot states */
+#define PUB_EMPTY 0
+#define PUB_LIVE  1
+#define PUB_GONE  2
+#define PUB_LOWER 3 /* live, but in a lower layer: only to be read */
+
+typedef struct {
+    unsigned long hash;
+    unsigned int path, proxy; /* offsets into the arena */
+    int state;
+} pub_slot;
+
+/**
+ * pub_table - the shared memory layout
+ *
+ * Slots are open addressed and never reused for another path, so a reader
+ * can probe without a lock; a path that goes away is marked PUB_GONE, and
+ * the strings stay in the arena for good.  Once something doesn't fit,
+ * @overflowed is set and the shim can no longer take a missing path to mean
+ * the file has no proxy.
+ */
+typedef struct {
+    int overflowed;
+    unsigned int arena_used, slots_used;
+    pub_slot slots[PUB_SLOTS];
+    char arena[PUB_ARENA];
+} pub_table;
+
+/**
+ * pub_index - the tracer's handle on the published index
+ */
+typedef struct {
+    pub_table *table;
+    char *path;
+    pthread_mutex_t lock; /* writers only */
+} pub_index;
+
+extern pub_index *new_pub_index(char *path);
+
+extern void free_pub_index(pub_index *index);
+
+extern void pub_add(pub_index *index,
+                    const char *file_path,
+                    const char *proxy_path);
+
+extern void pub_add_lower(pub_index *index,
+                          const char *file_path,
+                          const char *proxy_path);
+
+extern void pub_remove(pub_index *index, const char *file_path);
+
+extern pub_table *map_pub_table(int fd);
+
+extern const char *pub_lookup(pub_table *table,
+                              const char *file_path,
+                              int *known,
+                              int *lower);
+
+#endif /* _PUBINDEX_H */
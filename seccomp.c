@@ -0,0 +1,159 @@
+/**
+ * seccomp.c - Seccomp filter setup.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+#include "seccomp.h"
+
+#ifdef __amd64__
+#define FSSB_AUDIT_ARCH AUDIT_ARCH_X86_64
+#else
+#define FSSB_AUDIT_ARCH AUDIT_ARCH_I386
+#endif
+
+/**
+ * install_filter - send the given syscalls to the supervisor
+ * @syscalls: syscall numbers the supervisor is to see
+ * @count:    number of entries in @syscalls
+ * @action:   what the filter returns for those
+ * @flags:    flags for the seccomp syscall
+ * @cookie:   if not 0, the value in the last argument of a syscall the shim
+ *            has already taken care of
+ *
+ * Every other syscall is allowed straight through without the supervisor
+ * ever seeing it.  Syscalls made with a foreign ABI (say, int 0x80 on x86_64)
+ * have different numbers, so we don't try to be clever and send all of them.
+ *
+ * None of the syscalls we care about use their sixth argument, so the shim
+ * (see shim.c) passes the cookie there for the ones it has rewritten itself.
+ * Nothing stops a program from doing the same; FSSB keeps a program from
+ * changing your files by accident, it's no defence against one that means
+ * to.
+ *
+ * Returns what the seccomp syscall returned.
+ */
+static int install_filter(const int *syscalls,
+                          int count,
+                          unsigned int action,
+                          unsigned int flags,
+                          unsigned long cookie)
+{
+    /* 3 instructions for the arch check, 1 to load the syscall number, one
+       comparison per syscall, 2 return instructions and 5 for the cookie */
+    int len = 4 + count + 2 + (cookie ? 5 : 0);
+    struct sock_filter *filter = (struct sock_filter *)
+                                 malloc(len*sizeof(struct sock_filter));
+    int pos = 0, i;
+
+    filter[pos++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+    filter[pos++] = (struct sock_filter)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, FSSB_AUDIT_ARCH, 1, 0);
+    filter[pos++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, action);
+
+    filter[pos++] = (struct sock_filter)
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+
+    /* on a match, jump over the remaining comparisons and the ALLOW to the
+       final instruction */
+    for(i = 0; i < count; i++)
+        filter[pos++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, syscalls[i], count - i, 0);
+
+    filter[pos++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+    /* both halves of the sixth argument have to match */
+    if(cookie) {
+        filter[pos++] = (struct sock_filter)
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                     offsetof(struct seccomp_data, args[5]));
+        filter[pos++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)cookie, 0, 3);
+        filter[pos++] = (struct sock_filter)
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                     offsetof(struct seccomp_data, args[5]) + 4);
+        filter[pos++] = (struct sock_filter)
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cookie >> 32, 0, 1);
+        filter[pos++] = (struct sock_filter)
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+    }
+
+    filter[pos++] = (struct sock_filter)
+        BPF_STMT(BPF_RET | BPF_K, action);
+
+    struct sock_fprog prog = {
+        .len = (unsigned short)len,
+        .filter = filter,
+    };
+
+    /* required to install a filter without CAP_SYS_ADMIN */
+    int retval = -1;
+    if(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0)
+        retval = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, flags, &prog);
+
+    free(filter);
+    return retval;
+}
+
+/**
+ * install_syscall_filter - make only the given syscalls stop the tracer
+ * @syscalls: syscall numbers that should raise a PTRACE_EVENT_SECCOMP stop
+ * @count:    number of entries in @syscalls
+ * @cookie:   lets through syscalls the shim has rewritten, if not 0
+ *
+ * This must be called in the child before it execs.  The filter survives the
+ * exec and is inherited by every process the child creates.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int install_syscall_filter(const int *syscalls,
+                           int count,
+                           unsigned long cookie)
+{
+    return install_filter(syscalls, count, SECCOMP_RET_TRACE, 0, cookie) == 0 ?
+           0 : -1;
+}
+
+/**
+ * install_notify_filter - have the given syscalls wait on a supervisor
+ * @syscalls: syscall numbers the supervisor decides on
+ * @count:    number of entries in @syscalls
+ * @cookie:   lets through syscalls the shim has rewritten, if not 0
+ *
+ * Like install_syscall_filter, but the syscalls are reported on the fd this
+ * returns instead of to a tracer; see notify.c.
+ *
+ * Returns the notification fd, or -1 on failure.
+ */
+int install_notify_filter(const int *syscalls,
+                          int count,
+                          unsigned long cookie)
+{
+    return install_filter(syscalls, count, SECCOMP_RET_USER_NOTIF,
+                          SECCOMP_FILTER_FLAG_NEW_LISTENER, cookie);
+}
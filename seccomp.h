@@ -0,0 +1,31 @@
+/**
+ * seccomp.h - Seccomp filter setup.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SECCOMP_H
+#define _SECCOMP_H
+
+extern int install_syscall_filter(const int *syscalls,
+                                  int count,
+                                  unsigned long cookie);
+
+extern int install_notify_filter(const int *syscalls,
+                                 int count,
+                                 unsigned long cookie);
+
+#endif /* _SECCOMP_H */
@@ -0,0 +1,408 @@
+/**
+ * shim.c - The LD_PRELOAD shim.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With -p, every dynamically linked program the child runs gets this
+ * library preloaded.  It stands in for the libc calls that open and stat
+ * files, looks the path up in the index the tracer publishes (pubindex.c),
+ * and makes the syscall itself, on the proxy file or the real one, with the
+ * cookie the seccomp filter lets through.  That's a function call where the
+ * tracer would have taken two context switches.
+ *
+ * Whatever the shim can't settle on its own (the first write to a file,
+ * directory fds the tracer keeps track of, relative paths off a directory
+ * fd) is made as a plain syscall, so the tracer handles it as it always
+ * has.  So are static binaries, raw syscall() users and anything inside libc
+ * that doesn't go through these symbols.
+ */
+
+#define _GNU_SOURCE  /* for O_PATH and the 64 variants */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "pubindex.h"
+#include "path.h"
+
+#ifndef __amd64__
+#error "the preload shim's own_syscall is x86_64 code"
+#endif
+
+/* only what stands in for libc is visible to the program */
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+static pub_table *table;
+static unsigned long cookie;
+
+/**
+ * own_syscall - make a syscall the filter lets straight through
+ * @nr: the syscall number
+ *
+ * The cookie goes in the sixth argument, which none of these use.  The
+ * kernel leaves the registers as they were, and libc's own wrappers don't
+ * touch the ones they have no use for, so the cookie is wiped from r9 right
+ * away; otherwise the next unlink libc makes would sail through the filter.
+ *
+ * Returns what syscall() would.
+ */
+static long own_syscall(long nr, long a0, long a1, long a2, long a3, long a4)
+{
+    register long r10 asm("r10") = a3;
+    register long r8 asm("r8") = a4;
+    register long r9 asm("r9") = cookie;
+    long ret = nr;
+
+    asm volatile("syscall\n\t"
+                 "xor %%r9d, %%r9d"
+                 : "+a"(ret), "+r"(r9)
+                 : "D"(a0), "S"(a1), "d"(a2), "r"(r10), "r"(r8)
+                 : "rcx", "r11", "memory");
+
+    if(ret < 0 && ret > -4096) {
+        errno = -ret;
+        return -1;
+    }
+
+    return ret;
+}
+
+/**
+ * shim_init - map the published index
+ *
+ * Without FSSB_INDEX and FSSB_COOKIE (say, fssb isn't running us, or the
+ * program cleaned out its environment), the shim stays out of the way.
+ */
+__attribute__((constructor))
+static void shim_init()
+{
+    char *index_path = getenv("FSSB_INDEX"),
+         *cookie_str = getenv("FSSB_COOKIE");
+    if(!index_path || !cookie_str)
+        return;
+
+    cookie = strtoul(cookie_str, NULL, 16);
+
+    int fd = own_syscall(SYS_openat, AT_FDCWD, (long)index_path,
+                         O_RDONLY | O_CLOEXEC, 0, 0);
+    if(fd < 0)
+        return;
+
+    table = map_pub_table(fd);
+    own_syscall(SYS_close, fd, 0, 0, 0, 0);
+}
+
+/**
+ * shim_path - get the key the index has a path under
+ * @dirfd: the directory a relative @path is relative to
+ * @path:  the path as the program gave it
+ *
+ * Relative paths are taken against getcwd, which the tracer agrees with (see
+ * syscall_exit).  Ones relative to another directory fd are left to the
+ * tracer, which knows where its directory fds point.
+ *
+ * Returns a (char *) pointer to be freed, or NULL if the tracer should see
+ * this one.
+ */
+static char *shim_path(int dirfd, const char *path)
+{
+    if(!table || !path || path[0] == 0)
+        return NULL;
+
+    if(path[0] == '/')
+        return canonical_path("/", path);
+
+    if(dirfd != AT_FDCWD)
+        return NULL;
+
+    char cwd[PATH_MAX];
+    if(!getcwd(cwd, sizeof(cwd)))
+        return NULL;
+
+    return canonical_path(cwd, path);
+}
+
+/**
+ * shim_open - open a file, going round the tracer if we can
+ * @dirfd: the directory a relative @path is relative to
+ * @path:  the path
+ * @flags: the open flags
+ * @mode:  the mode for a new file
+ *
+ * This follows proxyfile_for_open: a file with a proxy is opened there, and
+ * one without is opened as it is if nothing's going to change it.  Making a
+ * proxy is the tracer's job.
+ *
+ * Returns what open returns.
+ */
+static int shim_open(int dirfd, const char *path, int flags, mode_t mode)
+{
+    char *file_path = NULL;
+    if(!(flags & (O_DIRECTORY | O_PATH)))
+        file_path = shim_path(dirfd, path);
+
+    if(!file_path)
+        return syscall(SYS_openat, dirfd, path, flags, mode);
+
+    int known, lower;
+    const char *proxy = pub_lookup(table, file_path, &known, &lower);
+    free(file_path);
+
+    int writes = (flags & O_ACCMODE) != O_RDONLY ||
+                 flags & (O_APPEND | O_CREAT | O_TRUNC);
+
+    /* a lower layer's file has to be copied up before it's written */
+    if(proxy && !(lower && writes))
+        return own_syscall(SYS_openat, AT_FDCWD, (long)proxy, flags, mode, 0);
+    if(known && !proxy && !writes)
+        return own_syscall(SYS_openat, dirfd, (long)path, flags, mode, 0);
+
+    return syscall(SYS_openat, dirfd, path, flags, mode);
+}
+
+/**
+ * shim_stat - stat a file, going round the tracer if we can
+ * @dirfd: the directory a relative @path is relative to
+ * @path:  the path
+ * @buf:   where the result goes
+ * @flags: AT_* flags
+ *
+ * Returns what fstatat returns.
+ */
+static int shim_stat(int dirfd, const char *path, struct stat *buf, int flags)
+{
+    char *file_path = shim_path(dirfd, path);
+    if(!file_path)
+        return syscall(SYS_newfstatat, dirfd, path, buf, flags);
+
+    int known, lower;
+    const char *proxy = pub_lookup(table, file_path, &known, &lower);
+    free(file_path);
+
+    if(proxy)
+        return own_syscall(SYS_newfstatat, AT_FDCWD, (long)proxy,
+                           (long)buf, flags, 0);
+    if(known)
+        return own_syscall(SYS_newfstatat, dirfd, (long)path,
+                           (long)buf, flags, 0);
+
+    return syscall(SYS_newfstatat, dirfd, path, buf, flags);
+}
+
+/**
+ * shim_access - check access to a file, going round the tracer if we can
+ * @dirfd: the directory a relative @path is relative to
+ * @path:  the path
+ * @mode:  the access mode
+ * @flags: AT_* flags; plain faccessat has none, so any at all means
+ *         faccessat2, which is left to the tracer
+ *
+ * Returns what faccessat returns.
+ */
+static int shim_access(int dirfd, const char *path, int mode, int flags)
+{
+    if(flags)
+        return syscall(SYS_faccessat2, dirfd, path, mode, flags);
+
+    char *file_path = shim_path(dirfd, path);
+    if(!file_path)
+        return syscall(SYS_faccessat, dirfd, path, mode);
+
+    int known, lower;
+    const char *proxy = pub_lookup(table, file_path, &known, &lower);
+    free(file_path);
+
+    if(proxy)
+        return own_syscall(SYS_faccessat, AT_FDCWD, (long)proxy, mode, 0, 0);
+    if(known)
+        return own_syscall(SYS_faccessat, dirfd, (long)path, mode, 0, 0);
+
+    return syscall(SYS_faccessat, dirfd, path, mode);
+}
+
+/**
+ * fopen_flags - get the open flags for an fopen mode
+ * @mode: the mode
+ *
+ * Returns the flags, or -1 if the mode makes no sense.
+ */
+static int fopen_flags(const char *mode)
+{
+    int flags;
+    switch(mode[0]) {
+        case 'r': flags = O_RDONLY; break;
+        case 'w': flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+        case 'a': flags = O_WRONLY | O_CREAT | O_APPEND; break;
+        default: return -1;
+    }
+
+    const char *p;
+    for(p = mode + 1; *p && *p != ','; p++) {
+        if(*p == '+')
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        else if(*p == 'e')
+            flags |= O_CLOEXEC;
+        else if(*p == 'x')
+            flags |= O_EXCL;
+    }
+
+    return flags;
+}
+
+/**
+ * get_mode - fetch the mode argument of an open
+ * @flags: the open flags
+ * @args:  the variable arguments
+ */
+#define get_mode(flags, args) \
+    ((flags) & (O_CREAT | O_TMPFILE) ? va_arg(args, mode_t) : 0)
+
+SHIM_EXPORT int open(const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = get_mode(flags, args);
+    va_end(args);
+
+    return shim_open(AT_FDCWD, path, flags, mode);
+}
+
+SHIM_EXPORT int open64(const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = get_mode(flags, args);
+    va_end(args);
+
+    return shim_open(AT_FDCWD, path, flags, mode);
+}
+
+SHIM_EXPORT int openat(int dirfd, const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = get_mode(flags, args);
+    va_end(args);
+
+    return shim_open(dirfd, path, flags, mode);
+}
+
+SHIM_EXPORT int openat64(int dirfd, const char *path, int flags, ...)
+{
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = get_mode(flags, args);
+    va_end(args);
+
+    return shim_open(dirfd, path, flags, mode);
+}
+
+/* what _FORTIFY_SOURCE builds call instead */
+SHIM_EXPORT int __open_2(const char *path, int flags)
+{
+    return shim_open(AT_FDCWD, path, flags, 0);
+}
+
+SHIM_EXPORT int __open64_2(const char *path, int flags)
+{
+    return shim_open(AT_FDCWD, path, flags, 0);
+}
+
+SHIM_EXPORT int __openat_2(int dirfd, const char *path, int flags)
+{
+    return shim_open(dirfd, path, flags, 0);
+}
+
+SHIM_EXPORT int __openat64_2(int dirfd, const char *path, int flags)
+{
+    return shim_open(dirfd, path, flags, 0);
+}
+
+SHIM_EXPORT FILE *fopen(const char *path, const char *mode)
+{
+    int flags = fopen_flags(mode);
+    if(flags == -1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = shim_open(AT_FDCWD, path, flags, 0666);
+    if(fd < 0)
+        return NULL;
+
+    FILE *retval = fdopen(fd, mode);
+    if(!retval)
+        close(fd);
+
+    return retval;
+}
+
+SHIM_EXPORT FILE *fopen64(const char *path, const char *mode)
+{
+    return fopen(path, mode);
+}
+
+SHIM_EXPORT int stat(const char *path, struct stat *buf)
+{
+    return shim_stat(AT_FDCWD, path, buf, 0);
+}
+
+SHIM_EXPORT int stat64(const char *path, struct stat64 *buf)
+{
+    return shim_stat(AT_FDCWD, path, (struct stat *)buf, 0);
+}
+
+SHIM_EXPORT int lstat(const char *path, struct stat *buf)
+{
+    return shim_stat(AT_FDCWD, path, buf, AT_SYMLINK_NOFOLLOW);
+}
+
+SHIM_EXPORT int lstat64(const char *path, struct stat64 *buf)
+{
+    return shim_stat(AT_FDCWD, path, (struct stat *)buf, AT_SYMLINK_NOFOLLOW);
+}
+
+SHIM_EXPORT int fstatat(int dirfd, const char *path, struct stat *buf,
+                        int flags)
+{
+    return shim_stat(dirfd, path, buf, flags);
+}
+
+SHIM_EXPORT int fstatat64(int dirfd, const char *path, struct stat64 *buf,
+                          int flags)
+{
+    return shim_stat(dirfd, path, (struct stat *)buf, flags);
+}
+
+SHIM_EXPORT int access(const char *path, int mode)
+{
+    return shim_access(AT_FDCWD, path, mode, 0);
+}
+
+SHIM_EXPORT int faccessat(int dirfd, const char *path, int mode, int flags)
+{
+    return shim_access(dirfd, path, mode, flags);
+}
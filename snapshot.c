@@ -0,0 +1,299 @@
+/**
+ * snapshot.c - Saved sandbox index.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/* Number of bits a digest maps to, as in bloom.c. */
+#define SNAPSHOT_PROBES 4
+
+/**
+ * slot_index - get the preferred slot for a digest
+ * @capacity: number of slots
+ * @digest:   the path digest
+ */
+static unsigned long slot_index(uint64_t capacity, const unsigned char *digest)
+{
+    unsigned long h;
+    memcpy(&h, digest, sizeof(h)); /* the digest is already well mixed */
+    return h & (capacity - 1);
+}
+
+/**
+ * bloom_bit - get the nth bit of the Bloom filter for a digest
+ * @bloom_bytes: size of the filter
+ * @digest:      the digest
+ * @n:           which probe
+ */
+static unsigned long bloom_bit(uint64_t bloom_bytes,
+                               const unsigned char *digest,
+                               int n)
+{
+    uint32_t h;
+    memcpy(&h, digest + 4*n, sizeof(h));
+    return h & (8*bloom_bytes - 1);
+}
+
+/**
+ * write_snapshot - save what a journal adds up to as a snapshot
+ * @SANDBOX_DIR: the sandbox directory
+ * @r:           the journal, replayed
+ *
+ * The new snapshot is written next to the old one and renamed over it, so
+ * a process that has the old one mapped in isn't disturbed.  The magic goes
+ * in last, once the rest is on disk, so a crash can't leave a file that
+ * looks whole but isn't.
+ *
+ * Returns 0 on success, -1 otherwise.
+ */
+int write_snapshot(char *SANDBOX_DIR, journal_replay *r)
+{
+    uint64_t capacity = 16;
+    while(capacity < 2 * (uint64_t)r->count)
+        capacity *= 2;
+
+    uint64_t bloom_bytes = 8;
+    while(8*bloom_bytes < SNAPSHOT_BLOOM_BITS * (uint64_t)r->count)
+        bloom_bytes *= 2;
+
+    /* offset 0 is kept for empty slots */
+    uint64_t strings_size = 1;
+    int i;
+    for(i = 0; i < r->count; i++)
+        strings_size += r->entries[i]->path_len + 1;
+
+    size_t size = sizeof(snapshot_header) + capacity * sizeof(snapshot_slot) +
+                  bloom_bytes + strings_size;
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%ssnapshot", SANDBOX_DIR);
+    snprintf(tmp, sizeof(tmp), "%ssnapshot.new", SANDBOX_DIR);
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || ftruncate(fd, size) != 0) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", tmp);
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    char *map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "fssb: error: cannot map %s\n", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    /* the file starts out zeroed, which is what empty slots look like */
+    snapshot_header *header = (snapshot_header *)map;
+    snapshot_slot *slots = (snapshot_slot *)(map + sizeof(snapshot_header));
+    unsigned char *bloom = (unsigned char *)(slots + capacity);
+    char *strings = (char *)bloom + bloom_bytes;
+
+    uint64_t used = 1;
+    for(i = 0; i < r->count; i++) {
+        journal_entry *e = r->entries[i];
+
+        unsigned long k = slot_index(capacity, e->digest);
+        while(slots[k].path)
+            k = (k + 1) & (capacity - 1);
+
+        memcpy(slots[k].digest, e->digest, DIGEST_LEN);
+        slots[k].suffix = e->suffix;
+        slots[k].path = used;
+
+        memcpy(strings + used, e->path, e->path_len + 1);
+        used += e->path_len + 1;
+
+        int n;
+        for(n = 0; n < SNAPSHOT_PROBES; n++) {
+            unsigned long bit = bloom_bit(bloom_bytes, e->digest, n);
+            bloom[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+
+    header->hash_algo = r->hash_algo;
+    header->count = r->count;
+    header->capacity = capacity;
+    header->bloom_bytes = bloom_bytes;
+    header->strings_size = strings_size;
+    header->journal_size = r->size;
+
+    int synced = msync(map, size, MS_SYNC) == 0;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    munmap(map, size);
+
+    if(!synced || fsync(fd) != 0) {
+        fprintf(stderr, "fssb: error: cannot write %s\n", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if(rename(tmp, path) != 0) {
+        fprintf(stderr, "fssb: error: cannot create %s\n", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * open_snapshot - map a sandbox's snapshot in
+ * @SANDBOX_DIR: the sandbox directory
+ *
+ * This is the whole of loading it: lookups go straight to the mapping, and
+ * only the pages they touch are ever read.
+ *
+ * Returns a (snapshot *) pointer, or NULL if there's no usable snapshot.
+ */
+snapshot *open_snapshot(char *SANDBOX_DIR)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%ssnapshot", SANDBOX_DIR);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if(fd < 0 || fstat(fd, &sb) != 0 ||
+       (size_t)sb.st_size < sizeof(snapshot_header)) {
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    char *map = (char *)mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    snapshot_header *header = (snapshot_header *)map;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+       sizeof(snapshot_header) + header->capacity * sizeof(snapshot_slot) +
+       header->bloom_bytes + header->strings_size != (uint64_t)sb.st_size) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+
+    snapshot *s = (snapshot *)malloc(sizeof(snapshot));
+    s->header = header;
+    s->size = sb.st_size;
+    s->slots = (snapshot_slot *)(map + sizeof(snapshot_header));
+    s->bloom = (unsigned char *)(s->slots + header->capacity);
+    s->strings = (char *)s->bloom + header->bloom_bytes;
+    s->taken = (unsigned char *)calloc(header->capacity, 1);
+    s->SANDBOX_DIR = strdup(SANDBOX_DIR);
+
+    return s;
+}
+
+/**
+ * close_snapshot - unmap a snapshot
+ * @s: the snapshot
+ */
+void close_snapshot(snapshot *s)
+{
+    munmap(s->header, s->size);
+    free(s->taken);
+    free(s->SANDBOX_DIR);
+    free(s);
+}
+
+/**
+ * snapshot_maybe - check the Bloom filter for a digest
+ * @s:      the snapshot
+ * @digest: the path digest
+ *
+ * Returns 0 if the snapshot definitely doesn't have the path, 1 if it might.
+ */
+int snapshot_maybe(snapshot *s, const unsigned char *digest)
+{
+    int n;
+    for(n = 0; n < SNAPSHOT_PROBES; n++) {
+        unsigned long bit = bloom_bit(s->header->bloom_bytes, digest, n);
+        if(!(s->bloom[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * snapshot_find - look a path up in a snapshot
+ * @s:         the snapshot
+ * @file_path: the path
+ * @digest:    its digest
+ *
+ * Slots the proxyfile_list has taken over don't count.
+ *
+ * Returns the slot, or -1 if there's none for the path.
+ */
+long snapshot_find(snapshot *s,
+                   const char *file_path,
+                   const unsigned char *digest)
+{
+    if(!snapshot_maybe(s, digest))
+        return -1;
+
+    uint64_t capacity = s->header->capacity;
+    unsigned long k = slot_index(capacity, digest);
+    while(s->slots[k].path) {
+        snapshot_slot *slot = &s->slots[k];
+        if(!s->taken[k] && memcmp(slot->digest, digest, DIGEST_LEN) == 0 &&
+           strcmp(s->strings + slot->path, file_path) == 0)
+            return k;
+        k = (k + 1) & (capacity - 1);
+    }
+
+    return -1;
+}
+
+/**
+ * snapshot_suffix_taken - check if a proxy file name is in use by a snapshot
+ * @s:      the snapshot
+ * @digest: the path digest
+ * @suffix: the collision suffix
+ */
+int snapshot_suffix_taken(snapshot *s,
+                          const unsigned char *digest,
+                          int suffix)
+{
+    uint64_t capacity = s->header->capacity;
+    unsigned long k = slot_index(capacity, digest);
+    while(s->slots[k].path) {
+        snapshot_slot *slot = &s->slots[k];
+        if(!s->taken[k] && memcmp(slot->digest, digest, DIGEST_LEN) == 0 &&
+           slot->suffix == (uint32_t)suffix)
+            return 1;
+        k = (k + 1) & (capacity - 1);
+    }
+
+    return 0;
+}
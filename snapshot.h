@@ -0,0 +1,98 @@
+/**
+ * snapshot.h - Saved sandbox index.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "hash.h"
+#include "journal.h"
+
+#define SNAPSHOT_MAGIC "FSSBSNP1"
+
+/* Bits of Bloom filter per entry; with 4 probes, that's about one false
+   positive in four hundred. */
+#define SNAPSHOT_BLOOM_BITS 16
+
+/**
+ * snapshot_header - the start of the snapshot file
+ *
+ * The slots, the Bloom filter and the strings follow, in that order.
+ * @journal_size is how much of the journal the snapshot takes in; if the
+ * journal's grown since, fssb didn't get to save it at the end.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t hash_algo;
+    uint32_t unused;
+    uint64_t count;
+    uint64_t capacity;     /* slots, a power of two */
+    uint64_t bloom_bytes;  /* a power of two */
+    uint64_t strings_size;
+    uint64_t journal_size;
+    char pad[8];
+} snapshot_header;
+
+/**
+ * snapshot_slot - an open addressing slot keyed by the path digest
+ */
+typedef struct {
+    unsigned char digest[DIGEST_LEN];
+    uint32_t suffix;
+    uint32_t unused;
+    uint64_t path; /* offset into the strings; 0 for an empty slot */
+} snapshot_slot;
+
+/**
+ * snapshot - a snapshot mapped in
+ *
+ * The file is never written once it's made; the next one is written
+ * alongside and renamed over it, so this mapping stays as it was.  What's
+ * changed since goes in the proxyfile_list, and @taken marks the slots it
+ * has taken over.
+ */
+typedef struct {
+    snapshot_header *header;
+    size_t size;
+    snapshot_slot *slots;
+    unsigned char *bloom;
+    char *strings;
+    unsigned char *taken;
+    char *SANDBOX_DIR; /* where its proxy files are */
+} snapshot;
+
+extern int write_snapshot(char *SANDBOX_DIR, journal_replay *r);
+
+extern snapshot *open_snapshot(char *SANDBOX_DIR);
+
+extern void close_snapshot(snapshot *s);
+
+extern int snapshot_maybe(snapshot *s, const unsigned char *digest);
+
+extern long snapshot_find(snapshot *s,
+                          const char *file_path,
+                          const unsigned char *digest);
+
+extern int snapshot_suffix_taken(snapshot *s,
+                                 const unsigned char *digest,
+                                 int suffix);
+
+#endif /* _SNAPSHOT_H */
@@ -0,0 +1,268 @@
+/**
+ * stats.c - Tracer statistics.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "stats.h"
+
+/* set by --stats and --stats-json */
+int stats_enabled;
+
+static __thread stats_block *mine;
+
+/* every thread's block, for write_stats to add up */
+static stats_block *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *timer_names[TIMER_COUNT] = {
+    "handle", "get_string", "write_string", "index",
+};
+
+/* Names of the syscalls we're likely to see; the rest go by number. */
+static const struct {
+    int nr;
+    const char *name;
+} syscall_names[] = {
+    { SYS_open, "open" }, { SYS_openat, "openat" },
+    { SYS_openat2, "openat2" }, { SYS_creat, "creat" },
+    { SYS_unlink, "unlink" }, { SYS_unlinkat, "unlinkat" },
+    { SYS_rename, "rename" }, { SYS_renameat, "renameat" },
+    { SYS_renameat2, "renameat2" },
+    { SYS_stat, "stat" }, { SYS_lstat, "lstat" },
+    { SYS_newfstatat, "newfstatat" }, { SYS_statx, "statx" },
+    { SYS_access, "access" }, { SYS_faccessat, "faccessat" },
+    { SYS_faccessat2, "faccessat2" },
+    { SYS_close, "close" }, { SYS_close_range, "close_range" },
+    { SYS_dup2, "dup2" }, { SYS_dup3, "dup3" },
+    { SYS_chdir, "chdir" }, { SYS_fchdir, "fchdir" },
+    { SYS_execve, "execve" }, { SYS_execveat, "execveat" },
+};
+
+/**
+ * get_block - get this thread's stats_block, making it if need be
+ */
+static stats_block *get_block()
+{
+    if(mine)
+        return mine;
+
+    mine = (stats_block *)calloc(1, sizeof(stats_block));
+    mine->syscall = STATS_MAX_SYSCALL;
+
+    pthread_mutex_lock(&blocks_lock);
+    mine->next = blocks;
+    blocks = mine;
+    pthread_mutex_unlock(&blocks_lock);
+
+    return mine;
+}
+
+/**
+ * stats_syscall - say which syscall the thread is handling now
+ * @nr: the syscall number
+ */
+void stats_syscall(long nr)
+{
+    get_block()->syscall = nr >= 0 && nr < STATS_MAX_SYSCALL ? nr
+                                                             : STATS_MAX_SYSCALL;
+}
+
+/**
+ * stats_count - count one of something for the syscall being handled
+ * @counter: STAT_STOPS, STAT_REWRITES or STAT_LOOKUPS
+ */
+void stats_count(int counter)
+{
+    stats_block *b = get_block();
+    b->counters[b->syscall][counter]++;
+}
+
+/**
+ * stats_now - get the time to measure from
+ *
+ * Returns nanoseconds on the monotonic clock.
+ */
+long stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * stats_time - put a time down in a histogram
+ * @timer: which histogram
+ * @start: what stats_now said when it started
+ */
+void stats_time(int timer, long start)
+{
+    long ns = stats_now() - start;
+
+    int bucket = 0;
+    while(bucket < STATS_BUCKETS - 1 && ns >> (bucket + 1))
+        bucket++;
+
+    histogram *h = &get_block()->timers[timer];
+    h->count++;
+    h->total_ns += ns;
+    h->buckets[bucket]++;
+}
+
+/**
+ * syscall_name - get the name of a syscall, if we know it
+ * @nr: the syscall number
+ *
+ * Returns a (const char *) pointer, or NULL.
+ */
+static const char *syscall_name(int nr)
+{
+    int i, count = sizeof(syscall_names) / sizeof(syscall_names[0]);
+    for(i = 0; i < count; i++)
+        if(syscall_names[i].nr == nr)
+            return syscall_names[i].name;
+
+    return NULL;
+}
+
+/**
+ * cpu_seconds - add up user and system time
+ * @ru: the usage
+ */
+static double cpu_seconds(struct rusage *ru)
+{
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+           ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * write_stats - write out what's been recorded
+ * @out:  where to
+ * @json: 1 for JSON, 0 for lines for people
+ *
+ * Call this once the child has been reaped, so its CPU time is in, and all
+ * the other threads are done.
+ */
+void write_stats(FILE *out, int json)
+{
+    /* add up every thread's */
+    stats_block *total = (stats_block *)calloc(1, sizeof(stats_block));
+    stats_block *b;
+    int nr, i, k;
+    for(b = blocks; b != NULL; b = b->next) {
+        for(nr = 0; nr <= STATS_MAX_SYSCALL; nr++)
+            for(i = 0; i < STAT_COUNTER_COUNT; i++)
+                total->counters[nr][i] += b->counters[nr][i];
+
+        for(i = 0; i < TIMER_COUNT; i++) {
+            total->timers[i].count += b->timers[i].count;
+            total->timers[i].total_ns += b->timers[i].total_ns;
+            for(k = 0; k < STATS_BUCKETS; k++)
+                total->timers[i].buckets[k] += b->timers[i].buckets[k];
+        }
+    }
+
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    double tracer_cpu = cpu_seconds(&self),
+           child_cpu = cpu_seconds(&children),
+           ratio = child_cpu > 0 ? tracer_cpu / child_cpu : 0;
+
+    if(json) {
+        fprintf(out, "{\n  \"tracer_cpu_s\": %.6f,\n  \"child_cpu_s\": %.6f,\n"
+                     "  \"cpu_ratio\": %.6f,\n  \"syscalls\": [",
+                tracer_cpu, child_cpu, ratio);
+    }
+    else {
+        fprintf(out, "fssb: stats: tracer cpu %.3f s, child cpu %.3f s, "
+                     "ratio %.3f\n", tracer_cpu, child_cpu, ratio);
+        fprintf(out, "fssb: stats: %-16s %10s %10s %10s\n",
+                "syscall", "stops", "rewrites", "lookups");
+    }
+
+    int first = 1;
+    for(nr = 0; nr <= STATS_MAX_SYSCALL; nr++) {
+        long *c = total->counters[nr];
+        if(!c[STAT_STOPS] && !c[STAT_REWRITES] && !c[STAT_LOOKUPS])
+            continue;
+
+        char name[32];
+        if(nr == STATS_MAX_SYSCALL)
+            strcpy(name, "other");
+        else if(syscall_name(nr))
+            strcpy(name, syscall_name(nr));
+        else
+            sprintf(name, "#%d", nr);
+
+        if(json)
+            fprintf(out, "%s\n    {\"nr\": %d, \"name\": \"%s\", "
+                         "\"stops\": %ld, \"rewrites\": %ld, "
+                         "\"lookups\": %ld}",
+                    first ? "" : ",", nr, name,
+                    c[STAT_STOPS], c[STAT_REWRITES], c[STAT_LOOKUPS]);
+        else
+            fprintf(out, "fssb: stats: %-16s %10ld %10ld %10ld\n", name,
+                    c[STAT_STOPS], c[STAT_REWRITES], c[STAT_LOOKUPS]);
+        first = 0;
+    }
+
+    if(json)
+        fprintf(out, "\n  ],\n  \"timers\": {");
+
+    for(i = 0; i < TIMER_COUNT; i++) {
+        histogram *h = &total->timers[i];
+
+        if(json)
+            fprintf(out, "%s\n    \"%s\": {\"count\": %ld, \"total_ns\": %ld, "
+                         "\"buckets\": [",
+                    i ? "," : "", timer_names[i], h->count, h->total_ns);
+        else
+            fprintf(out, "fssb: stats: %s: %ld calls, %ld ns mean\n",
+                    timer_names[i], h->count,
+                    h->count ? h->total_ns / h->count : 0);
+
+        /* only the buckets anything fell in */
+        first = 1;
+        for(k = 0; k < STATS_BUCKETS; k++) {
+            if(!h->buckets[k])
+                continue;
+
+            if(json)
+                fprintf(out, "%s{\"min_ns\": %ld, \"count\": %ld}",
+                        first ? "" : ", ", 1L << k, h->buckets[k]);
+            else
+                fprintf(out, "fssb: stats:   >= %10ld ns: %ld\n",
+                        1L << k, h->buckets[k]);
+            first = 0;
+        }
+
+        if(json)
+            fprintf(out, "]}");
+    }
+
+    if(json)
+        fprintf(out, "\n  }\n}\n");
+
+    free(total);
+}
@@ -0,0 +1,89 @@
+/**
+ * stats.h - Tracer statistics.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdio.h>
+
+/* Syscall numbers counted one by one; anything above goes together. */
+#define STATS_MAX_SYSCALL 512
+
+/* Bucket k of a histogram counts times from 2^k to 2^(k+1) - 1 ns. */
+#define STATS_BUCKETS 40
+
+/* what's counted per syscall */
+enum {
+    STAT_STOPS,    /* times the tracer was stopped for it */
+    STAT_REWRITES, /* arguments sent to the sandbox instead */
+    STAT_LOOKUPS,  /* lookups in the proxyfile index */
+    STAT_COUNTER_COUNT,
+};
+
+/* what's timed */
+enum {
+    TIMER_HANDLE,       /* handling a syscall stop or notification */
+    TIMER_GET_STRING,
+    TIMER_WRITE_STRING,
+    TIMER_INDEX,        /* proxyfile index operations */
+    TIMER_COUNT,
+};
+
+typedef struct {
+    long count, total_ns;
+    long buckets[STATS_BUCKETS];
+} histogram;
+
+/**
+ * stats_block - one thread's statistics
+ *
+ * Every thread that records anything gets its own, so there's nothing to
+ * share until they're added up at the end.
+ */
+typedef struct stats_block {
+    long counters[STATS_MAX_SYSCALL + 1][STAT_COUNTER_COUNT];
+    histogram timers[TIMER_COUNT];
+
+    int syscall; /* the one lookups are put down to */
+
+    struct stats_block *next;
+} stats_block;
+
+extern int stats_enabled;
+
+/* With stats off, all this costs is a test of stats_enabled. */
+#define STATS_SYSCALL(nr) \
+    do { if(stats_enabled) stats_syscall(nr); } while(0)
+#define STATS_COUNT(counter) \
+    do { if(stats_enabled) stats_count(counter); } while(0)
+#define STATS_START() (stats_enabled ? stats_now() : 0)
+#define STATS_STOP(timer, start) \
+    do { if(stats_enabled) stats_time(timer, start); } while(0)
+
+extern void stats_syscall(long nr);
+
+extern void stats_count(int counter);
+
+extern long stats_now();
+
+extern void stats_time(int timer, long start);
+
+extern void write_stats(FILE *out, int json);
+
+#endif /* _STATS_H */
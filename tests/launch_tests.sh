@@ -1,11 +1,39 @@
 #!/bin/bash
 
-SANDBOX="../fssb -- "
+# the checks compute proxy file names with MD5
+SANDBOX="../fssb -a md5 -- "
 RUNNER="python ./tests.py"
 
 testcases=(
 	'test_no_syscalls'
 	'test_save_empty_file'
+	'test_copy_up_on_append'
+	'test_at_syscalls'
+	'test_stat'
+	'test_umask'
+	'test_canonical_paths'
+	'test_symlink_dotdot'
+	'test_map_from_journal'
+	'test_resume'
+	'test_lower_layers'
+	'test_preload'
+	'test_commit'
+	'test_commit_conflict'
+	'test_commit_overlay'
+	'test_commit_symlink'
+	'test_daemon'
+)
+
+# the ones the seccomp backend handles differently, run with it as well
+SECCOMP_SANDBOX="../fssb -a md5 -b seccomp -- "
+seccomp_testcases=(
+	'test_copy_up_on_append'
+	'test_at_syscalls'
+	'test_symlink_dotdot'
+	'test_stat'
+	'test_umask'
+	'test_map_from_journal'
+	'test_commit'
 )
 
 echo "Removing all /tmp/fssb-*"
@@ -15,7 +43,16 @@ echo "Launching tests"
 
 for testcase in ${testcases[@]}
 do
+	$RUNNER setup $testcase
 	$SANDBOX $RUNNER test $testcase
 	$RUNNER check $testcase
 done
 
+echo "Launching tests with -b seccomp"
+
+for testcase in ${seccomp_testcases[@]}
+do
+	$RUNNER setup $testcase
+	$SECCOMP_SANDBOX $RUNNER test $testcase
+	$RUNNER check $testcase
+done
@@ -12,6 +12,10 @@ Only the 1st phase is run under the sandbox.
 To implement a test, simply write a test function that will return
 a tuple of two functions corresponding to the phases.
 
+A test that needs real files in place before the sandbox starts can
+return a setup function first, making it a tuple of three; the setup
+phase is run outside the sandbox, before the test phase.
+
 If a phase is not required, simply make it to just pass, e.g.:
     def check_save_empty_file():
         pass
@@ -27,6 +31,10 @@ import glob
 import inspect
 import hashlib
 import operator
+import platform
+import shutil
+import subprocess
+import time
 
 
 # via http://stackoverflow.com/questions/287871/print-in-terminal-with-colors-using-python
@@ -56,6 +64,31 @@ def sandbox_paths():
     return sandbox_dir, filemap_path
 
 
+FSSB = os.path.abspath(os.path.join(os.path.dirname(__file__), '..', 'fssb'))
+
+
+def proxy_path(sandbox_dir, file_name):
+    # the sandbox keys files by their absolute path
+    hashed_name = hashlib.md5(os.path.abspath(file_name).encode()).hexdigest()
+    return os.path.join(sandbox_dir, hashed_name)
+
+
+def read_file(path):
+    with open(path) as f:
+        return f.read()
+
+
+def write_file(path, content):
+    with open(path, 'w') as f:
+        f.write(content)
+
+
+def run_fssb(*args):
+    with open(os.devnull, 'w') as devnull:
+        return subprocess.call([FSSB] + list(args),
+                               stdout=devnull, stderr=devnull)
+
+
 def _assert(fnc, *args, **kwargs):
     curr_frame = inspect.currentframe()
     upper_fn_frame = inspect.getouterframes(curr_frame)[1]
@@ -88,7 +121,9 @@ def test_no_syscalls():
 
 def test_save_empty_file():
     empty_file_name = 'save_empty_file'
-    hashed_name = hashlib.md5(empty_file_name).hexdigest()
+    # the sandbox keys files by their absolute path
+    empty_file_path = os.path.abspath(empty_file_name)
+    hashed_name = hashlib.md5(empty_file_path.encode()).hexdigest()
 
     def test():
         with open(empty_file_name, 'wb'):
@@ -97,7 +132,7 @@ def test_save_empty_file():
     def check_save_empty_file():
         sandbox_dir, filemap_path = sandbox_paths()
 
-        empty_file_path = os.path.join(sandbox_dir, hashed_name)
+        proxy_file_path = os.path.join(sandbox_dir, hashed_name)
 
         # lets assume we made a bad testcase (or we've changed the fssb
         # to skip newline at the end of file-map file)
@@ -105,18 +140,505 @@ def test_save_empty_file():
         _assert(
             operator.eq,
             open(filemap_path).read(),
-            '{} = {}\n'.format(empty_file_path, empty_file_name)
+            '{} = {}\n'.format(proxy_file_path, empty_file_path)
         )
-        _assert(operator.eq, open(empty_file_path).read(), '')
+        _assert(operator.eq, open(proxy_file_path).read(), '')
 
     return test, check_save_empty_file
 
 
+def test_copy_up_on_append():
+    file_name = 'copy_up_on_append'
+
+    def setup():
+        write_file(file_name, 'old\n')
+
+    def test():
+        with open(file_name, 'a') as f:
+            f.write('new\n')
+
+        # an in-place edit of what's now in the sandbox
+        with open(file_name, 'r+') as f:
+            f.write('OLD')
+
+    def check_copy_up_keeps_content():
+        sandbox_dir, _filemap_path = sandbox_paths()
+
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, file_name)),
+                'OLD\nnew\n')
+        _assert(operator.eq, read_file(file_name), 'old\n')
+
+        os.remove(file_name)
+
+    return setup, test, check_copy_up_keeps_content
+
+
+def test_at_syscalls():
+    file_name = 'at_syscalls'
+    moved_name = 'at_syscalls_moved'
+
+    def test():
+        # relative to the parent, so the dirfd has to be looked at
+        parent = os.open('..', os.O_RDONLY)
+        here = os.path.basename(os.getcwd())
+
+        fd = os.open(os.path.join(here, file_name),
+                     os.O_WRONLY | os.O_CREAT, 0o644, dir_fd=parent)
+        os.write(fd, b'at\n')
+        os.close(fd)
+
+        os.rename(os.path.join(here, file_name),
+                  os.path.join(here, moved_name),
+                  src_dir_fd=parent, dst_dir_fd=parent)
+        os.close(parent)
+
+    def check_at_syscalls_resolve_dirfds():
+        sandbox_dir, filemap_path = sandbox_paths()
+
+        _assert(operator.eq,
+                read_file(filemap_path),
+                '{} = {}\n'.format(proxy_path(sandbox_dir, moved_name),
+                                   os.path.abspath(moved_name)))
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, moved_name)),
+                'at\n')
+        _assert(operator.not_, os.path.exists(file_name))
+        _assert(operator.not_, os.path.exists(moved_name))
+
+    return test, check_at_syscalls_resolve_dirfds
+
+
+def test_canonical_paths():
+    file_name = 'canonical_paths'
+
+    def test():
+        here = os.path.basename(os.getcwd())
+
+        # the same file by a roundabout way
+        with open(os.path.join('.', '..', here, '.', file_name), 'w') as f:
+            f.write('one\n')
+
+        # and from somewhere else, which the sandbox has to follow
+        os.chdir('..')
+        with open(os.path.join(here, file_name), 'a') as f:
+            f.write('two\n')
+        os.chdir(here)
+
+    def check_canonical_paths_share_a_proxy():
+        sandbox_dir, filemap_path = sandbox_paths()
+
+        _assert(operator.eq,
+                read_file(filemap_path),
+                '{} = {}\n'.format(proxy_path(sandbox_dir, file_name),
+                                   os.path.abspath(file_name)))
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, file_name)),
+                'one\ntwo\n')
+
+    return test, check_canonical_paths_share_a_proxy
+
+
+def test_symlink_dotdot():
+    link, sub = 'dotdot_link', os.path.join('dotdot_dir', 'sub')
+    file_name = 'dotdot'
+
+    def setup():
+        os.makedirs(sub)
+        os.symlink(sub, link)
+
+    def test():
+        # ".." after a symlink goes up from where it points
+        write_file(os.path.join(link, '..', file_name), 'up\n')
+
+    def check_dotdot_follows_symlinks():
+        sandbox_dir, filemap_path = sandbox_paths()
+        real_name = os.path.join('dotdot_dir', file_name)
+
+        _assert(operator.eq,
+                read_file(filemap_path),
+                '{} = {}\n'.format(proxy_path(sandbox_dir, real_name),
+                                   os.path.abspath(real_name)))
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, real_name)),
+                'up\n')
+
+        os.remove(link)
+        shutil.rmtree('dotdot_dir')
+
+    return setup, test, check_dotdot_follows_symlinks
+
+
+def test_stat():
+    grown, deleted = 'stat_grown', 'stat_deleted'
+    made, moved = 'stat_made', 'stat_moved'
+
+    def setup():
+        write_file(grown, 'old\n')
+        write_file(deleted, 'deleted\n')
+
+    def test():
+        with open(grown, 'a') as f:
+            f.write('new\n')
+        write_file(made, 'made\n')
+        os.rename(made, moved)
+        os.remove(deleted)
+
+        # inside, stat sees the sandbox's files...
+        _assert(operator.eq, os.stat(grown).st_size, len('old\nnew\n'))
+        _assert(operator.eq, os.stat(moved).st_size, len('made\n'))
+        _assert(operator.not_, os.path.exists(made))
+
+    def check_stat_sees_the_sandbox():
+        # ...and outside, the real ones, which it left alone
+        _assert(operator.eq, os.stat(grown).st_size, len('old\n'))
+        _assert(operator.truth, os.path.exists(deleted))
+        _assert(operator.not_, os.path.exists(moved))
+
+        for name in (grown, deleted):
+            os.remove(name)
+
+    return setup, test, check_stat_sees_the_sandbox
+
+
+def test_umask():
+    file_name = 'umask'
+
+    def test():
+        old = os.umask(0o077)
+        write_file(file_name, 'private\n')
+        os.umask(old)
+
+    def check_umask_is_the_childs():
+        sandbox_dir, _filemap_path = sandbox_paths()
+
+        _assert(operator.eq,
+                os.stat(proxy_path(sandbox_dir, file_name)).st_mode & 0o777,
+                0o600)
+
+    return test, check_umask_is_the_childs
+
+
+def test_map_from_journal():
+    names = ['journal_kept', 'journal_renamed', 'journal_deleted']
+    moved_name = 'journal_moved'
+
+    def test():
+        for name in names:
+            write_file(name, name + '\n')
+        os.rename('journal_renamed', moved_name)
+        os.remove('journal_deleted')
+
+    def check_map_from_journal():
+        sandbox_dir, filemap_path = sandbox_paths()
+
+        # as write_map had it: what's left, in the order it was made
+        expected = ''.join('{} = {}\n'.format(proxy_path(sandbox_dir, name),
+                                              os.path.abspath(name))
+                           for name in ('journal_kept', moved_name))
+        _assert(operator.eq, read_file(filemap_path), expected)
+
+        # compacted down to a header and an add for each of them, each of
+        # 64 byte records, with 16 bytes of the path in the first
+        def records(name):
+            size = len(os.path.abspath(name)) + 1
+            return 1 + max(0, (size - 16 + 63) // 64)
+        _assert(operator.eq,
+                os.path.getsize(os.path.join(sandbox_dir, 'journal')),
+                64 * (1 + records('journal_kept') + records(moved_name)))
+
+        os.remove(filemap_path)
+        _assert(operator.eq, run_fssb('--map', sandbox_dir), 0)
+        _assert(operator.eq, read_file(filemap_path), expected)
+
+    return test, check_map_from_journal
+
+
+def test_resume():
+    file_name = 'resume'
+
+    def test():
+        write_file(file_name, 'one\n')
+
+    def check_resume_carries_on():
+        sandbox_dir, filemap_path = sandbox_paths()
+
+        # a second run in the same sandbox sees what the first one wrote
+        _assert(operator.eq,
+                run_fssb('-u', sandbox_dir, '--',
+                         'sh', '-c', 'echo two >> ' + file_name),
+                0)
+
+        _assert(operator.eq, sandbox_paths()[0], sandbox_dir)
+        _assert(operator.eq,
+                read_file(filemap_path),
+                '{} = {}\n'.format(proxy_path(sandbox_dir, file_name),
+                                   os.path.abspath(file_name)))
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, file_name)),
+                'one\ntwo\n')
+        _assert(operator.not_, os.path.exists(file_name))
+
+    return test, check_resume_carries_on
+
+
+def test_lower_layers():
+    file_name = 'lower_layers'
+    copy_name = 'lower_layers_copy'
+
+    def test():
+        write_file(file_name, 'lower\n')
+
+    def check_lower_layers_read_and_copy_up():
+        lower_dir, _filemap_path = sandbox_paths()
+
+        _assert(operator.eq,
+                run_fssb('-l', lower_dir, '--', 'sh', '-c',
+                         'cat {0} > {1}; echo upper >> {0}'.format(file_name,
+                                                                   copy_name)),
+                0)
+
+        upper_dir, _filemap_path = sandbox_paths()
+        _assert(operator.ne, upper_dir, lower_dir)
+
+        # read through from below, then copied up to be written
+        _assert(operator.eq,
+                read_file(proxy_path(upper_dir, copy_name)),
+                'lower\n')
+        _assert(operator.eq,
+                read_file(proxy_path(upper_dir, file_name)),
+                'lower\nupper\n')
+
+        # and the layer underneath is as it was
+        _assert(operator.eq,
+                read_file(proxy_path(lower_dir, file_name)),
+                'lower\n')
+        _assert(operator.not_,
+                os.path.exists(proxy_path(lower_dir, copy_name)))
+
+    return test, check_lower_layers_read_and_copy_up
+
+
+def test_preload():
+    names = ['preload_one', 'preload_two', 'preload_both']
+    program = ('echo one > {0}; cat {0} > {1}; echo two >> {0}; '
+               'cat {0} {1} > {2}; rm {1}; test -s {0}'.format(*names))
+
+    def test():
+        pass
+
+    def check_preload_matches_ptrace():
+        # the shim is x86_64 only
+        if platform.machine() != 'x86_64':
+            return
+
+        # and it really is in there with -p
+        _assert(operator.eq,
+                run_fssb('-p', '--', 'sh', '-c',
+                         'case "$LD_PRELOAD" in *libfssb.so*) exit 0;; '
+                         'esac; exit 1'),
+                0)
+
+        results = []
+        for args in ((), ('-p',)):
+            _assert(operator.eq,
+                    run_fssb('-a', 'md5', *(args + ('--', 'sh', '-c',
+                                                    program))),
+                    0)
+
+            sandbox_dir, filemap_path = sandbox_paths()
+            results.append((read_file(filemap_path).replace(sandbox_dir, ''),
+                            [read_file(proxy_path(sandbox_dir, name))
+                             for name in (names[0], names[2])]))
+
+        _assert(operator.eq, results[1], results[0])
+        _assert(operator.eq,
+                results[0][1], ['one\ntwo\n', 'one\ntwo\none\n'])
+        for name in names:
+            _assert(operator.not_, os.path.exists(name))
+
+    return test, check_preload_matches_ptrace
+
+
+def test_commit():
+    changed, deleted = 'commit_changed', 'commit_deleted'
+    renamed, moved = 'commit_renamed', 'commit_moved'
+    made = 'commit_made'
+
+    def setup():
+        for name in (changed, deleted, renamed):
+            write_file(name, name + '\n')
+
+    def test():
+        with open(changed, 'a') as f:
+            f.write('more\n')
+        os.remove(deleted)
+        write_file(made, 'made\n')
+        os.rename(renamed, moved)
+
+    def check_commit_applies_changes():
+        sandbox_dir, _filemap_path = sandbox_paths()
+
+        _assert(operator.eq, run_fssb('--commit', sandbox_dir), 0)
+
+        _assert(operator.eq, read_file(changed), changed + '\nmore\n')
+        _assert(operator.not_, os.path.exists(deleted))
+        _assert(operator.eq, read_file(made), 'made\n')
+        _assert(operator.not_, os.path.exists(renamed))
+        _assert(operator.eq, read_file(moved), renamed + '\n')
+
+        for name in (changed, made, moved):
+            os.remove(name)
+
+    return setup, test, check_commit_applies_changes
+
+
+def test_commit_conflict():
+    changed, other = 'commit_conflict', 'commit_conflict_other'
+
+    def setup():
+        write_file(changed, 'old\n')
+        write_file(other, 'other\n')
+
+    def test():
+        for name in (changed, other):
+            with open(name, 'a') as f:
+                f.write('sandbox\n')
+
+    def check_commit_conflict_changes_nothing():
+        sandbox_dir, _filemap_path = sandbox_paths()
+
+        # changed behind the sandbox's back
+        write_file(changed, 'changed\n')
+
+        _assert(operator.ne, run_fssb('--commit', sandbox_dir), 0)
+
+        _assert(operator.eq, read_file(changed), 'changed\n')
+        _assert(operator.eq, read_file(other), 'other\n')
+
+        for name in (changed, other):
+            os.remove(name)
+
+    return setup, test, check_commit_conflict_changes_nothing
+
+
+def test_commit_overlay():
+    changed, deleted = 'commit_overlay', 'commit_overlay_deleted'
+    made = os.path.join('commit_overlay_dir', 'sub', 'made')
+
+    def setup():
+        write_file(changed, 'old\n')
+        write_file(deleted, 'deleted\n')
+
+    def test():
+        pass
+
+    def check_commit_overlay_applies_changes():
+        # exits 3 if fssb fell back to ptrace instead
+        _assert(operator.eq,
+                run_fssb('-b', 'overlay', '--', 'sh', '-c',
+                         'grep -q upperdir=/tmp/fssb- /proc/self/mountinfo || '
+                         'exit 3; '
+                         'echo more >> {}; rm {}; mkdir -p {}; '
+                         'chmod 700 {}; echo made > {}'.format(
+                             changed, deleted, os.path.dirname(made),
+                             os.path.dirname(made), made)),
+                0)
+
+        sandbox_dir, _filemap_path = sandbox_paths()
+        _assert(operator.eq, run_fssb('--commit', sandbox_dir), 0)
+
+        _assert(operator.eq, read_file(changed), 'old\nmore\n')
+        _assert(operator.not_, os.path.exists(deleted))
+        _assert(operator.eq, read_file(made), 'made\n')
+        _assert(operator.eq,
+                os.stat(os.path.dirname(made)).st_mode & 0o777, 0o700)
+
+        os.remove(changed)
+        shutil.rmtree('commit_overlay_dir')
+
+    return setup, test, check_commit_overlay_applies_changes
+
+
+def test_commit_symlink():
+    target, link = 'commit_symlink_target', 'commit_symlink'
+
+    def setup():
+        write_file(target, 'target\n')
+        os.symlink(target, link)
+
+    def test():
+        with open(link, 'a') as f:
+            f.write('more\n')
+
+    def check_commit_symlink_is_refused():
+        sandbox_dir, _filemap_path = sandbox_paths()
+
+        # the sandbox has the link's path, not its target's
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, link)),
+                'target\nmore\n')
+
+        _assert(operator.ne, run_fssb('--commit', sandbox_dir), 0)
+
+        _assert(os.path.islink, link)
+        _assert(operator.eq, read_file(target), 'target\n')
+
+        os.remove(link)
+        os.remove(target)
+
+    return setup, test, check_commit_symlink_is_refused
+
+
+def test_daemon():
+    socket_name = 'daemon_socket'
+    file_name = 'daemon'
+    program = 'echo hello; echo daemon > {}; exit 7'.format(file_name)
+
+    def test():
+        pass
+
+    def check_daemon_runs_sandboxes():
+        with open(os.devnull, 'w') as devnull:
+            daemon = subprocess.Popen([FSSB, '--daemon', socket_name],
+                                      stdout=devnull, stderr=devnull)
+
+            for _ in range(100):
+                if os.path.exists(socket_name):
+                    break
+                time.sleep(0.05)
+
+            client = subprocess.Popen([FSSB, '--connect', socket_name,
+                                       '-a', 'md5', '--', 'sh', '-c', program],
+                                      stdout=subprocess.PIPE, stderr=devnull)
+            output = client.communicate()[0].decode()
+
+        daemon.terminate()
+        daemon.wait()
+        os.remove(socket_name)
+
+        # the program's output and exit status come back to the client...
+        _assert(operator.contains, output, 'hello\n')
+        _assert(operator.eq, client.returncode, 7)
+
+        # ...its writes went in a sandbox as usual...
+        sandbox_dir, _filemap_path = sandbox_paths()
+        _assert(operator.eq,
+                read_file(proxy_path(sandbox_dir, file_name)),
+                'daemon\n')
+        _assert(operator.not_, os.path.exists(file_name))
+
+        # ...and fssb on its own exits just the same
+        _assert(operator.eq, run_fssb('--', 'sh', '-c', program), 7)
+
+    return test, check_daemon_runs_sandboxes
+
+
 def main():
     phase = sys.argv[1]
     test_name = sys.argv[2]
 
-    phases = ('test', 'check')
+    phases = ('setup', 'test', 'check')
 
     if phase not in phases:
         print('Wrong phase name. Valid phases: {}'.format(phases))
@@ -124,11 +646,21 @@ def main():
 
     test_function = globals()[test_name]
 
-    test_exec, test_check = test_function()
+    functions = test_function()
+    if len(functions) == 3:
+        test_setup, test_exec, test_check = functions
+    else:
+        test_exec, test_check = functions
+        test_setup = None
+
+    if phase == 'setup' and test_setup is None:
+        return
 
     print(colored(HEADER, 'Launching {} on {}'.format(phase, test_name)))
 
-    if phase == 'test':
+    if phase == 'setup':
+        test_setup()
+    elif phase == 'test':
         test_exec()
     else:
         test_check()
@@ -137,7 +669,8 @@ def main():
 
 if __name__ == '__main__':
     if len(sys.argv) < 3:
-        print('Usage: %s (test|check) <test_name>' % sys.argv[0])
+        print('Usage: %s (setup|test|check) <test_name>' % sys.argv[0])
+        print('    setup   - launches setup phase for given test, if it has one')
         print('    test    - launches test phase for given test')
         print('    check   - launches check&clean phase for given test')
         sys.exit(-1)
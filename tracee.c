@@ -0,0 +1,457 @@
+/**
+ * tracee.c - Per-process tracer state.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tracee.h"
+
+/* Marks a hash table slot whose tracee has gone away. */
+#define TOMBSTONE ((tracee *)-1)
+
+#define INIT_TABLE_CAPACITY 64
+
+/**
+ * new_tracee_table - creates a new, empty tracee table
+ *
+ * Returns a (tracee_table *) pointer.
+ */
+tracee_table *new_tracee_table()
+{
+    tracee_table *retval = (tracee_table *)malloc(sizeof(tracee_table));
+
+    retval->capacity = INIT_TABLE_CAPACITY;
+    retval->used = 0;
+    retval->tombstones = 0;
+    retval->table = (tracee **)calloc(retval->capacity, sizeof(tracee *));
+
+    return retval;
+}
+
+/**
+ * table_index - get the preferred hash table slot for a PID
+ * @tab: the tracee_table
+ * @pid: the PID
+ *
+ * PIDs are handed out more or less sequentially, so a multiplicative hash
+ * is enough to spread them out.
+ */
+static int table_index(tracee_table *tab, pid_t pid)
+{
+    return ((unsigned int)pid * 2654435761u) & (tab->capacity - 1);
+}
+
+/**
+ * table_insert - put a tracee in the first free slot for its PID
+ * @tab: the tracee_table
+ * @t:   the tracee
+ */
+static void table_insert(tracee_table *tab, tracee *t)
+{
+    int i = table_index(tab, t->pid);
+    while(tab->table[i] != NULL && tab->table[i] != TOMBSTONE)
+        i = (i + 1) & (tab->capacity - 1);
+
+    if(tab->table[i] == TOMBSTONE)
+        tab->tombstones--;
+
+    tab->table[i] = t;
+    t->slot = i;
+}
+
+/**
+ * table_grow - rebuild the hash table if it's getting crowded
+ * @tab: the tracee_table
+ *
+ * Short-lived processes leave a lot of tombstones behind; a rebuild drops
+ * all of them.
+ */
+static void table_grow(tracee_table *tab)
+{
+    if(2*(tab->used + tab->tombstones + 1) <= tab->capacity)
+        return;
+
+    tracee **old = tab->table;
+    int old_capacity = tab->capacity, i;
+
+    /* only double if it's actually the live entries filling things up */
+    if(4*(tab->used + 1) > tab->capacity)
+        tab->capacity *= 2;
+
+    tab->table = (tracee **)calloc(tab->capacity, sizeof(tracee *));
+    tab->tombstones = 0;
+
+    for(i = 0; i < old_capacity; i++)
+        if(old[i] != NULL && old[i] != TOMBSTONE)
+            table_insert(tab, old[i]);
+
+    free(old);
+}
+
+/**
+ * find_tracee - look up the tracee with the given PID
+ * @tab: the tracee_table
+ * @pid: the PID
+ *
+ * Returns a (tracee *) pointer, or NULL if we don't know about the PID.
+ */
+tracee *find_tracee(tracee_table *tab, pid_t pid)
+{
+    int i = table_index(tab, pid);
+    while(tab->table[i] != NULL) {
+        tracee *cur = tab->table[i];
+        if(cur != TOMBSTONE && cur->pid == pid)
+            return cur;
+        i = (i + 1) & (tab->capacity - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * add_tracee - start keeping track of a process
+ * @tab: the tracee_table
+ * @pid: its PID
+ *
+ * The tracee starts out knowing nothing; see inherit_tracee.
+ *
+ * Returns a (tracee *) pointer to the new tracee.
+ */
+tracee *add_tracee(tracee_table *tab, pid_t pid)
+{
+    tracee *t = (tracee *)calloc(1, sizeof(tracee));
+    t->pid = pid;
+
+    insert_tracee(tab, t);
+
+    return t;
+}
+
+/**
+ * insert_tracee - put an existing tracee into a table
+ * @tab: the tracee_table
+ * @t:   the tracee, not in any table
+ */
+void insert_tracee(tracee_table *tab, tracee *t)
+{
+    table_grow(tab);
+    table_insert(tab, t);
+    tab->used++;
+}
+
+/**
+ * inherit_tracee - copy over what a new process gets from its parent
+ * @child:  the new tracee
+ * @parent: the tracee that forked or cloned it
+ *
+ * @thread: the child is a thread, sharing the fds and cwd of the parent
+ *
+ * The child starts out with a copy of (or shares) the parent's memory, so
+ * the parent's scratch mapping is there in the child as well.
+ */
+void inherit_tracee(tracee *child, tracee *parent, int thread)
+{
+    if(child->cwd)
+        release_cwd_state(child->cwd);
+    if(child->fds)
+        release_fd_table(child->fds);
+    if(child->scratch)
+        release_scratch_area(child->scratch);
+
+    if(thread) {
+        child->cwd = parent->cwd;
+        child->cwd->refs++;
+
+        child->fds = parent->fds;
+        child->fds->refs++;
+
+        child->scratch = parent->scratch;
+        child->scratch->refs++;
+    }
+    else {
+        /* the same directory, so the same id */
+        child->cwd = new_cwd_state(strdup(parent->cwd->path));
+        child->cwd->id = parent->cwd->id;
+
+        child->fds = copy_fd_table(parent->fds);
+
+        /* the same mapping, but the paths in it are the parent's business */
+        child->scratch = new_scratch_area();
+        child->scratch->base = parent->scratch->base;
+    }
+
+    child->inherited = 1;
+}
+
+/**
+ * unlink_tracee - take a tracee out of a table without freeing it
+ * @tab: the tracee_table
+ * @t:   the tracee
+ */
+void unlink_tracee(tracee_table *tab, tracee *t)
+{
+    tab->table[t->slot] = TOMBSTONE;
+    tab->tombstones++;
+    tab->used--;
+}
+
+/**
+ * remove_tracee - stop keeping track of a process
+ * @tab: the tracee_table
+ * @t:   the tracee
+ */
+void remove_tracee(tracee_table *tab, tracee *t)
+{
+    unlink_tracee(tab, t);
+
+    free(t->paths[0]);
+    free(t->paths[1]);
+    free(t->parked);
+    free(t->injected);
+    if(t->cwd)
+        release_cwd_state(t->cwd);
+    if(t->fds)
+        release_fd_table(t->fds);
+    if(t->scratch) {
+        /* gone in the middle of a syscall; its paths are free again */
+        if(t->rewritten)
+            t->scratch->inflight--;
+        release_scratch_area(t->scratch);
+    }
+    free(t);
+}
+
+/* ids handed out to working directories, over all the worker threads */
+static unsigned long last_cwd_id;
+
+/**
+ * new_cwd_state - creates a cwd_state for a new working directory
+ * @path: the directory, absolute and canonical; it's taken over
+ *
+ * Returns a (cwd_state *) pointer.
+ */
+cwd_state *new_cwd_state(char *path)
+{
+    cwd_state *retval = (cwd_state *)malloc(sizeof(cwd_state));
+
+    retval->path = path;
+    retval->id = __atomic_add_fetch(&last_cwd_id, 1, __ATOMIC_RELAXED);
+    retval->refs = 1;
+
+    return retval;
+}
+
+/**
+ * set_cwd - change the working directory
+ * @cwd:  the cwd_state
+ * @path: the new directory, absolute and canonical; it's taken over
+ */
+void set_cwd(cwd_state *cwd, char *path)
+{
+    free(cwd->path);
+    cwd->path = path;
+    cwd->id = __atomic_add_fetch(&last_cwd_id, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * release_cwd_state - drop a reference to a cwd_state
+ * @cwd: the cwd_state
+ */
+void release_cwd_state(cwd_state *cwd)
+{
+    if(--cwd->refs > 0)
+        return;
+
+    free(cwd->path);
+    free(cwd);
+}
+
+/**
+ * new_fd_table - creates a new, empty fd_table
+ *
+ * Returns a (fd_table *) pointer.
+ */
+fd_table *new_fd_table()
+{
+    fd_table *retval = (fd_table *)malloc(sizeof(fd_table));
+
+    retval->paths = NULL;
+    retval->size = 0;
+    retval->refs = 1;
+
+    return retval;
+}
+
+/**
+ * copy_fd_table - get a private copy of an fd_table, as fork does
+ * @tab: the fd_table
+ *
+ * Returns a (fd_table *) pointer.
+ */
+fd_table *copy_fd_table(fd_table *tab)
+{
+    fd_table *retval = new_fd_table();
+
+    retval->size = tab->size;
+    retval->paths = (char **)calloc(tab->size, sizeof(char *));
+
+    int fd;
+    for(fd = 0; fd < tab->size; fd++)
+        if(tab->paths[fd])
+            retval->paths[fd] = strdup(tab->paths[fd]);
+
+    return retval;
+}
+
+/**
+ * release_fd_table - drop a reference to an fd_table
+ * @tab: the fd_table
+ */
+void release_fd_table(fd_table *tab)
+{
+    if(--tab->refs > 0)
+        return;
+
+    int fd;
+    for(fd = 0; fd < tab->size; fd++)
+        free(tab->paths[fd]);
+
+    free(tab->paths);
+    free(tab);
+}
+
+/**
+ * fd_path - get the directory an fd refers to
+ * @tab: the fd_table
+ * @fd:  the fd
+ *
+ * Returns a (char *) pointer owned by the table, or NULL if we don't know.
+ */
+char *fd_path(fd_table *tab, int fd)
+{
+    if(fd < 0 || fd >= tab->size)
+        return NULL;
+
+    return tab->paths[fd];
+}
+
+/**
+ * set_fd_path - remember the directory an fd refers to
+ * @tab:  the fd_table
+ * @fd:   the fd
+ * @path: the directory; the table takes it over
+ */
+void set_fd_path(fd_table *tab, int fd, char *path)
+{
+    if(fd < 0) {
+        free(path);
+        return;
+    }
+
+    if(fd >= tab->size) {
+        int size = tab->size ? tab->size : 16;
+        while(size <= fd)
+            size *= 2;
+
+        tab->paths = (char **)realloc(tab->paths, size * sizeof(char *));
+        memset(tab->paths + tab->size, 0, (size - tab->size) * sizeof(char *));
+        tab->size = size;
+    }
+
+    free(tab->paths[fd]);
+    tab->paths[fd] = path;
+}
+
+/**
+ * clear_fd - forget about an fd
+ * @tab: the fd_table
+ * @fd:  the fd
+ */
+void clear_fd(fd_table *tab, int fd)
+{
+    if(fd < 0 || fd >= tab->size)
+        return;
+
+    free(tab->paths[fd]);
+    tab->paths[fd] = NULL;
+}
+
+/**
+ * unshare_fds - give a tracee its own copy of the fd_table it shares
+ * @t: the tracee
+ */
+void unshare_fds(tracee *t)
+{
+    if(t->fds->refs == 1)
+        return;
+
+    fd_table *copy = copy_fd_table(t->fds);
+    release_fd_table(t->fds);
+    t->fds = copy;
+}
+
+/**
+ * new_scratch_area - creates a scratch_area for a new address space
+ *
+ * Returns a (scratch_area *) pointer.
+ */
+scratch_area *new_scratch_area()
+{
+    scratch_area *retval = (scratch_area *)malloc(sizeof(scratch_area));
+
+    retval->base = -1;
+    retval->used = 0;
+    retval->inflight = 0;
+    retval->refs = 1;
+
+    return retval;
+}
+
+/**
+ * release_scratch_area - drop a reference to a scratch_area
+ * @s: the scratch_area
+ *
+ * The mapping itself stays in the child; it goes away with its address
+ * space.
+ */
+void release_scratch_area(scratch_area *s)
+{
+    if(--s->refs > 0)
+        return;
+
+    free(s);
+}
+
+/**
+ * scratch_alloc - get room for a path in a scratch_area
+ * @s:   the scratch_area, with its mapping made
+ * @len: bytes needed
+ *
+ * Returns the address in the child, or -1 if the area is full.
+ */
+long scratch_alloc(scratch_area *s, size_t len)
+{
+    len = (len + 7) & ~7UL; /* keep them aligned */
+    if(s->used + len > SCRATCH_SIZE)
+        return -1;
+
+    long addr = s->base + s->used;
+    s->used += len;
+    return addr;
+}
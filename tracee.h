@@ -0,0 +1,161 @@
+/**
+ * tracee.h - Per-process tracer state.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TRACEE_H
+#define _TRACEE_H
+
+#include <sys/types.h>
+#include <sys/user.h>
+
+/* Number of syscall arguments a handler can rewrite. */
+#define MAX_SYSCALL_ARGS 6
+
+/* Size of the scratch mapping; only the pages that get used cost anything. */
+#define SCRATCH_SIZE (1 << 20)
+
+/**
+ * fd_table - what the directory fds of a process refer to
+ *
+ * The *at() syscalls name files relative to a directory fd, so we keep
+ * track of the directories the child opens rather than asking /proc each
+ * time.  Threads share one of these, just like they share their fds.
+ */
+typedef struct {
+    char **paths; /* indexed by fd, NULL if it's not a directory we know */
+    int size;
+    int refs;
+} fd_table;
+
+/**
+ * cwd_state - the working directory of a process
+ *
+ * Threads share this, like they share their fds.  Every change of
+ * directory gets a new id, so an id always stands for the same path.
+ */
+typedef struct {
+    char *path; /* absolute and canonical */
+    unsigned long id;
+    int refs;
+} cwd_state;
+
+/**
+ * scratch_area - memory in the child where rewritten paths go
+ *
+ * We map this into the child ourselves, once per address space, so that
+ * nothing of the child's own gets overwritten.  Threads share one, just like
+ * they share their memory.  Paths are handed out with a bump pointer that
+ * goes back to the start once no syscall is using any of them.
+ */
+typedef struct {
+    long base;    /* -1 until the mapping has been made */
+    size_t used;  /* the bump pointer */
+    int inflight; /* syscalls that have paths in here */
+    int refs;
+} scratch_area;
+
+typedef struct {
+    pid_t pid;
+
+    /* A new process can only run once we've seen both its initial stop
+       and its parent's fork event, whichever comes first. */
+    int started, inherited;
+
+    /* set once the process has been assigned to a worker thread */
+    int placed;
+
+    /* registers to put back once the worker it was handed to has it */
+    struct user_regs_struct *parked;
+
+    /* syscall in progress: set at the entry stop, cleared at the exit stop */
+    int in_syscall;
+    int syscall;
+
+    /* the entry handler wants to see the exit of the syscall */
+    int need_exit;
+
+    /* arguments we rewrote at the entry (bit n set for argument n) and
+       their original values, to be put back at the exit */
+    int rewritten;
+    long orig_args[MAX_SYSCALL_ARGS];
+
+    /* paths read at the entry that the exit handler needs */
+    char *paths[2];
+
+    /* where we write rewritten paths into the tracee; NULL until inherited */
+    scratch_area *scratch;
+
+    /* registers of the syscall an injected mmap is standing in for, NULL
+       unless there's one in progress */
+    struct user_regs_struct *injected;
+
+    /* current working directory; NULL until inherited */
+    cwd_state *cwd;
+
+    /* its directory fds; NULL until inherited */
+    fd_table *fds;
+
+    int slot; /* position in the hash table */
+} tracee;
+
+typedef struct {
+    tracee **table;
+    int capacity, used, tombstones;
+} tracee_table;
+
+extern tracee_table *new_tracee_table();
+
+extern tracee *find_tracee(tracee_table *tab, pid_t pid);
+
+extern tracee *add_tracee(tracee_table *tab, pid_t pid);
+
+extern void insert_tracee(tracee_table *tab, tracee *t);
+
+extern void unlink_tracee(tracee_table *tab, tracee *t);
+
+extern void inherit_tracee(tracee *child, tracee *parent, int thread);
+
+extern void remove_tracee(tracee_table *tab, tracee *t);
+
+extern cwd_state *new_cwd_state(char *path);
+
+extern void set_cwd(cwd_state *cwd, char *path);
+
+extern void release_cwd_state(cwd_state *cwd);
+
+extern fd_table *new_fd_table();
+
+extern fd_table *copy_fd_table(fd_table *tab);
+
+extern void release_fd_table(fd_table *tab);
+
+extern char *fd_path(fd_table *tab, int fd);
+
+extern void set_fd_path(fd_table *tab, int fd, char *path);
+
+extern void clear_fd(fd_table *tab, int fd);
+
+extern void unshare_fds(tracee *t);
+
+extern scratch_area *new_scratch_area();
+
+extern void release_scratch_area(scratch_area *s);
+
+extern long scratch_alloc(scratch_area *s, size_t len);
+
+#endif /* _TRACEE_H */
@@ -17,258 +17,417 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* for process_vm_readv and process_vm_writev */
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <wait.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
-#include <openssl/md5.h>
+#include <sys/uio.h>
 
 #include "utils.h"
+#include "stats.h"
+
+/* Set once we learn the kernel predates PTRACE_GET_SYSCALL_INFO (5.3). */
+static int no_syscall_info = 0;
 
 /**
- * syscall_breakpoint - break at the entry or exit of a syscall
+ * load_regs - start a fresh register context for a stopped child
+ * @ctx:   the register context
  * @child: PID of the child process
  *
- * This will stop the process until called again.
+ * Nothing is fetched until it's asked for.  Call this once per stop; the
+ * context is only valid until the child is resumed.
+ */
+void load_regs(regs_ctx *ctx, pid_t child)
+{
+    ctx->pid = child;
+    ctx->have_info = 0;
+    ctx->have_regs = 0;
+    ctx->dirty = 0;
+}
+
+/**
+ * fetch_syscall_info - get the syscall number and arguments in one go
+ * @ctx: the register context
  *
- * Return 0 if the child has been stopped, 1 if it has exited.
+ * Returns 1 if ctx->info has the syscall number and arguments, 0 if the
+ * caller has to go through the full register set instead.
  */
-int syscall_breakpoint(pid_t child)
+static int fetch_syscall_info(regs_ctx *ctx)
 {
-    int status;
+    /* the registers may have been changed since */
+    if(ctx->have_regs)
+        return 0;
+
+    if(ctx->have_info)
+        return ctx->info.op == PTRACE_SYSCALL_INFO_ENTRY ||
+               ctx->info.op == PTRACE_SYSCALL_INFO_SECCOMP;
+
+    if(no_syscall_info)
+        return 0;
+
+    if(ptrace(PTRACE_GET_SYSCALL_INFO, ctx->pid,
+              sizeof(ctx->info), &ctx->info) <= 0) {
+        if(errno == EIO)
+            no_syscall_info = 1;
+        return 0;
+    }
 
-    while(1) {
-        ptrace(PTRACE_SYSCALL, child, 0, 0);
-        waitpid(child, &status, 0);
+    ctx->have_info = 1;
+    return fetch_syscall_info(ctx);
+}
 
-        if (WIFSTOPPED(status) && WSTOPSIG(status) & 0x80)
-            return 0;
-        if (WIFEXITED(status))
-            return 1;
+/**
+ * regs_ctx_regs - get the full register set of the child
+ * @ctx: the register context
+ *
+ * The registers are fetched with a single PTRACE_GETREGS the first time
+ * they're needed at this stop.
+ *
+ * Returns a pointer to the cached registers.  Changes made through it must
+ * be followed by marking the context dirty.
+ */
+struct user_regs_struct *regs_ctx_regs(regs_ctx *ctx)
+{
+    if(!ctx->have_regs) {
+        ptrace(PTRACE_GETREGS, ctx->pid, 0, &ctx->regs);
+        ctx->have_regs = 1;
     }
+
+    return &ctx->regs;
+}
+
+/**
+ * flush_regs - write the register context back to the child if modified
+ * @ctx: the register context
+ *
+ * This must be called before the child is resumed.
+ */
+void flush_regs(regs_ctx *ctx)
+{
+    if(!ctx->dirty)
+        return;
+
+    ptrace(PTRACE_SETREGS, ctx->pid, 0, &ctx->regs);
+    ctx->dirty = 0;
+}
+
+/**
+ * get_syscall_nr - get the number of the syscall the child is stopped in
+ * @ctx: the register context
+ */
+long get_syscall_nr(regs_ctx *ctx)
+{
+    if(fetch_syscall_info(ctx))
+        return ctx->info.entry.nr;
+
+    return get_reg(ctx, orig_eax);
 }
 
 /**
  * get_syscall_arg - get the nth argument of the syscall.
- * @child: PID of the child process
- * @n:     which argument (max 6 args for any syscall)
+ * @ctx: the register context
+ * @n:   which argument (max 6 args for any syscall)
  *
  * Returns the long corresponding the argument.  If this is a string, a pointer
  * to it is returned.  If n is greater than 6, -1L is returned.
  */
-long get_syscall_arg(pid_t child, int n)
+long get_syscall_arg(regs_ctx *ctx, int n)
 {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, child, 0, &regs);
+    if(n < 0 || n >= 6)
+        return -1L;
+
+    /* the seccomp variant lays out nr and args just like the entry one */
+    if(fetch_syscall_info(ctx))
+        return ctx->info.entry.args[n];
+
+    struct user_regs_struct *regs = regs_ctx_regs(ctx);
 
     switch(n) {
 #ifdef __amd64__
     /* x86_64 has {rdi, rsi, rdx, r10, r8, r9} */
-    case 0: return regs.rdi;
-    case 1: return regs.rsi;
-    case 2: return regs.rdx;
-    case 3: return regs.r10;
-    case 4: return regs.r8;
-    case 5: return regs.r9;
+    case 0: return regs->rdi;
+    case 1: return regs->rsi;
+    case 2: return regs->rdx;
+    case 3: return regs->r10;
+    case 4: return regs->r8;
+    case 5: return regs->r9;
 #else
     /* x86 has {ebx, ecx, edx, esi, edi, ebp} */
-    case 0: return regs.ebx;
-    case 1: return regs.ecx;
-    case 2: return regs.edx;
-    case 3: return regs.esi;
-    case 4: return regs.edi;
-    case 5: return regs.ebp;
+    case 0: return regs->ebx;
+    case 1: return regs->ecx;
+    case 2: return regs->edx;
+    case 3: return regs->esi;
+    case 4: return regs->edi;
+    case 5: return regs->ebp;
 #endif
     default: return -1L;
     }
 }
 
+/**
+ * get_syscall_ret - get the return value of the syscall
+ * @ctx: the register context
+ *
+ * Only meaningful at the exit of a syscall.
+ */
+long get_syscall_ret(regs_ctx *ctx)
+{
+    fetch_syscall_info(ctx);
+    if(ctx->have_info && !ctx->have_regs &&
+       ctx->info.op == PTRACE_SYSCALL_INFO_EXIT)
+        return ctx->info.exit.rval;
+
+    return get_reg(ctx, eax);
+}
+
 /**
  * set_syscall_arg - set the nth syscall argument
- * @child:  PID of the child process
+ * @ctx:    the register context
  * @n:      which argument (max 6 args for any syscall)
  * @regval: register value
+ *
+ * This only changes the context; flush_regs writes it back to the child.
  */
-void set_syscall_arg(pid_t child, int n, long regval) {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, child, 0, &regs);
+void set_syscall_arg(regs_ctx *ctx, int n, long regval) {
+    struct user_regs_struct *regs = regs_ctx_regs(ctx);
 
     switch(n) {
 #ifdef __amd64__
     /* x86_64 has {rdi, rsi, rdx, r10, r8, r9} */
-    case 0: regs.rdi = regval; break;
-    case 1: regs.rsi = regval; break;
-    case 2: regs.rdx = regval; break;
-    case 3: regs.r10 = regval; break;
-    case 4: regs.r8  = regval; break;
-    case 5: regs.r9  = regval; break;
+    case 0: regs->rdi = regval; break;
+    case 1: regs->rsi = regval; break;
+    case 2: regs->rdx = regval; break;
+    case 3: regs->r10 = regval; break;
+    case 4: regs->r8  = regval; break;
+    case 5: regs->r9  = regval; break;
 #else
     /* x86 has {ebx, ecx, edx, esi, edi, ebp} */
-    case 0: regs.ebx = regval; break;
-    case 1: regs.ecx = regval; break;
-    case 2: regs.edx = regval; break;
-    case 3: regs.esi = regval; break;
-    case 4: regs.edi = regval; break;
-    case 5: regs.ebp = regval; break;
+    case 0: regs->ebx = regval; break;
+    case 1: regs->ecx = regval; break;
+    case 2: regs->edx = regval; break;
+    case 3: regs->esi = regval; break;
+    case 4: regs->edi = regval; break;
+    case 5: regs->ebp = regval; break;
 #endif
+    default: return;
     }
 
-    ptrace(PTRACE_SETREGS, child, 0, &regs);
+    ctx->dirty = 1;
 }
 
+/* Upper bound on the number of pages a single process_vm_{readv,writev}
+   call will cover.  PATH_MAX is one page, and an unaligned path may straddle
+   two. */
+#define MAX_IOV_PAGES 2
+
 /**
- * get_string - returns the string at the given address of the child process
- * @child: PID of the child process
- * @addr:  memory address location
+ * page_size - returns the size of a page of memory
+ */
+static unsigned long page_size()
+{
+    static unsigned long size = 0;
+    if(size == 0)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+/**
+ * split_pages - describe a child memory range as one iovec per page
+ * @addr:   start of the range in the child's memory
+ * @len:    length of the range
+ * @remote: array of at least MAX_IOV_PAGES iovecs to fill
  *
- * Note: the string has to be null-terminated.
+ * process_vm_readv and process_vm_writev only do partial transfers at the
+ * granularity of iovec elements, so splitting at page boundaries lets us
+ * get everything up to an unmapped page instead of failing altogether.
  *
- * Returns a (char *) pointer.
+ * Returns the number of iovecs used.  Anything beyond MAX_IOV_PAGES pages is
+ * left out; the caller will notice the short transfer and come back for it.
  */
-char *get_string(pid_t child, unsigned long addr)
+static int split_pages(unsigned long addr, size_t len, struct iovec *remote)
 {
-    char *str = (char *)malloc(1024);
-    int alloc = 1024, copied = 0;
-    unsigned long word;
+    int count = 0;
 
-    while(1) {
-        if(copied + sizeof(word) > alloc) {  /* too big (that's what she said) */
-            alloc *= 2;
-            str = (char *)realloc(str, alloc);
-        }
-
-        word = ptrace(PTRACE_PEEKDATA, child, addr + copied);
-        if(errno) {
-            str[copied] = 0;
-            break;
-        }
-        memcpy(str + copied, &word, sizeof(word));
+    while(len > 0 && count < MAX_IOV_PAGES) {
+        size_t chunk = page_size() - addr % page_size();
+        if(chunk > len)
+            chunk = len;
 
-        /* If we've already encountered null, break and return */
-        if(memchr(&word, 0, sizeof(word)) != NULL)
-            break;
+        remote[count].iov_base = (void *)addr;
+        remote[count].iov_len = chunk;
+        count++;
 
-        copied += sizeof(word);
+        addr += chunk;
+        len -= chunk;
     }
 
-    return str;
+    return count;
 }
 
 /**
- * write_string - writes a string to the given address of the child process
- * @child:            PID of the child process
- * @addr:             memory address location
- * @str:              string to be written
- * @overwritten_size: stores the number of bytes overwritten
+ * proc_mem_io - read or write child memory through /proc/<pid>/mem
+ * @child: PID of the child process
+ * @addr:  memory address location
+ * @buf:   local buffer
+ * @len:   number of bytes
+ * @write: 1 to write @buf into the child, 0 to read into @buf
+ *
+ * This is our fallback when the process_vm_* syscalls are unavailable or
+ * refuse to touch the memory (they won't write to read-only pages, for
+ * example).
  *
- * Returns a pointer to a memory address of bytes that needs to be restored.
+ * Returns the number of bytes transferred, or -1 on failure.
  */
-void write_string(pid_t child,
-                  unsigned long addr,
-                  char *str)
+static ssize_t proc_mem_io(pid_t child,
+                           unsigned long addr,
+                           void *buf,
+                           size_t len,
+                           int write)
 {
-    int copied = 0;
-    while(1) {
-        unsigned long word;
-        memcpy(&word, str + copied, sizeof(word));
-        ptrace(PTRACE_POKETEXT, child, addr + copied, word);
+    char procfile[64];
+    sprintf(procfile, "/proc/%d/mem", child);
 
-        copied += sizeof(word);
+    int fd = open(procfile, write ? O_WRONLY : O_RDONLY);
+    if(fd < 0)
+        return -1;
 
-        if(memchr(&word, 0, sizeof(word)) != NULL)
-            break;
-    }
+    ssize_t retval;
+    if(write)
+        retval = pwrite(fd, buf, len, addr);
+    else
+        retval = pread(fd, buf, len, addr);
+
+    close(fd);
+    return retval;
 }
 
 /**
- * md5sum - return a MD5 hash of the given string
- * @str: the string
+ * read_child_mem - read a block of memory from the child process
+ * @child: PID of the child process
+ * @addr:  memory address location
+ * @buf:   buffer to copy into
+ * @len:   number of bytes to read
+ *
+ * The read stops early at the first page that isn't mapped.
  *
- * Returns a 32-character string containing the MD5 hash.  Remember to free
- * this after use.
+ * Returns the number of bytes read, or -1 if nothing could be read.
  */
-char *md5sum(char *str)
+ssize_t read_child_mem(pid_t child, unsigned long addr, void *buf, size_t len)
 {
-    char *retval = (char *)malloc(33);
-
-    unsigned char d[17];
-    MD5(str, strlen(str), d);
-
-    int i;
-    for(i = 0; i < 16; i++) {
-        unsigned char x = d[i] >> 4;
-        if(x < 10)
-            retval[2*i] = '0' + x;
-        else
-            retval[2*i] = 'a' + x - 10;
-
-        x = d[i] & 0xf;
-        if(x < 10)
-            retval[2*i+1] = '0' + x;
-        else
-            retval[2*i+1] = 'a' + x - 10;
-    }
+    struct iovec local = { buf, len }, remote[MAX_IOV_PAGES];
+    int count = split_pages(addr, len, remote);
 
-    retval[32] = 0;
+    ssize_t retval = process_vm_readv(child, &local, 1, remote, count, 0);
+    if(retval <= 0)
+        retval = proc_mem_io(child, addr, buf, len, 0);
 
     return retval;
 }
 
 /**
- * proxy_path - returns a string containing the proxy path
- * @prefix:    prefix to the MD5 sum
- * @file_path: path of the original file
+ * write_child_mem - write a block of memory to the child process
+ * @child: PID of the child process
+ * @addr:  memory address location
+ * @buf:   buffer to copy from
+ * @len:   number of bytes to write
  *
- * Returns a (char *) pointer.  Remember to free this at the end.
+ * Returns the number of bytes written, or -1 on failure.
  */
-char *proxy_path(char *prefix, char *file_path)
+ssize_t write_child_mem(pid_t child,
+                        unsigned long addr,
+                        const void *buf,
+                        size_t len)
 {
-    /* 32 for the MD5 hash, 1 for the null at the end */
-    int malloc_len = strlen(prefix) + 32 + 1;
-    char *retval = (char *)malloc(malloc_len*sizeof(char));
-    *retval = 0;
+    size_t written = 0;
+
+    while(written < len) {
+        struct iovec local = { (char *)buf + written, len - written },
+                     remote[MAX_IOV_PAGES];
+        int count = split_pages(addr + written, len - written, remote);
+
+        ssize_t n = process_vm_writev(child, &local, 1, remote, count, 0);
+        if(n <= 0) {
+            /* whatever's left goes through /proc in a single write */
+            n = proc_mem_io(child, addr + written, (char *)buf + written,
+                            len - written, 1);
+            if(n <= 0)
+                return written ? written : -1;
+        }
 
-    strcpy(retval, prefix);
-    char *md5 = md5sum(file_path);
-    strcat(retval, md5);
-    free(md5);
+        written += n;
+    }
 
-    return retval;
+    return written;
 }
 
 /**
- * get_readonly_mem - gets the starting position of the readonly memory
+ * get_string - returns the string at the given address of the child process
  * @child: PID of the child process
+ * @addr:  memory address location
  *
- * Returns a long corresponding to the starting address of the readonly
- * section of the child's memory.
+ * Note: the string has to be null-terminated.  We read up to the end of the
+ * page after the one @addr is in, so any path up to PATH_MAX long comes in
+ * with a single syscall.
+ *
+ * Returns a (char *) pointer.
  */
-long get_readonly_mem(pid_t child) {
-    char procfile[256];
-    sprintf(procfile, "/proc/%d/maps", child);
-    FILE *maps = fopen(procfile, "r");
+char *get_string(pid_t child, unsigned long addr)
+{
+    long start = STATS_START();
+    int alloc = 2*page_size() + 1, copied = 0;
+    char *str = (char *)malloc(alloc);
 
     while(1) {
-        char *buffer = NULL;
-        size_t n = 0;
-        ssize_t size = getline(&buffer, &n, maps);
-        if(size == -1) {
-            free(buffer);
-            break;
+        /* the rest of this page and all of the next one */
+        size_t want = 2*page_size() - (addr + copied) % page_size();
+        if(copied + want + 1 > alloc) {
+            alloc = copied + want + 1;
+            str = (char *)realloc(str, alloc);
         }
 
-        if(strstr(buffer, "r-xp")) {
-            long memaddr;
-            sscanf(buffer, "%lx", &memaddr);
-            return memaddr;
+        ssize_t n = read_child_mem(child, addr + copied, str + copied, want);
+        if(n <= 0) {
+            str[copied] = 0;
+            break;
         }
 
-        free(buffer);
+        /* If we've already encountered null, break and return */
+        if(memchr(str + copied, 0, n) != NULL)
+            break;
+
+        copied += n;
+
+        if(n < want) { /* ran into unmapped memory without seeing a null */
+            str[copied] = 0;
+            break;
+        }
     }
 
-    return -1;
+    STATS_STOP(TIMER_GET_STRING, start);
+    return str;
+}
+
+/**
+ * write_string - writes a string to the given address of the child process
+ * @child: PID of the child process
+ * @addr:  memory address location
+ * @str:   string to be written
+ *
+ * The terminating null is written too.
+ */
+void write_string(pid_t child,
+                  unsigned long addr,
+                  char *str)
+{
+    long start = STATS_START();
+    write_child_mem(child, addr, str, strlen(str) + 1);
+    STATS_STOP(TIMER_WRITE_STRING, start);
 }
@@ -35,25 +35,54 @@
 #define offsetof(str, field) __builtin_offsetof(str, field)
 #endif
 
-/* Return the register `reg` of `child`. */
+/**
+ * regs_ctx - the registers of a child at one syscall stop
+ *
+ * Handlers read and modify the registers through this instead of going to
+ * the kernel every time.  Everything is fetched lazily, at most once per stop,
+ * and written back once in flush_regs if anything was changed.
+ */
+typedef struct {
+    pid_t pid;
+    struct __ptrace_syscall_info info;
+    struct user_regs_struct regs;
+    int have_info, have_regs, dirty;
+} regs_ctx;
+
+/* Return the register `reg` from the context `ctx`. */
 #ifndef get_reg
-#define get_reg(child, reg) ptrace(PTRACE_PEEKUSER, \
-                                   child, \
-                                   offsetof(struct user, regs.reg))
+#define get_reg(ctx, reg) (regs_ctx_regs(ctx)->reg)
 #endif
 
+/* Set the register `reg` in the context `ctx` to `val`. */
 #ifndef set_reg
-#define set_reg(child, reg, val) ptrace(PTRACE_SETREGS, \
-                                        child, \
-                                        offsetof(struct user, regs.reg), \
-                                        val)
+#define set_reg(ctx, reg, val) (regs_ctx_regs(ctx)->reg = (val), \
+                                (ctx)->dirty = 1)
 #endif
 
-extern int syscall_breakpoint(pid_t child);
+extern void load_regs(regs_ctx *ctx, pid_t child);
+
+extern struct user_regs_struct *regs_ctx_regs(regs_ctx *ctx);
+
+extern void flush_regs(regs_ctx *ctx);
+
+extern long get_syscall_nr(regs_ctx *ctx);
 
-extern long get_syscall_arg(pid_t child, int n);
+extern long get_syscall_arg(regs_ctx *ctx, int n);
 
-extern void set_syscall_arg(pid_t child, int n, long regval);
+extern long get_syscall_ret(regs_ctx *ctx);
+
+extern void set_syscall_arg(regs_ctx *ctx, int n, long regval);
+
+extern ssize_t read_child_mem(pid_t child,
+                              unsigned long addr,
+                              void *buf,
+                              size_t len);
+
+extern ssize_t write_child_mem(pid_t child,
+                               unsigned long addr,
+                               const void *buf,
+                               size_t len);
 
 extern char *get_string(pid_t child, unsigned long addr);
 
@@ -61,10 +90,4 @@ extern void write_string(pid_t child,
                          unsigned long addr,
                          char *str);
 
-extern char *md5sum(char *str);
-
-extern char *proxy_path(char *prefix, char *file_path);
-
-extern long get_readonly_mem(pid_t child);
-
 #endif /* _UTILS_H */
@@ -0,0 +1,181 @@
+/**
+ * worker.c - Tracer worker threads.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#include "worker.h"
+
+worker *workers;
+int worker_count;
+
+/**
+ * init_workers - set up the worker structures
+ * @count: number of tracer threads
+ *
+ * The threads themselves are started by the caller; worker 0 is meant to be
+ * the thread that started the child.
+ */
+void init_workers(int count)
+{
+    worker_count = count;
+    workers = (worker *)calloc(count, sizeof(worker));
+
+    int i;
+    for(i = 0; i < count; i++) {
+        workers[i].id = i;
+        workers[i].doorbell = -1;
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+}
+
+/* the doorbell only needs to be stopped by the signal, not to act on it */
+static void doorbell_handler(int sig)
+{
+    (void)sig;
+}
+
+/**
+ * start_doorbell - create and attach the worker's doorbell process
+ * @w: the worker; this must be called from its own thread
+ *
+ * Only needed when there's more than one worker.
+ */
+void start_doorbell(worker *w)
+{
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        /* PR_SET_PDEATHSIG is tied to the thread that forked us, so the
+           doorbell goes away with its worker */
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        signal(SIGUSR1, doorbell_handler);
+        while(1)
+            pause();
+    }
+
+    ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_EXITKILL);
+    w->doorbell = pid;
+}
+
+/**
+ * stop_doorbell - get rid of the worker's doorbell process
+ * @w: the worker; this must be called from its own thread
+ */
+void stop_doorbell(worker *w)
+{
+    if(w->doorbell == -1)
+        return;
+
+    kill(w->doorbell, SIGKILL);
+    waitpid(w->doorbell, NULL, __WALL);
+    w->doorbell = -1;
+}
+
+/**
+ * ring_doorbell - wake up a worker blocked in waitpid
+ * @w: the worker
+ */
+void ring_doorbell(worker *w)
+{
+    if(w->doorbell != -1)
+        kill(w->doorbell, SIGUSR1);
+}
+
+/**
+ * pick_worker - choose the worker a new process should go to
+ * @self: the worker asking
+ *
+ * Returns the least loaded worker, preferring @self on a tie since keeping
+ * a process saves us the handoff.
+ */
+worker *pick_worker(worker *self)
+{
+    worker *best = self;
+    long best_load = __atomic_load_n(&self->load, __ATOMIC_RELAXED);
+
+    int i;
+    for(i = 0; i < worker_count; i++) {
+        long load = __atomic_load_n(&workers[i].load, __ATOMIC_RELAXED);
+        if(load < best_load) {
+            best = &workers[i];
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * hand_off - give a process to another worker
+ * @w: the worker to give it to
+ * @t: the process; it must already be detached
+ */
+void hand_off(worker *w, tracee *t)
+{
+    handoff *h = (handoff *)malloc(sizeof(handoff));
+    h->t = t;
+
+    __atomic_add_fetch(&w->load, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&w->lock);
+    h->next = w->queue;
+    w->queue = h;
+    pthread_mutex_unlock(&w->lock);
+
+    ring_doorbell(w);
+}
+
+/**
+ * take_handoff - get the next process handed to this worker
+ * @w: the worker
+ *
+ * Returns a (tracee *) pointer, or NULL if the queue is empty.
+ */
+tracee *take_handoff(worker *w)
+{
+    pthread_mutex_lock(&w->lock);
+    handoff *h = w->queue;
+    if(h)
+        w->queue = h->next;
+    pthread_mutex_unlock(&w->lock);
+
+    if(!h)
+        return NULL;
+
+    tracee *t = h->t;
+    free(h);
+    return t;
+}
+
+/**
+ * quit_workers - tell every worker to stop once it's out of processes
+ */
+void quit_workers()
+{
+    int i;
+    for(i = 0; i < worker_count; i++) {
+        __atomic_store_n(&workers[i].quit, 1, __ATOMIC_RELEASE);
+        ring_doorbell(&workers[i]);
+    }
+}
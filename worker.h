@@ -0,0 +1,74 @@
+/**
+ * worker.h - Tracer worker threads.  Part of the FSSB project.
+ *
+ * Copyright (C) 2016 Adhityaa Chandrasekar
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "tracee.h"
+
+typedef struct handoff {
+    tracee *t;
+    struct handoff *next;
+} handoff;
+
+/**
+ * worker - a tracer thread and the processes it owns
+ *
+ * ptrace only lets the thread that attached to a process control it, so a
+ * process stays with one worker from the moment it's placed.  Processes are
+ * handed to another worker through its queue.  Since a worker spends its
+ * time blocked in waitpid, it also traces an idle doorbell process; sending
+ * that a signal produces a stop the worker is guaranteed to wake up for.
+ */
+typedef struct {
+    pthread_t thread;
+    int id;
+
+    pid_t doorbell;
+
+    pthread_mutex_t lock;
+    handoff *queue;
+    int quit;
+
+    long load; /* number of processes owned or on their way */
+} worker;
+
+extern worker *workers;
+extern int worker_count;
+
+extern void init_workers(int count);
+
+extern void start_doorbell(worker *w);
+
+extern void stop_doorbell(worker *w);
+
+extern void ring_doorbell(worker *w);
+
+extern worker *pick_worker(worker *self);
+
+extern void hand_off(worker *w, tracee *t);
+
+extern tracee *take_handoff(worker *w);
+
+extern void quit_workers();
+
+#endif /* _WORKER_H */